@@ -87,9 +87,64 @@ else
   version = "BizHawk"
 end
 local name = "Unnamed"
+-- Protocol 2 is negotiated with the Version command, it uses binary frames for reads and writes
+local protocol = 1
+local buffer = ""
+
+-- A frame is the marker byte, an opcode byte, the payload size on 4 bytes (big endian) then the payload
+-- "R" payload : ranges of domain (1 byte), address (4 bytes), size (4 bytes), answered by a "r" frame with all the data
+-- "W" payload : ranges of domain (1 byte), address (4 bytes), size (4 bytes) followed by the data, no answer
+local FRAME_MARKER = 2
+local domains = { [0] = "System Bus", [1] = "WRAM", [2] = "CARTROM", [3] = "CARTRAM" }
+local unpack = unpack or table.unpack
 
 memory.usememorydomain("System Bus")
 
+local function readU32(s, pos)
+    local b1, b2, b3, b4 = string.byte(s, pos, pos + 3)
+    return ((b1 * 256 + b2) * 256 + b3) * 256 + b4
+end
+
+local function u32(v)
+    return string.char(math.floor(v / 16777216) % 256, math.floor(v / 65536) % 256, math.floor(v / 256) % 256, v % 256)
+end
+
+-- string.char can't take a whole memory range at once
+local function bytesToString(bytes)
+    local chunks = {}
+    for i = 1, #bytes, 4096 do
+        chunks[#chunks + 1] = string.char(unpack(bytes, i, math.min(i + 4095, #bytes)))
+    end
+    return table.concat(chunks)
+end
+
+local function onFrame(opcode, payload)
+    local pos = 1
+    if opcode == "R" then
+        local datas = {}
+        while pos + 8 <= #payload do
+            local domain = domains[string.byte(payload, pos)]
+            local adr = readU32(payload, pos + 1)
+            local length = readU32(payload, pos + 5)
+            pos = pos + 9
+            datas[#datas + 1] = bytesToString(readbyterange(adr, length, domain))
+        end
+        local data = table.concat(datas)
+        connection:send(string.char(FRAME_MARKER) .. "r" .. u32(#data) .. data)
+    elseif opcode == "W" then
+        while pos + 8 <= #payload do
+            local domain = domains[string.byte(payload, pos)]
+            local adr = readU32(payload, pos + 1)
+            local length = readU32(payload, pos + 5)
+            pos = pos + 9
+            for i = 0, length - 1 do
+                writebyte(adr + i, string.byte(payload, pos + i), domain)
+            end
+            pos = pos + length
+        end
+    end
+end
+
 local function onMessage(s)
     local parts = {}
     for part in string.gmatch(s, '([^|]+)') do
@@ -127,7 +182,37 @@ local function onMessage(s)
         print("Lua script stopped, to restart the script press \"Restart\"")
         stopped = true
     elseif parts[1] == "Version" then
-        connection:send("Version|Multitroid LUA|" .. version .. "|\n")
+        if parts[2] == "2" then
+            protocol = 2
+            print("Using binary protocol " .. protocol)
+            connection:send("Version|Multitroid LUA|" .. version .. "|2|\n")
+        else
+            connection:send("Version|Multitroid LUA|" .. version .. "|\n")
+        end
+    end
+end
+
+-- Text commands end with a new line, binary frames start with FRAME_MARKER
+local function processBuffer()
+    while #buffer > 0 and not stopped do
+        if string.byte(buffer, 1) == FRAME_MARKER then
+            if #buffer < 6 then
+                return
+            end
+            local size = readU32(buffer, 3)
+            if #buffer < 6 + size then
+                return
+            end
+            onFrame(string.sub(buffer, 2, 2), string.sub(buffer, 7, 6 + size))
+            buffer = string.sub(buffer, 7 + size)
+        else
+            local eol = string.find(buffer, "\n", 1, true)
+            if not eol then
+                return
+            end
+            onMessage(string.sub(buffer, 1, eol - 1))
+            buffer = string.sub(buffer, eol + 1)
+        end
     end
 end
 
@@ -157,12 +242,18 @@ local main = function()
 
         connection:settimeout(0)
         connected = true
+        protocol = 1
+        buffer = ""
         print('Connected to QUsb2Snes')
         return
     end
-    local s, status = connection:receive('*l')
-    if s then
-        onMessage(s)
+    -- QUsb2Snes can send several commands at once (multi address read/write),
+    -- handle everything pending instead of one command per frame
+    local s, status, partial = connection:receive(65536)
+    local data = s or partial
+    if data and #data > 0 then
+        buffer = buffer .. data
+        processBuffer()
     end
     if status == 'closed' then
         print('Connection to QUsb2Snes is closed')
@@ -53,19 +53,28 @@ equals(QUSB2SNES_NOGUI, 1) {
 include($$PWD/devices/EmuNWAccess-qt/EmuNWAccess-qt.pri)
 
 SOURCES += adevice.cpp \
+          checkfilejob.cpp \
+          deviceatomicjob.cpp \
+          devicebenchmark.cpp \
           devicefactory.cpp \
+          deviceinfojob.cpp \
+          devicejob.cpp \
+          devicememoryjob.cpp \
           devices/sd2snesfactory.cpp \
           devices/snesclassicfactory.cpp \
-          ipsparse.cpp \
+          patchengine.cpp \
+          patchjob.cpp \
           devices/deviceerror.cpp \
           devices/luabridge.cpp \
           devices/luabridgedevice.cpp \
           devices/retroarchdevice.cpp \
           devices/retroarchfactory.cpp \
           devices/retroarchhost.cpp \
+          devices/retroarchhex.cpp \
           devices/emunetworkaccessfactory.cpp \
           devices/emunetworkaccessdevice.cpp \
           main.cpp \
+          rommapping/addressmapper.cpp \
           rommapping/mapping_hirom.c \
           rommapping/mapping_lorom.c \
           rommapping/rommapping.c \
@@ -73,30 +82,58 @@ SOURCES += adevice.cpp \
           devices/sd2snesdevice.cpp \
           devices/snesclassic.cpp \
           localstorage.cpp \
+          memorywatcher.cpp \
+          nwaserver.cpp \
+          putfilemanifest.cpp \
           wsserver.cpp \
           wsservercommands.cpp
 
 HEADERS += adevice.h \
+          checkfilejob.h \
+          deviceatomicjob.h \
+          devicebenchmark.h \
           devicefactory.h \
+          deviceinfojob.h \
+          devicejob.h \
+          devicememoryjob.h \
           devices/deviceerror.h \
           devices/sd2snesfactory.h \
           devices/snesclassicfactory.h \
           devices/retroarchfactory.h \
-          ipsparse.h \
+          patchengine.h \
+          patchjob.h \
           devices/luabridge.h \
           devices/luabridgedevice.h \
           devices/retroarchdevice.h \
           devices/retroarchhost.h \
+          devices/retroarchhex.h \
           devices/emunetworkaccessfactory.h \
           devices/emunetworkaccessdevice.h \
+          rommapping/addressmapper.h \
           rommapping/rommapping.h \
           rommapping/rominfo.h \
           devices/sd2snesdevice.h \
           devices/snesclassic.h \
           localstorage.h \
+          memorywatcher.h \
+          nwaserver.h \
+          putfilemanifest.h \
           usb2snes.h \
           wsserver.h
 
+# Lua scripts sent by the clients, needs the Lua (5.3 or newer) development files
+equals(QUSB2SNES_SCRIPTING, 1) {
+    message("building QUsb2Snes with scripting")
+    DEFINES += "QUSB2SNES_SCRIPTING=1"
+    isEmpty(LUA_PKGCONFIG): LUA_PKGCONFIG = lua5.4
+    CONFIG += link_pkgconfig
+    PKGCONFIG += $$LUA_PKGCONFIG
+    SOURCES += devicescript.cpp \
+               scriptjob.cpp
+    HEADERS += devicescript.h \
+               scriptjob.h
+}
+
 macx: {
         message("MAC OS BUILD")
 	SOURCES += osx/appnap.mm
@@ -20,11 +20,14 @@
 
 #include "adevice.h"
 
+#include <QElapsedTimer>
 #include <QMetaEnum>
 
 ADevice::ADevice(QObject *parent) : QObject(parent)
 {
     m_attachError = "This device does not provide attach errors";
+    m_commandTime = 0;
+    m_dataTime = 0;
 }
 
 bool ADevice::hasVariaditeCommands()
@@ -32,6 +35,27 @@ bool ADevice::hasVariaditeCommands()
     return false;
 }
 
+/*
+ * Devices that can push a memory region on their own (like the sd2snes STREAM command)
+ * reimplement these. The server falls back on polling with regular get for the others.
+ */
+
+bool ADevice::hasStreamCommands()
+{
+    return false;
+}
+
+void ADevice::streamCommand(SD2Snes::space space, unsigned int addr, unsigned int size)
+{
+    Q_UNUSED(space)
+    Q_UNUSED(addr)
+    Q_UNUSED(size)
+}
+
+void ADevice::stopStreamCommand()
+{
+}
+
 bool ADevice::deleteOnClose()
 {
     return false;
@@ -47,6 +71,50 @@ QString ADevice::attachError() const
     return m_attachError;
 }
 
+/*
+ * Timestamps are in microseconds on a monotonic clock shared by all devices.
+ * Devices mark when they send a command and when the first data of its reply arrive,
+ * the time the value was sampled is somewhere in between.
+ */
+
+qint64 ADevice::monotonicTime()
+{
+    static QElapsedTimer clock;
+    if (!clock.isValid())
+        clock.start();
+    return clock.nsecsElapsed() / 1000;
+}
+
+qint64 ADevice::lastCommandTime() const
+{
+    return m_commandTime;
+}
+
+qint64 ADevice::lastDataTime() const
+{
+    return m_dataTime;
+}
+
+qint64 ADevice::sampleTimeEstimate() const
+{
+    if (m_dataTime < m_commandTime)
+        return m_commandTime;
+    return m_commandTime + (m_dataTime - m_commandTime) / 2;
+}
+
+void ADevice::markCommandSent()
+{
+    m_commandTime = monotonicTime();
+}
+
+// Only the first data after a command matter
+void ADevice::markDataReceived(qint64 time)
+{
+    if (m_dataTime >= m_commandTime)
+        return ;
+    m_dataTime = time == -1 ? monotonicTime() : time;
+}
+
 QString ADevice::getFlagString(USB2SnesWS::extra_info_flags flag)
 {
     static QMetaEnum me = USB2SnesWS::staticMetaObject.enumerator(USB2SnesWS::staticMetaObject.indexOfEnumerator("extra_info_flags"));
@@ -59,6 +59,9 @@ public:
     virtual bool            hasFileCommands() = 0;
     virtual bool            hasControlCommands() = 0;
     virtual bool            hasVariaditeCommands();
+    virtual bool            hasStreamCommands();
+    virtual void            streamCommand(SD2Snes::space space, unsigned int addr, unsigned int size);
+    virtual void            stopStreamCommand();
     virtual bool            deleteOnClose();
 
     virtual USB2SnesInfo    parseInfo(const QByteArray &data) = 0;
@@ -66,12 +69,18 @@ public:
     QByteArray      dataRead;
     State           state() const;
     QString         attachError() const;
+    qint64          lastCommandTime() const;
+    qint64          lastDataTime() const;
+    qint64          sampleTimeEstimate() const;
+
+    static qint64   monotonicTime();
 
 signals:
     void            commandFinished();
     void            protocolError();
     void            closed();
     void            getDataReceived(QByteArray data);
+    void            streamDataReceived(QByteArray data);
     void            sizeGet(unsigned int);
 
 public slots:
@@ -81,6 +90,11 @@ public slots:
 protected:
     State   m_state;
     QString m_attachError;
+    qint64  m_commandTime;
+    qint64  m_dataTime;
+
+    void    markCommandSent();
+    void    markDataReceived(qint64 time = -1);
 
     QString getFlagString(USB2SnesWS::extra_info_flags flag);
 };
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <QDir>
+#include <QFileInfo>
+#include <QLoggingCategory>
+#include "checkfilejob.h"
+
+Q_LOGGING_CATEGORY(log_checkfilejob, "CheckFileJob")
+#define sDebug() qCDebug(log_checkfilejob)
+
+CheckFileJob::CheckFileJob(const QString& path, quint64 size, const QByteArray& sha256, QObject *parent)
+    : DeviceJob(parent), hash(QCryptographicHash::Sha256)
+{
+    this->path = QDir::cleanPath("/" + path);
+    expectedSize = size;
+    expectedSha256 = sha256;
+    step = ListDir;
+    sizeMatch = false;
+    received = 0;
+    timeoutTimer.setSingleShot(true);
+    timeoutTimer.setInterval(5000);
+    connect(&timeoutTimer, &QTimer::timeout, this, &CheckFileJob::onTimeout);
+}
+
+void CheckFileJob::start(ADevice *device)
+{
+    m_device = device;
+    connect(device, &ADevice::commandFinished, this, &CheckFileJob::onDeviceCommandFinished);
+    connect(device, &ADevice::protocolError, this, &CheckFileJob::onDeviceProtocolError);
+    connect(device, &ADevice::sizeGet, this, &CheckFileJob::onDeviceSizeGet);
+    connect(device, &ADevice::getDataReceived, this, &CheckFileJob::onDeviceGetDataReceived);
+    // finished/failed must not be emitted while the server is still starting the job
+    QTimer::singleShot(0, this, &CheckFileJob::startOperation);
+}
+
+void CheckFileJob::abort()
+{
+    timeoutTimer.stop();
+    DeviceJob::abort();
+}
+
+void CheckFileJob::startOperation()
+{
+    if (m_device == nullptr)
+        return ;
+    timeoutTimer.start();
+    if (step == ListDir)
+    {
+        m_device->fileCommand(SD2Snes::opcode::LS, QFileInfo(path).path().toLatin1());
+    } else {
+        sizeMatch = false;
+        received = 0;
+        hash.reset();
+        m_device->fileCommand(SD2Snes::opcode::GET, path.toLatin1());
+    }
+}
+
+void CheckFileJob::onDeviceCommandFinished()
+{
+    timeoutTimer.stop();
+    if (step == ListDir)
+    {
+        QString fileName = QFileInfo(path).fileName();
+        bool found = false;
+        for (const ADevice::FileInfos& fi : m_device->parseLSCommand(m_device->dataRead))
+        {
+            if (fi.type == SD2Snes::file_type::FILE && fi.name == fileName)
+                found = true;
+        }
+        if (!found)
+        {
+            done(false);
+            return ;
+        }
+        step = ReadFile;
+        // The device can finish a command while we are still starting it
+        QTimer::singleShot(0, this, &CheckFileJob::startOperation);
+        return ;
+    }
+    done(sizeMatch && received == expectedSize && hash.result() == expectedSha256);
+}
+
+// The whole file is still sent by the device when the size is wrong, it's just not hashed
+
+void CheckFileJob::onDeviceSizeGet(unsigned int size)
+{
+    sizeMatch = size == expectedSize;
+}
+
+void CheckFileJob::onDeviceGetDataReceived(QByteArray data)
+{
+    if (step != ReadFile)
+        return ;
+    timeoutTimer.start();
+    received += static_cast<quint64>(data.size());
+    if (sizeMatch)
+        hash.addData(data);
+}
+
+void CheckFileJob::onDeviceProtocolError()
+{
+    timeoutTimer.stop();
+    fail("CheckFile: device error");
+}
+
+void CheckFileJob::onTimeout()
+{
+    fail("CheckFile: the device did not answer in time");
+}
+
+void CheckFileJob::done(bool match)
+{
+    sDebug() << path << (match ? "is" : "is not") << "the file of the manifest";
+    m_results = QStringList() << (match ? "Match" : "Mismatch");
+    finish();
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CHECKFILEJOB_H
+#define CHECKFILEJOB_H
+
+#include <QCryptographicHash>
+#include <QTimer>
+#include "devicejob.h"
+
+/*
+ * Make sure a file the manifest knows is still the same on the device :
+ * it's looked for in its directory then read back to compare its size and sha256.
+ * The result is Match or Mismatch.
+ */
+
+class CheckFileJob : public DeviceJob
+{
+    Q_OBJECT
+public:
+    CheckFileJob(const QString& path, quint64 size, const QByteArray& sha256, QObject *parent = nullptr);
+    void    start(ADevice* device);
+    void    abort();
+
+private slots:
+    void    onDeviceCommandFinished();
+    void    onDeviceProtocolError();
+    void    onDeviceSizeGet(unsigned int size);
+    void    onDeviceGetDataReceived(QByteArray data);
+    void    onTimeout();
+    void    startOperation();
+
+private:
+    enum Step {
+        ListDir,
+        ReadFile
+    };
+
+    QString             path;
+    quint64             expectedSize;
+    QByteArray          expectedSha256;
+    Step                step;
+    bool                sizeMatch;
+    quint64             received;
+    QCryptographicHash  hash;
+    QTimer              timeoutTimer;
+
+    void    done(bool match);
+};
+
+#endif // CHECKFILEJOB_H
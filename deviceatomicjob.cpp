@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <QLoggingCategory>
+#include "deviceatomicjob.h"
+
+Q_LOGGING_CATEGORY(log_devatomicjob, "DeviceAtomicJob")
+#define sDebug() qCDebug(log_devatomicjob)
+
+DeviceAtomicJob::DeviceAtomicJob(QObject *parent) : DeviceJob(parent)
+{
+    operation = ADD;
+    space = SD2Snes::space::SNES;
+    address = 0;
+    size = 1;
+    value = 0;
+    expected = 0;
+    writing = false;
+    timeoutTimer.setSingleShot(true);
+    timeoutTimer.setInterval(5000);
+    connect(&timeoutTimer, &QTimer::timeout, this, &DeviceAtomicJob::onTimeout);
+}
+
+void DeviceAtomicJob::setOperation(DeviceAtomicJob::Operation operation, SD2Snes::space space, unsigned int address,
+                                   unsigned int size, quint32 value, quint32 expected)
+{
+    this->operation = operation;
+    this->space = space;
+    this->address = address;
+    this->size = size;
+    this->value = value;
+    this->expected = expected;
+}
+
+void DeviceAtomicJob::start(ADevice *device)
+{
+    m_device = device;
+    connect(device, &ADevice::getDataReceived, this, &DeviceAtomicJob::onDeviceGetDataReceived);
+    connect(device, &ADevice::commandFinished, this, &DeviceAtomicJob::onDeviceCommandFinished);
+    connect(device, &ADevice::protocolError, this, &DeviceAtomicJob::onDeviceProtocolError);
+    writing = false;
+    readData.clear();
+    // finished/failed must not be emitted while the server is still starting the job
+    QTimer::singleShot(0, this, &DeviceAtomicJob::startOperation);
+}
+
+void DeviceAtomicJob::abort()
+{
+    timeoutTimer.stop();
+    DeviceJob::abort();
+}
+
+void DeviceAtomicJob::startOperation()
+{
+    if (m_device == nullptr)
+        return ;
+    timeoutTimer.start();
+    m_device->getAddrCommand(space, address, size);
+}
+
+void DeviceAtomicJob::onDeviceGetDataReceived(QByteArray data)
+{
+    if (!writing)
+        readData.append(data);
+}
+
+void DeviceAtomicJob::onDeviceCommandFinished()
+{
+    timeoutTimer.stop();
+    if (writing)
+    {
+        finish();
+        return ;
+    }
+    if (static_cast<unsigned int>(readData.size()) != size)
+    {
+        fail(QString("Atomic: got %1 bytes instead of %2").arg(readData.size()).arg(size));
+        return ;
+    }
+    quint32 old = 0;
+    for (unsigned int i = 0; i < size; i++)
+        old |= static_cast<quint32>(static_cast<quint8>(readData.at(static_cast<int>(i)))) << (i * 8);
+    quint32 mask = size == 4 ? 0xFFFFFFFF : (1u << (size * 8)) - 1;
+    quint32 newValue = old;
+    switch (operation)
+    {
+    case ADD:
+        newValue = (old + value) & mask;
+        break;
+    case OR:
+        newValue = old | value;
+        break;
+    case AND:
+        newValue = old & value;
+        break;
+    case XOR:
+        newValue = old ^ value;
+        break;
+    case COMPARE_AND_SWAP:
+        if (old == expected)
+            newValue = value;
+        break;
+    }
+    m_results = QStringList() << QString::number(old, 16);
+    sDebug() << "Atomic" << operation << "at" << QString::number(address, 16) << ":" << old << "->" << newValue;
+    if (newValue == old)
+    {
+        finish();
+        return ;
+    }
+    value = newValue;
+    writing = true;
+    // The device can finish a command while we are still starting it
+    QTimer::singleShot(0, this, &DeviceAtomicJob::writeValue);
+}
+
+void DeviceAtomicJob::writeValue()
+{
+    if (m_device == nullptr)
+        return ;
+    QByteArray data(static_cast<int>(size), 0);
+    for (unsigned int i = 0; i < size; i++)
+        data[static_cast<int>(i)] = static_cast<char>((value >> (i * 8)) & 0xFF);
+    timeoutTimer.start();
+    m_device->putAddrCommand(space, address, size);
+    m_device->writeData(data);
+}
+
+void DeviceAtomicJob::onDeviceProtocolError()
+{
+    timeoutTimer.stop();
+    fail("Atomic: device error");
+}
+
+void DeviceAtomicJob::onTimeout()
+{
+    fail("Atomic: the device did not answer in time");
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef DEVICEATOMICJOB_H
+#define DEVICEATOMICJOB_H
+
+#include <QTimer>
+#include "devicejob.h"
+
+/*
+ * Read-modify-write of a 1, 2 or 4 bytes little endian value.
+ * Being a job, no other request of the device queue can go between the read and the write,
+ * the game still runs so this only protects from the other clients.
+ * The result is the old value, in hex. Nothing is written if the value does not change.
+ */
+
+class DeviceAtomicJob : public DeviceJob
+{
+    Q_OBJECT
+public:
+    enum Operation {
+        ADD,
+        OR,
+        AND,
+        XOR,
+        COMPARE_AND_SWAP // write value if the old one is expected
+    };
+
+    explicit DeviceAtomicJob(QObject *parent = nullptr);
+    void    setOperation(Operation operation, SD2Snes::space space, unsigned int address, unsigned int size,
+                         quint32 value, quint32 expected = 0);
+    void    start(ADevice* device);
+    void    abort();
+
+private slots:
+    void    onDeviceGetDataReceived(QByteArray data);
+    void    onDeviceCommandFinished();
+    void    onDeviceProtocolError();
+    void    onTimeout();
+    void    startOperation();
+    void    writeValue();
+
+private:
+    Operation       operation;
+    SD2Snes::space  space;
+    unsigned int    address;
+    unsigned int    size;
+    quint32         value;
+    quint32         expected;
+    bool            writing;
+    QByteArray      readData;
+    QTimer          timeoutTimer;
+};
+
+#endif // DEVICEATOMICJOB_H
@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <QLoggingCategory>
+#include <algorithm>
+#include "devicebenchmark.h"
+
+Q_LOGGING_CATEGORY(log_devbench, "Benchmark")
+#define sDebug() qCDebug(log_devbench)
+#define sInfo() qCInfo(log_devbench)
+
+static const int            smallReadCount = 50;
+static const int            vgetBatchCount = 50;
+static const unsigned int   smallReadSize = 2;
+static const unsigned int   bulkReadSize = 0x8000;
+static const unsigned int   wramStart = 0xF50000;
+
+DeviceBenchmark::DeviceBenchmark(QObject *parent) : DeviceJob(parent)
+{
+    // No write without a scratch area given by the client, the game owns its memory
+    scratchAddress = 0;
+    scratchSize = 0;
+    step = SmallRead;
+    stepCount = 0;
+    opStart = 0;
+    timeoutTimer.setSingleShot(true);
+    timeoutTimer.setInterval(5000);
+    connect(&timeoutTimer, &QTimer::timeout, this, &DeviceBenchmark::onTimeout);
+    const QStringList names = QStringList() << "SmallRead" << "VGetBatch" << "BulkRead" << "BulkWrite";
+    for (const QString& name : names)
+    {
+        Pattern p;
+        p.name = name;
+        p.bytes = 0;
+        patterns.append(p);
+    }
+}
+
+void DeviceBenchmark::setScratchArea(unsigned int address, unsigned int size)
+{
+    scratchAddress = address;
+    scratchSize = size;
+}
+
+void DeviceBenchmark::start(ADevice *device)
+{
+    m_device = device;
+    connect(device, &ADevice::getDataReceived, this, &DeviceBenchmark::onDeviceGetDataReceived);
+    connect(device, &ADevice::commandFinished, this, &DeviceBenchmark::onDeviceCommandFinished);
+    connect(device, &ADevice::protocolError, this, &DeviceBenchmark::onDeviceProtocolError);
+    sInfo() << "Starting benchmark on" << device->name();
+    step = SmallRead;
+    stepCount = 0;
+    // finished/failed must not be emitted while the server is still starting the job
+    QTimer::singleShot(0, this, &DeviceBenchmark::startOperation);
+}
+
+void DeviceBenchmark::abort()
+{
+    timeoutTimer.stop();
+    DeviceJob::abort();
+}
+
+int DeviceBenchmark::patternIndex(DeviceBenchmark::Step step) const
+{
+    switch (step)
+    {
+    case SmallRead:
+        return 0;
+    case VGetBatch:
+        return 1;
+    case BulkRead:
+        return 2;
+    case BulkWrite:
+        return 3;
+    default:
+        return -1;
+    }
+}
+
+void DeviceBenchmark::startOperation()
+{
+    if (m_device == nullptr)
+        return ;
+    readData.clear();
+    timeoutTimer.start();
+    opStart = ADevice::monotonicTime();
+    switch (step)
+    {
+    case SmallRead:
+    {
+        m_device->getAddrCommand(SD2Snes::space::SNES, wramStart + static_cast<unsigned int>(stepCount) * 0x10, smallReadSize);
+        break;
+    }
+    case VGetBatch:
+    {
+        QList<QPair<unsigned int, quint8> > args;
+        for (unsigned int i = 0; i < 4; i++)
+            args.append(QPair<unsigned int, quint8>(wramStart + i * 0x100, 16));
+        m_device->getAddrCommand(SD2Snes::space::SNES, args);
+        break;
+    }
+    case BulkRead:
+    {
+        m_device->getAddrCommand(SD2Snes::space::SNES, wramStart, bulkReadSize);
+        break;
+    }
+    case ScratchRead:
+    {
+        m_device->getAddrCommand(SD2Snes::space::SNES, scratchAddress, scratchSize);
+        break;
+    }
+    case BulkWrite:
+    {
+        m_device->putAddrCommand(SD2Snes::space::SNES, scratchAddress, scratchSize);
+        m_device->writeData(scratchData);
+        break;
+    }
+    case Done:
+        break;
+    }
+}
+
+void DeviceBenchmark::onDeviceGetDataReceived(QByteArray data)
+{
+    readData.append(data);
+}
+
+void DeviceBenchmark::onDeviceCommandFinished()
+{
+    timeoutTimer.stop();
+    qint64 rtt = ADevice::monotonicTime() - opStart;
+    int index = patternIndex(step);
+    if (index != -1)
+    {
+        patterns[index].rtts.append(rtt);
+        patterns[index].bytes += step == BulkWrite ? scratchData.size() : readData.size();
+    }
+    stepCount++;
+    switch (step)
+    {
+    case SmallRead:
+    {
+        if (stepCount == smallReadCount)
+        {
+            step = m_device->hasVariaditeCommands() ? VGetBatch : BulkRead;
+            stepCount = 0;
+        }
+        break;
+    }
+    case VGetBatch:
+    {
+        if (stepCount == vgetBatchCount)
+        {
+            step = BulkRead;
+            stepCount = 0;
+        }
+        break;
+    }
+    case BulkRead:
+    {
+        if (scratchSize == 0)
+        {
+            step = Done;
+            makeResults();
+            sInfo() << "Benchmark done" << m_results;
+            finish();
+            return ;
+        }
+        step = ScratchRead;
+        break;
+    }
+    case ScratchRead:
+    {
+        if (readData.size() != static_cast<int>(scratchSize))
+        {
+            fail(QString("Benchmark: could not read the scratch area, got %1 bytes").arg(readData.size()));
+            return ;
+        }
+        scratchData = readData;
+        step = BulkWrite;
+        break;
+    }
+    case BulkWrite:
+    {
+        step = Done;
+        makeResults();
+        sInfo() << "Benchmark done" << m_results;
+        finish();
+        return ;
+    }
+    case Done:
+        return ;
+    }
+    // The device can finish a command while we are still starting it
+    QTimer::singleShot(0, this, &DeviceBenchmark::startOperation);
+}
+
+void DeviceBenchmark::onDeviceProtocolError()
+{
+    timeoutTimer.stop();
+    fail("Benchmark: device error");
+}
+
+void DeviceBenchmark::onTimeout()
+{
+    fail("Benchmark: the device did not answer in time");
+}
+
+static qint64   percentile(const QList<qint64>& sorted, int p)
+{
+    if (sorted.isEmpty())
+        return 0;
+    int index = (sorted.size() * p + 99) / 100 - 1;
+    return sorted.at(qBound(0, index, sorted.size() - 1));
+}
+
+/*
+ * For each pattern : name, count, p50, p90, p99, max (in microseconds) and bytes per second
+ */
+
+void DeviceBenchmark::makeResults()
+{
+    m_results.clear();
+    for (const Pattern& p : qAsConst(patterns))
+    {
+        QList<qint64> sorted = p.rtts;
+        std::sort(sorted.begin(), sorted.end());
+        qint64 total = 0;
+        for (qint64 t : qAsConst(sorted))
+            total += t;
+        qint64 bytesPerSec = total == 0 ? 0 : static_cast<qint64>(p.bytes) * 1000000 / total;
+        m_results << p.name << QString::number(sorted.size());
+        m_results << QString::number(percentile(sorted, 50)) << QString::number(percentile(sorted, 90));
+        m_results << QString::number(percentile(sorted, 99)) << QString::number(sorted.isEmpty() ? 0 : sorted.last());
+        m_results << QString::number(bytesPerSec);
+    }
+}
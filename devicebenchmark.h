@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef DEVICEBENCHMARK_H
+#define DEVICEBENCHMARK_H
+
+#include <QTimer>
+#include "devicejob.h"
+
+/*
+ * Run a small fixed workload on a device and measure it:
+ * small reads, VGET batches, a bulk read, and a bulk write on a scratch area.
+ * The bulk write only runs on a scratch area given with setScratchArea, it puts back
+ * what was read just before, what the game writes there in between is lost.
+ */
+
+class DeviceBenchmark : public DeviceJob
+{
+    Q_OBJECT
+public:
+    explicit DeviceBenchmark(QObject *parent = nullptr);
+    void    setScratchArea(unsigned int address, unsigned int size);
+    void    start(ADevice* device);
+    void    abort();
+
+private slots:
+    void    onDeviceGetDataReceived(QByteArray data);
+    void    onDeviceCommandFinished();
+    void    onDeviceProtocolError();
+    void    onTimeout();
+    void    startOperation();
+
+private:
+    enum Step {
+        SmallRead,
+        VGetBatch,
+        BulkRead,
+        ScratchRead,
+        BulkWrite,
+        Done
+    };
+
+    struct Pattern {
+        QString         name;
+        QList<qint64>   rtts;
+        quint64         bytes;
+    };
+
+    Step            step;
+    int             stepCount;
+    qint64          opStart;
+    unsigned int    scratchAddress;
+    unsigned int    scratchSize;
+    QByteArray      scratchData;
+    QByteArray      readData;
+    QList<Pattern>  patterns;
+    QTimer          timeoutTimer;
+
+    int     patternIndex(Step step) const;
+    void    makeResults();
+};
+
+#endif // DEVICEBENCHMARK_H
@@ -82,6 +82,9 @@ signals:
     void    newDeviceName(QString name);
     void    devicesListDone();
     void    deviceStatusDone(DeviceFactory::DeviceFactoryStatus status);
+    // Only for factories that watch their devices in the background
+    void    deviceAppeared(QString name);
+    void    deviceDisappeared(QString name);
 
 
 protected:
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "deviceinfojob.h"
+
+DeviceInfoJob::DeviceInfoJob(QObject *parent) : DeviceJob(parent)
+{
+    timeoutTimer.setSingleShot(true);
+    timeoutTimer.setInterval(5000);
+    connect(&timeoutTimer, &QTimer::timeout, this, &DeviceInfoJob::onTimeout);
+}
+
+void DeviceInfoJob::start(ADevice *device)
+{
+    m_device = device;
+    connect(device, &ADevice::commandFinished, this, &DeviceInfoJob::onDeviceCommandFinished);
+    connect(device, &ADevice::protocolError, this, &DeviceInfoJob::onDeviceProtocolError);
+    // finished/failed must not be emitted while the server is still starting the job
+    QTimer::singleShot(0, this, &DeviceInfoJob::startOperation);
+}
+
+void DeviceInfoJob::abort()
+{
+    timeoutTimer.stop();
+    DeviceJob::abort();
+}
+
+void DeviceInfoJob::startOperation()
+{
+    if (m_device == nullptr)
+        return ;
+    timeoutTimer.start();
+    m_device->infoCommand();
+}
+
+void DeviceInfoJob::onDeviceCommandFinished()
+{
+    timeoutTimer.stop();
+    USB2SnesInfo info = m_device->parseInfo(m_device->dataRead);
+    m_results = QStringList() << info.version << info.deviceName << info.romPlaying << info.flags;
+    finish();
+}
+
+void DeviceInfoJob::onDeviceProtocolError()
+{
+    timeoutTimer.stop();
+    fail("Info: device error");
+}
+
+void DeviceInfoJob::onTimeout()
+{
+    fail("Info: the device did not answer in time");
+}
@@ -18,20 +18,33 @@
  * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#ifndef IPSPARSE_H
-#define IPSPARSE_H
+#ifndef DEVICEINFOJOB_H
+#define DEVICEINFOJOB_H
 
-#include <QByteArray>
-#include <QList>
+#include <QTimer>
+#include "devicejob.h"
 
+/*
+ * The Info command as a job, results are the same as the Info reply :
+ * version, device name, rom playing then the flags
+ */
 
-struct IPSReccord {
-    quint32     offset; // Starting offset
-    QByteArray  data; // the data
-    bool        rle; // see parseIPS, but should be useless
-    quint16     size; // pretty useless since it can be read on the data
-};
+class DeviceInfoJob : public DeviceJob
+{
+    Q_OBJECT
+public:
+    explicit DeviceInfoJob(QObject *parent = nullptr);
+    void    start(ADevice* device);
+    void    abort();
 
-QList<IPSReccord>   parseIPSData(QByteArray ipsData);
+private slots:
+    void    onDeviceCommandFinished();
+    void    onDeviceProtocolError();
+    void    onTimeout();
+    void    startOperation();
+
+private:
+    QTimer  timeoutTimer;
+};
 
-#endif // IPSPARSE_H
+#endif // DEVICEINFOJOB_H
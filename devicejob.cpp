@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "devicejob.h"
+
+DeviceJob::DeviceJob(QObject *parent) : QObject(parent)
+{
+    m_device = nullptr;
+}
+
+void DeviceJob::abort()
+{
+    if (m_device != nullptr)
+        disconnect(m_device, nullptr, this, nullptr);
+    m_device = nullptr;
+}
+
+QStringList DeviceJob::results() const
+{
+    return m_results;
+}
+
+QString DeviceJob::errorString() const
+{
+    return m_errorString;
+}
+
+void DeviceJob::finish()
+{
+    if (m_device != nullptr)
+        disconnect(m_device, nullptr, this, nullptr);
+    emit finished();
+}
+
+void DeviceJob::fail(const QString error)
+{
+    m_errorString = error;
+    if (m_device != nullptr)
+        disconnect(m_device, nullptr, this, nullptr);
+    emit failed();
+}
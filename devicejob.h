@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef DEVICEJOB_H
+#define DEVICEJOB_H
+
+#include <QObject>
+#include <QStringList>
+#include "adevice.h"
+
+/*
+ * A DeviceJob is work done by the server itself on a device, like a benchmark.
+ * It goes through the device queue like any request and own the device
+ * until it emits finished or failed, so it can chain several device commands.
+ * start() should not emit finished or failed directly.
+ */
+
+class DeviceJob : public QObject
+{
+    Q_OBJECT
+public:
+    explicit DeviceJob(QObject *parent = nullptr);
+    virtual void    start(ADevice* device) = 0;
+    virtual void    abort();
+    QStringList     results() const;
+    QString         errorString() const;
+
+signals:
+    void    finished();
+    void    failed();
+
+protected:
+    ADevice*    m_device;
+    QStringList m_results;
+    QString     m_errorString;
+
+    void        finish();
+    void        fail(const QString error);
+};
+
+#endif // DEVICEJOB_H
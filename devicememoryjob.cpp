@@ -0,0 +1,161 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <QLoggingCategory>
+#include "devicememoryjob.h"
+
+Q_LOGGING_CATEGORY(log_devmemjob, "DeviceMemoryJob")
+#define sDebug() qCDebug(log_devmemjob)
+
+// The sd2snes takes at most 8 ranges in a variadic command, a NWA CORE_READ can have many more
+static const int maxVariadicRanges = 8;
+
+DeviceMemoryJob::DeviceMemoryJob(QObject *parent) : DeviceJob(parent)
+{
+    write = false;
+    variadic = false;
+    rangeIndex = 0;
+    dataOffset = 0;
+    totalSize = 0;
+    timeoutTimer.setSingleShot(true);
+    timeoutTimer.setInterval(5000);
+    connect(&timeoutTimer, &QTimer::timeout, this, &DeviceMemoryJob::onTimeout);
+}
+
+void DeviceMemoryJob::setRead(const QList<DeviceMemoryJob::Range> &ranges)
+{
+    write = false;
+    this->ranges = ranges;
+    m_data.clear();
+}
+
+void DeviceMemoryJob::setWrite(const QList<DeviceMemoryJob::Range> &ranges, const QByteArray &data)
+{
+    write = true;
+    this->ranges = ranges;
+    m_data = data;
+}
+
+QByteArray DeviceMemoryJob::data() const
+{
+    return m_data;
+}
+
+void DeviceMemoryJob::start(ADevice *device)
+{
+    m_device = device;
+    connect(device, &ADevice::getDataReceived, this, &DeviceMemoryJob::onDeviceGetDataReceived);
+    connect(device, &ADevice::commandFinished, this, &DeviceMemoryJob::onDeviceCommandFinished);
+    connect(device, &ADevice::protocolError, this, &DeviceMemoryJob::onDeviceProtocolError);
+    rangeIndex = 0;
+    dataOffset = 0;
+    totalSize = 0;
+    // The variadic commands sizes are on a byte
+    variadic = ranges.size() > 1 && device->hasVariaditeCommands();
+    for (const Range& range : qAsConst(ranges))
+    {
+        totalSize += range.second;
+        if (range.second > 255)
+            variadic = false;
+    }
+    if (!write)
+        m_data.clear();
+    sDebug() << "Starting" << (write ? "write" : "read") << "of" << ranges.size() << "ranges on" << device->name() << (variadic ? "(variadic)" : "");
+    // finished/failed must not be emitted while the server is still starting the job
+    QTimer::singleShot(0, this, &DeviceMemoryJob::startOperation);
+}
+
+void DeviceMemoryJob::abort()
+{
+    timeoutTimer.stop();
+    DeviceJob::abort();
+}
+
+void DeviceMemoryJob::startOperation()
+{
+    if (m_device == nullptr)
+        return ;
+    if (rangeIndex >= ranges.size())
+    {
+        if (!write && static_cast<unsigned int>(m_data.size()) != totalSize)
+        {
+            fail(QString("Memory read: got %1 bytes instead of %2").arg(m_data.size()).arg(totalSize));
+            return ;
+        }
+        finish();
+        return ;
+    }
+    timeoutTimer.start();
+    if (variadic)
+    {
+        QList<QPair<unsigned int, quint8> > args;
+        int size = 0;
+        while (rangeIndex < ranges.size() && args.size() < maxVariadicRanges)
+        {
+            const Range& range = ranges.at(rangeIndex);
+            args.append(QPair<unsigned int, quint8>(range.first, static_cast<quint8>(range.second)));
+            size += static_cast<int>(range.second);
+            rangeIndex++;
+        }
+        if (write)
+        {
+            m_device->putAddrCommand(SD2Snes::space::SNES, args);
+            m_device->writeData(m_data.mid(dataOffset, size));
+            dataOffset += size;
+        } else {
+            m_device->getAddrCommand(SD2Snes::space::SNES, args);
+        }
+        return ;
+    }
+    const Range& range = ranges.at(rangeIndex);
+    rangeIndex++;
+    if (write)
+    {
+        m_device->putAddrCommand(SD2Snes::space::SNES, range.first, range.second);
+        m_device->writeData(m_data.mid(dataOffset, static_cast<int>(range.second)));
+        dataOffset += static_cast<int>(range.second);
+    } else {
+        m_device->getAddrCommand(SD2Snes::space::SNES, range.first, range.second);
+    }
+}
+
+void DeviceMemoryJob::onDeviceGetDataReceived(QByteArray data)
+{
+    if (!write)
+        m_data.append(data);
+}
+
+void DeviceMemoryJob::onDeviceCommandFinished()
+{
+    timeoutTimer.stop();
+    // The device can finish a command while we are still starting it
+    QTimer::singleShot(0, this, &DeviceMemoryJob::startOperation);
+}
+
+void DeviceMemoryJob::onDeviceProtocolError()
+{
+    timeoutTimer.stop();
+    fail("Memory access: device error");
+}
+
+void DeviceMemoryJob::onTimeout()
+{
+    fail("Memory access: the device did not answer in time");
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef DEVICEMEMORYJOB_H
+#define DEVICEMEMORYJOB_H
+
+#include <QTimer>
+#include "devicejob.h"
+
+/*
+ * Read or write a list of SNES memory ranges (usb2snes addressing) on a device.
+ * Uses the variadic commands (8 ranges at a time) if the device has them, one command per range otherwise.
+ * The read data are in data() in the order of the ranges.
+ */
+
+class DeviceMemoryJob : public DeviceJob
+{
+    Q_OBJECT
+public:
+    typedef QPair<unsigned int, unsigned int> Range;
+
+    explicit DeviceMemoryJob(QObject *parent = nullptr);
+    void        setRead(const QList<Range>& ranges);
+    void        setWrite(const QList<Range>& ranges, const QByteArray& data);
+    QByteArray  data() const;
+    void        start(ADevice* device);
+    void        abort();
+
+private slots:
+    void    onDeviceGetDataReceived(QByteArray data);
+    void    onDeviceCommandFinished();
+    void    onDeviceProtocolError();
+    void    onTimeout();
+    void    startOperation();
+
+private:
+    bool            write;
+    bool            variadic;
+    QList<Range>    ranges;
+    int             rangeIndex;
+    int             dataOffset;
+    unsigned int    totalSize;
+    QByteArray      m_data;
+    QTimer          timeoutTimer;
+};
+
+#endif // DEVICEMEMORYJOB_H
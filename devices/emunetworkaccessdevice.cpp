@@ -52,14 +52,57 @@ EmuNetworkAccessDevice::EmuNetworkAccessDevice(QString _name, uint port)
     });
     doingPutFile = false;
     currentMemorieToWrite = nullptr;
+    currentWriteEntry = 0;
+    writeAcksPending = 0;
     isRetroarch = false;
+    addressMapper.setRomType(LoROM);
+}
+
+bool EmuNetworkAccessDevice::hasCapabilities() const
+{
+    return !memoryAccess.isEmpty();
+}
+
+EmuNetworkAccessDevice::Capabilities EmuNetworkAccessDevice::capabilities() const
+{
+    Capabilities cap;
+    cap.memoryAccess = memoryAccess;
+    cap.emuName = emuName;
+    cap.emuVersion = emuVersion;
+    cap.romType = addressMapper.romType();
+    return cap;
+}
+
+void EmuNetworkAccessDevice::setCapabilities(const Capabilities &cap)
+{
+    sDebug() << "Using cached capabilities" << cap.emuName << cap.emuVersion << cap.memoryAccess;
+    memoryAccess = cap.memoryAccess;
+    emuName = cap.emuName;
+    emuVersion = cap.emuVersion;
+    addressMapper.setRomType(cap.romType);
+}
+
+QString EmuNetworkAccessDevice::game() const
+{
+    return currentGame;
+}
+
+// Memory access and ROM type depend on the game (and the core for RetroArch)
+void EmuNetworkAccessDevice::setGame(const QString &game)
+{
+    if (game == currentGame)
+        return ;
+    sDebug() << "Game changed" << currentGame << "->" << game;
+    currentGame = game;
+    memoryAccess.clear();
+    addressMapper.setRomType(LoROM);
 }
 
 void EmuNetworkAccessDevice::setInfoFromRomHeader(QByteArray data)
 {
     struct rom_infos* rInfos = get_rom_info(data);
     sDebug() << "From header : " << rInfos->title << rInfos->type;
-    retroArchRomType = rInfos->type;
+    addressMapper.setRomType(rInfos->type);
     free(rInfos);
 }
 
@@ -67,6 +110,7 @@ void EmuNetworkAccessDevice::setInfoFromRomHeader(QByteArray data)
 void EmuNetworkAccessDevice::onEmuReadyRead()
 {
     static int step = 0;
+    markDataReceived();
     auto rep = emu->readReply();
     sDebug() << "Reply ready";
     sDebug() << rep;
@@ -107,7 +151,7 @@ void EmuNetworkAccessDevice::onEmuReadyRead()
                     {
                         setInfoFromRomHeader(rep.binary);
                     } else {
-                        retroArchRomType = LoROM;
+                        addressMapper.setRomType(LoROM);
                     }
                 }
             }
@@ -117,6 +161,7 @@ void EmuNetworkAccessDevice::onEmuReadyRead()
                 for (auto& ma : memAccess)
                     memoryAccess[ma["name"]] = ma["access"];
             }
+            emit capabilitiesChanged();
             afterMemoryAccess();
             afterMemoryAccess = [](){;};
             break;
@@ -129,9 +174,11 @@ void EmuNetworkAccessDevice::onEmuReadyRead()
                     if (rep["state"] == "no_game")
                     {
                         whatRunning = "";
+                        setGame("");
                         emit commandFinished();
                         return ;
                     } else {
+                        setGame(rep["game"]);
                         step = 1;
                         emu->cmdGameInfo();
                     }
@@ -151,6 +198,7 @@ void EmuNetworkAccessDevice::onEmuReadyRead()
                 {
                     if (rep["state"] == "running")
                         whatRunning = rep["game"];
+                    setGame(rep["state"] == "no_game" ? QString() : rep["game"]);
                     emu->cmdEmulatorInfo();
                     step = 1;
                     return ;
@@ -161,6 +209,7 @@ void EmuNetworkAccessDevice::onEmuReadyRead()
                     emuName = rep["name"];
                     if (emuName.toLower() == QString("RetroArch").toLower())
                         isRetroarch = true;
+                    emit capabilitiesChanged();
                     emu->cmdEmulationStatus();
                     step = 0;
                 }
@@ -169,51 +218,50 @@ void EmuNetworkAccessDevice::onEmuReadyRead()
         }
         case USB2SnesWS::GetAddress:
         {
-            if (rep.isError)
-            {
-                emit protocolError();
-                NWAMemoriesToGet.clear();
-                return ;
-            }
-            if (rep.binary.size() != getAddressSizeRequested)
+            if (getAddressReplies.size() >= NWAMemoriesToGet.size())
+                break;
+            const auto& group = NWAMemoriesToGet.at(getAddressReplies.size());
+            if (rep.isError || static_cast<unsigned int>(rep.binary.size()) != memoriesSize(group))
             {
                 emit protocolError();
                 NWAMemoriesToGet.clear();
+                getAddressRanges.clear();
+                getAddressReplies.clear();
                 return ;
             }
-            emit getDataReceived(rep.binary);
-            if (NWAMemoriesToGet.isEmpty())
-            {
-                m_state = READY;
-                emit commandFinished();
-            } else {
-                nwaGetMemory(NWAMemoriesToGet.takeFirst());
-            }
+            getAddressReplies.append(rep.binary);
+            if (getAddressReplies.size() < NWAMemoriesToGet.size())
+                break;
+            QByteArray data;
+            for (const auto& range : qAsConst(getAddressRanges))
+                data.append(getAddressReplies.at(range.group).mid(range.offset, range.size));
+            NWAMemoriesToGet.clear();
+            getAddressRanges.clear();
+            getAddressReplies.clear();
+            m_state = READY;
+            emit getDataReceived(data);
+            emit commandFinished();
             break;
         }
         case USB2SnesWS::PutAddress:
         {
-            NWAMemoriesToWrite.takeFirst();
-            if (NWAMemoriesToWrite.isEmpty())
-            {
-                m_state = READY;
-                emit commandFinished();
-                break;
-            }
-            currentMemorieToWrite = &NWAMemoriesToWrite.first();
-            prepareWriteMemory(currentMemorieToWrite->mems);
-            if (!cachedData.isEmpty())
+            if (rep.isError)
             {
-                if (currentMemorieToWrite->totalSize <= cachedData.size())
-                {
-                    emu->cmdCoreWriteMemoryData(cachedData.left(currentMemorieToWrite->totalSize));
-                    cachedData = cachedData.mid(currentMemorieToWrite->totalSize);
-                } else {
-                    emu->cmdCoreWriteMemoryData(cachedData);
-                    currentMemorieToWrite->sizeWritten += cachedData.size();
-                    cachedData.clear();
-                }
+                sDebug() << "Write memory failed" << rep.error;
+                NWAMemoriesToWrite.clear();
+                currentMemorieToWrite = nullptr;
+                writeAcksPending = 0;
+                cachedData.clear();
+                emit protocolError();
+                return ;
             }
+            writeAcksPending--;
+            if (writeAcksPending > 0)
+                break;
+            NWAMemoriesToWrite.clear();
+            currentMemorieToWrite = nullptr;
+            m_state = READY;
+            emit commandFinished();
             break;
         }
         default:
@@ -230,72 +278,64 @@ void EmuNetworkAccessDevice::onEmuDisconnected()
 
 
 
-EmuNetworkAccessDevice::MemoryAddress    EmuNetworkAccessDevice::sd2snesToDomain(unsigned int sd2snesAddr)
+// RetroArch accesses the SNES bus, so it needs a command for each linear part of the mapping
+QList<EmuNetworkAccessDevice::MemoryAddress>    EmuNetworkAccessDevice::sd2snesToDomains(unsigned int sd2snesAddr, unsigned int size)
 {
-    MemoryAddress   toret;
-    if (sd2snesAddr >= 0xF50000 && sd2snesAddr < 0xF70000)
-    {
-        toret.domain = "WRAM";
-        toret.offset = sd2snesAddr - 0xF50000;
-        return toret;
-    }
-    if (sd2snesAddr >= 0xE00000)
+    QList<MemoryAddress> toret;
+    const auto pieces = addressMapper.map(sd2snesAddr, size, isRetroarch ? AddressMapper::ByBusRange : AddressMapper::ByRegion);
+    for (const auto& piece : pieces)
     {
-        toret.domain = "SRAM";
-        toret.offset = sd2snesAddr - 0xE00000;
-        return toret;
+        MemoryAddress memAddr;
+        switch (piece.region)
+        {
+        case AddressMapper::ROM:
+            memAddr.domain = "CARTROM";
+            break;
+        case AddressMapper::SRAM:
+            memAddr.domain = "SRAM";
+            break;
+        case AddressMapper::WRAM:
+            memAddr.domain = "WRAM";
+            break;
+        default:
+            break;
+        }
+        memAddr.offset = piece.offset;
+        memAddr.size = piece.size;
+        memAddr.busAddress = piece.busAddress;
+        toret.append(memAddr);
     }
-    toret.domain = "CARTROM";
-    toret.offset = sd2snesAddr;
     return toret;
 }
 
-void EmuNetworkAccessDevice::controlCommand(SD2Snes::opcode op, QByteArray args)
+bool EmuNetworkAccessDevice::canAccess(const MemoryAddress &memAddr, const QString &mode) const
 {
-    Q_UNUSED(op)
-    Q_UNUSED(args)
+    if (isRetroarch && memAddr.busAddress == -1)
+        return false;
+    return memoryAccess.value(memAddr.domain).contains(mode);
 }
 
-unsigned int EmuNetworkAccessDevice::toRetroArchAddressing(const MemoryAddress& memAddr)
+void EmuNetworkAccessDevice::controlCommand(SD2Snes::opcode op, QByteArray args)
 {
-    if (memAddr.domain == "CARTROM" && retroArchRomType == LoROM)
-        return 0x800000 + (memAddr.offset + (0x8000 * ((memAddr.offset + 0x8000) / 0x8000)));
-    if (memAddr.domain == "CARTROM" && retroArchRomType == HiROM)
-    {
-        if (memAddr.offset < 0x400000)
-            return memAddr.offset + 0xC00000;
-        else //exhirom
-            return memAddr.offset + 0x400000;
-    }
-    if (memAddr.domain == "WRAM")
-    {
-        return memAddr.offset + 0x7E0000;
-    }
-    if (memAddr.domain == "SRAM")
-    {
-        if (retroArchRomType == LoROM)
-            //return addr - 0xE00000 + 0x700000;
-            return lorom_sram_pc_to_snes(memAddr.offset);
-        return lorom_sram_pc_to_snes(memAddr.offset);
-        return memAddr.offset + 0x20000;
-    }
+    Q_UNUSED(op)
+    Q_UNUSED(args)
 }
 
 void EmuNetworkAccessDevice::actualGetMemory(const MemoryAddress& memAdd)
 {
+    markCommandSent();
     if (!isRetroarch)
     {
         emu->cmdCoreReadMemory(memAdd.domain, memAdd.offset, memAdd.size);
         return ;
     }
     // Everyone love RetroArch
-    emu->cmd("RETROARCH_READ_CORE_MEMORY", QString("%1;%2").arg(toRetroArchAddressing(memAdd)).arg(memAdd.size));
+    emu->cmd("RETROARCH_READ_CORE_MEMORY", QString("%1;%2").arg(memAdd.busAddress).arg(memAdd.size));
 }
 
 void EmuNetworkAccessDevice::nwaGetMemory(const MemoryAddress& memAdd)
 {
     sDebug() << "NWA get Memory single : " << memAdd;
-    getAddressSizeRequested = memAdd.size;
     actualGetMemory(memAdd);
 }
 
@@ -303,21 +343,41 @@ void EmuNetworkAccessDevice::nwaGetMemory(const QList<MemoryAddress>& list)
 {
     QList<QPair<int, int> >mems;
     const QString domain = list.first().domain;
-    getAddressSizeRequested = 0;
     for (const auto& memAdd : list)
     {
         //sDebug() << "NWa get memory multiple : " << memAdd;
         mems.append(QPair<int, int>(memAdd.offset, memAdd.size));
-        getAddressSizeRequested += memAdd.size;
     }
+    markCommandSent();
     emu->cmdCoreReadMemory(domain, mems);
 }
 
+unsigned int EmuNetworkAccessDevice::memoriesSize(const QList<MemoryAddress> &list)
+{
+    unsigned int size = 0;
+    for (const auto& memAdd : list)
+        size += memAdd.size;
+    return size;
+}
+
+// The emulator replies in order, no need to wait for a reply to send the next read
+void EmuNetworkAccessDevice::sendGetMemories()
+{
+    getAddressReplies.clear();
+    for (const auto& group : qAsConst(NWAMemoriesToGet))
+    {
+        if (group.size() == 1)
+            nwaGetMemory(group.first());
+        else
+            nwaGetMemory(group);
+    }
+}
+
 void EmuNetworkAccessDevice::prepareWriteMemory(const QList<MemoryAddress>& list)
 {
     if (isRetroarch)
     {
-        emu->bcmdPrepare("RETROARCH_WRITE_CORE_MEMORY", QString("%1;%2").arg(toRetroArchAddressing(list.first())).arg(list.first().size), list.first().size);
+        emu->bcmdPrepare("RETROARCH_WRITE_CORE_MEMORY", QString("%1;%2").arg(list.first().busAddress).arg(list.first().size), list.first().size);
         return ;
     }
     QList<QPair<int, int> >mems;
@@ -330,6 +390,21 @@ void EmuNetworkAccessDevice::prepareWriteMemory(const QList<MemoryAddress>& list
     emu->cmdCoreWriteMemoryPrepare(domain, mems);
 }
 
+void EmuNetworkAccessDevice::startPutAddress()
+{
+    currentWriteEntry = 0;
+    writeAcksPending = NWAMemoriesToWrite.size();
+    currentMemorieToWrite = &NWAMemoriesToWrite.first();
+    putAddressTotalSent = 0;
+    prepareWriteMemory(currentMemorieToWrite->mems);
+    if (!cachedData.isEmpty())
+    {
+        QByteArray data = cachedData;
+        cachedData.clear();
+        writeData(data);
+    }
+}
+
 void EmuNetworkAccessDevice::getAddrCommand(SD2Snes::space space, unsigned int addr, unsigned int size)
 {
     if (space != SD2Snes::SNES)
@@ -339,16 +414,7 @@ void EmuNetworkAccessDevice::getAddrCommand(SD2Snes::space space, unsigned int a
     }
     m_state = BUSY;
     std::function<void()> F([this, addr, size] {
-        currentCmd = USB2SnesWS::GetAddress;
-        auto newAddr = sd2snesToDomain(addr);
-        newAddr.size = size;
-        sDebug() << "Get address" << newAddr.domain << newAddr.offset;
-        if (memoryAccess[newAddr.domain].contains("r"))
-        {
-            nwaGetMemory(newAddr);
-        } else {
-            emit protocolError();
-        }
+        startGetAddress(sd2snesToDomains(addr, size));
     });
     if (!memoryAccess.contains("WRAM"))
     {
@@ -370,28 +436,10 @@ void EmuNetworkAccessDevice::getAddrCommand(SD2Snes::space space, QList<QPair<un
     }
     m_state = BUSY;
     std::function<void()> F([this, args] {
-        currentCmd = USB2SnesWS::GetAddress;
-        NWAMemoriesToGet.append(QList<MemoryAddress>());
-        QString domain = "";
-        for (auto pairing : args)
-        {
-            auto newAddr = sd2snesToDomain(pairing.first);
-            if (!memoryAccess[newAddr.domain].contains("r"))
-            {
-                emit protocolError();
-                return;
-            }
-            newAddr.size = pairing.second;
-            //sDebug() << "Get address" << newAddr;
-            if (domain != "" && newAddr.domain != domain)
-            {
-                NWAMemoriesToGet.append(QList<MemoryAddress>());
-            }
-            domain = newAddr.domain;
-            NWAMemoriesToGet.last().append(newAddr);
-        }
-        nwaGetMemory(NWAMemoriesToGet.takeFirst());
-
+        QList<MemoryAddress> mems;
+        for (const auto& pairing : args)
+            mems.append(sd2snesToDomains(pairing.first, pairing.second));
+        startGetAddress(mems);
     });
     if (!memoryAccess.contains("WRAM"))
     {
@@ -403,30 +451,45 @@ void EmuNetworkAccessDevice::getAddrCommand(SD2Snes::space space, QList<QPair<un
     }
 }
 
+void EmuNetworkAccessDevice::startGetAddress(const QList<MemoryAddress> &mems)
+{
+    currentCmd = USB2SnesWS::GetAddress;
+    NWAMemoriesToGet.clear();
+    getAddressRanges.clear();
+    QMap<QString, int> domainGroup;
+    for (const auto& memAddr : mems)
+    {
+        if (!canAccess(memAddr, "r"))
+        {
+            NWAMemoriesToGet.clear();
+            getAddressRanges.clear();
+            emit protocolError();
+            return;
+        }
+        //sDebug() << "Get address" << memAddr;
+        // RetroArch reads one range per command
+        if (isRetroarch || !domainGroup.contains(memAddr.domain))
+        {
+            domainGroup[memAddr.domain] = NWAMemoriesToGet.size();
+            NWAMemoriesToGet.append(QList<MemoryAddress>());
+        }
+        int group = domainGroup.value(memAddr.domain);
+        getAddressRanges.append(GetAddressRange{group, memoriesSize(NWAMemoriesToGet.at(group)), memAddr.size});
+        NWAMemoriesToGet[group].append(memAddr);
+    }
+    sendGetMemories();
+}
+
 void EmuNetworkAccessDevice::putAddrCommand(SD2Snes::space space, unsigned int addr, unsigned int size)
 {
     // Don't call the "generic" qpair variant, as the size is limited to quint8
     if (space != SD2Snes::SNES)
         emit protocolError();
     m_state = BUSY;
+    currentMemorieToWrite = nullptr;
+    cachedData.clear();
     std::function<void()> F([this, addr, size] {
-        currentCmd = USB2SnesWS::PutAddress;
-        NWAMemoriesToWrite.append(PutAddressEntry());
-        auto newAddr = sd2snesToDomain(addr);
-        currentMemorieToWrite = &NWAMemoriesToWrite.last();
-        if (!memoryAccess[newAddr.domain].contains("w"))
-        {
-            emit protocolError();
-            NWAMemoriesToWrite.clear();
-            return;
-        }
-        newAddr.size = size;
-        currentMemorieToWrite->mems.append(newAddr);
-        NWAMemoriesToWrite.last().totalSize += newAddr.size;
-        NWAMemoriesToWrite.last().domain = newAddr.domain;
-        putAddressTotalSent = 0;
-        putAddressTotalSize = size;
-        prepareWriteMemory(currentMemorieToWrite->mems);
+        setupPutAddress(sd2snesToDomains(addr, size));
     });
     if (!memoryAccess.contains("WRAM"))
     {
@@ -443,35 +506,13 @@ void EmuNetworkAccessDevice::putAddrCommand(SD2Snes::space space, QList<QPair<un
     if (space != SD2Snes::SNES)
         emit protocolError();
     m_state = BUSY;
+    currentMemorieToWrite = nullptr;
+    cachedData.clear();
     std::function<void()> F([this, args] {
-        currentCmd = USB2SnesWS::PutAddress;
-        NWAMemoriesToWrite.append(PutAddressEntry());
-        QString domain = "";
-        sDebug() << "Should be 1" << NWAMemoriesToWrite.size();
-        currentMemorieToWrite = &NWAMemoriesToWrite.last();
-        for (auto pairing : args)
-        {
-            auto newAddr = sd2snesToDomain(pairing.first);
-            if (!memoryAccess[newAddr.domain].contains("w"))
-            {
-                emit protocolError();
-                NWAMemoriesToWrite.clear();
-                return;
-            }
-            newAddr.size = pairing.second;
-            putAddressTotalSize += newAddr.size;
-            if (domain != "" && newAddr.domain != domain)
-            {
-                NWAMemoriesToWrite.append(PutAddressEntry());
-                sDebug() << "Adding new putaddressentry" << NWAMemoriesToWrite.size() << NWAMemoriesToWrite.last().totalSize;
-            }
-            domain = newAddr.domain;
-            NWAMemoriesToWrite.last().totalSize += newAddr.size;
-            NWAMemoriesToWrite.last().domain = newAddr.domain;
-            NWAMemoriesToWrite.last().mems.append(newAddr);
-        }
-        putAddressTotalSent = 0;
-        prepareWriteMemory(currentMemorieToWrite->mems);
+        QList<MemoryAddress> mems;
+        for (const auto& pairing : args)
+            mems.append(sd2snesToDomains(pairing.first, pairing.second));
+        setupPutAddress(mems);
     });
     if (!memoryAccess.contains("WRAM"))
     {
@@ -483,6 +524,36 @@ void EmuNetworkAccessDevice::putAddrCommand(SD2Snes::space space, QList<QPair<un
     }
 }
 
+void EmuNetworkAccessDevice::setupPutAddress(const QList<MemoryAddress> &mems)
+{
+    currentCmd = USB2SnesWS::PutAddress;
+    NWAMemoriesToWrite.clear();
+    NWAMemoriesToWrite.append(PutAddressEntry());
+    QString domain = "";
+    putAddressTotalSize = 0;
+    for (const auto& memAddr : mems)
+    {
+        if (!canAccess(memAddr, "w"))
+        {
+            emit protocolError();
+            NWAMemoriesToWrite.clear();
+            return;
+        }
+        putAddressTotalSize += memAddr.size;
+        // A bCORE_WRITE per domain, RetroArch writes one range per command
+        if (domain != "" && (memAddr.domain != domain || isRetroarch))
+        {
+            NWAMemoriesToWrite.append(PutAddressEntry());
+            sDebug() << "Adding new putaddressentry" << NWAMemoriesToWrite.size() << NWAMemoriesToWrite.last().totalSize;
+        }
+        domain = memAddr.domain;
+        NWAMemoriesToWrite.last().totalSize += memAddr.size;
+        NWAMemoriesToWrite.last().domain = memAddr.domain;
+        NWAMemoriesToWrite.last().mems.append(memAddr);
+    }
+    startPutAddress();
+}
+
 void EmuNetworkAccessDevice::putAddrCommand(SD2Snes::space space, unsigned char flags, unsigned int addr, unsigned int size)
 {
     QList<QPair<unsigned int, quint8> > plop;
@@ -523,6 +594,11 @@ void EmuNetworkAccessDevice::writeData(QByteArray data)
         }
         return ;
     }
+    if (currentMemorieToWrite == nullptr)
+    {
+        cachedData += data;
+        return ;
+    }
     putAddressTotalSent += data.size();
     sDebug() << "Total Sent : " << putAddressTotalSent << "Total Size" << putAddressTotalSize;
     if (putAddressTotalSent > putAddressTotalSize)
@@ -530,26 +606,24 @@ void EmuNetworkAccessDevice::writeData(QByteArray data)
         emit protocolError();
         return;
     }
-    // If we get data but the emu still has not confirm the previous write
-    if (currentMemorieToWrite->totalSize == currentMemorieToWrite->sizeWritten && NWAMemoriesToWrite.size() > 1)
-    {
-        cachedData += data;
-        return ;
-    }
-    int remainingWrite = currentMemorieToWrite->totalSize - currentMemorieToWrite->sizeWritten;
-    sDebug() << "Remaining to write : " << remainingWrite;
-    if (data.size() < remainingWrite)
-    {
-        emu->cmdCoreWriteMemoryData(data);
-        currentMemorieToWrite->sizeWritten += data.size();
-    }
-    if (data.size() >= remainingWrite)
-    {
-        emu->cmdCoreWriteMemoryData(data.left(remainingWrite));
-        currentMemorieToWrite->sizeWritten += remainingWrite;
-        if (data.size() > remainingWrite)
+    // No need to wait for the emulator ack, the next bCORE_WRITE follows
+    // the data of the previous one directly
+    int offset = 0;
+    while (offset < data.size() && currentMemorieToWrite != nullptr)
+    {
+        int remainingWrite = currentMemorieToWrite->totalSize - currentMemorieToWrite->sizeWritten;
+        int toWrite = qMin(remainingWrite, data.size() - offset);
+        sDebug() << "Remaining to write : " << remainingWrite;
+        emu->cmdCoreWriteMemoryData(data.mid(offset, toWrite));
+        currentMemorieToWrite->sizeWritten += toWrite;
+        offset += toWrite;
+        if (currentMemorieToWrite->sizeWritten == currentMemorieToWrite->totalSize)
         {
-            cachedData += data.mid(remainingWrite);
+            if (currentWriteEntry + 1 >= NWAMemoriesToWrite.size())
+                break;
+            currentWriteEntry++;
+            currentMemorieToWrite = &NWAMemoriesToWrite[currentWriteEntry];
+            prepareWriteMemory(currentMemorieToWrite->mems);
         }
     }
 }
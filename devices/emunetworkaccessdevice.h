@@ -29,7 +29,7 @@
 #include "../adevice.h"
 #include "../localstorage.h"
 #include "emunwaccessclient.h"
-#include "../rommapping/rommapping.h"
+#include "../rommapping/addressmapper.h"
 
 class EmuNetworkAccessDevice : public ADevice
 {
@@ -38,6 +38,24 @@ class EmuNetworkAccessDevice : public ADevice
 public:
     EmuNetworkAccessDevice(QString name, uint port);
 
+    // What we learn from the emulator before being able to access the memory
+    // only valid for the game that was running when they were fetched
+    struct Capabilities
+    {
+        QMap<QString, QString>  memoryAccess;
+        QString                 emuName;
+        QString                 emuVersion;
+        rom_type                romType;
+    };
+    bool            hasCapabilities() const;
+    Capabilities    capabilities() const;
+    void            setCapabilities(const Capabilities& cap);
+    QString         game() const;
+    void            setGame(const QString& game);
+
+signals:
+    void            capabilitiesChanged();
+
     // ADevice interface
 public:
     void fileCommand(SD2Snes::opcode op, QVector<QByteArray> args);
@@ -68,6 +86,7 @@ private:
     QString             emuName;
     QString             emuVersion;
     QString             whatRunning;
+    QString             currentGame;
     QString             myName;
     bool                doingPutFile;
     QFile*              uploadedFile;
@@ -82,6 +101,7 @@ private:
         QString domain;
         quint32 offset;
         quint32 size;
+        int     busAddress;
         friend QDebug              operator<<(QDebug debug, const MemoryAddress& ma);
     };
     friend QDebug              operator<<(QDebug debug, const EmuNetworkAccessDevice::MemoryAddress& ma);
@@ -99,25 +119,43 @@ private:
         QString domain;
     };
 
+    // A read command per domain, all sent at once. The ranges keep the client
+    // order to rebuild the reply from the per domain replies
+    struct GetAddressRange
+    {
+        int             group;
+        unsigned int    offset;
+        unsigned int    size;
+    };
     QList<QList<MemoryAddress>> NWAMemoriesToGet;
+    QList<GetAddressRange>  getAddressRanges;
+    QList<QByteArray>       getAddressReplies;
+    // Every entry is a bCORE_WRITE, they are sent back to back as soon
+    // as the data for the previous one is written, the emulator acks them in order
     QList<PutAddressEntry>  NWAMemoriesToWrite;
     PutAddressEntry*        currentMemorieToWrite;
-    unsigned int            getAddressSizeRequested;
+    int                     currentWriteEntry;
+    int                     writeAcksPending;
     unsigned int            putAddressTotalSize;
     unsigned int            putAddressTotalSent;
-    QByteArray              cachedData;
+    QByteArray              cachedData; // Data received before the memory access is known
     QMap<QString, QString>  memoryAccess;
     std::function<void()>   afterMemoryAccess;
-    rom_type                retroArchRomType;
+    AddressMapper           addressMapper;
 
     USB2SnesWS::opcode  currentCmd;
 
-    MemoryAddress sd2snesToDomain(unsigned int sd2snesAddr);
+    QList<MemoryAddress> sd2snesToDomains(unsigned int sd2snesAddr, unsigned int size);
+    bool canAccess(const MemoryAddress& memAddr, const QString& mode) const;
+    void startGetAddress(const QList<MemoryAddress>& mems);
+    void setupPutAddress(const QList<MemoryAddress>& mems);
     void nwaGetMemory(const MemoryAddress &memAdd);
     void nwaGetMemory(const QList<MemoryAddress> &list);
+    void sendGetMemories();
+    static unsigned int memoriesSize(const QList<MemoryAddress> &list);
     void prepareWriteMemory(const QList<MemoryAddress> &list);
+    void startPutAddress();
     void actualGetMemory(const MemoryAddress &memAdd);
-    unsigned int toRetroArchAddressing(const MemoryAddress &memAddr);
     void setInfoFromRomHeader(QByteArray data);
 private slots:
     void onEmuReadyRead();
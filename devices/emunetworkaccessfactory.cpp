@@ -20,21 +20,33 @@
 
 
 #include <QLoggingCategory>
+#include <QSettings>
 #include <QTcpSocket>
 #include <QTime>
 #include <QTimer>
 
 #include "emunetworkaccessfactory.h"
+#include "../nwaserver.h"
 
 
 Q_LOGGING_CATEGORY(log_emunwafactory, "Emu NWA Factory")
 #define sDebug() qCDebug(log_emunwafactory)
 
+extern QSettings* globalSettings;
 
 
 EmuNetworkAccessFactory::EmuNetworkAccessFactory()
 {
     startingPort = 0xBEEF;
+    portCount = 5;
+    connectTimeout = 50;
+    probeTimeout = 500;
+    if (globalSettings->contains("EmuNWAPortStart"))
+        startingPort = static_cast<unsigned short>(globalSettings->value("EmuNWAPortStart").toUInt());
+    if (globalSettings->contains("EmuNWAPortCount"))
+        portCount = static_cast<unsigned short>(qMax(1u, globalSettings->value("EmuNWAPortCount").toUInt()));
+    if (globalSettings->contains("EmuNWAConnectTimeout"))
+        connectTimeout = qMax(10, globalSettings->value("EmuNWAConnectTimeout").toInt());
     QByteArray envPort = qgetenv("NWA_PORT_RANGE");
     if (!envPort.isEmpty())
     {
@@ -43,22 +55,34 @@ EmuNetworkAccessFactory::EmuNetworkAccessFactory()
         if (ok)
             startingPort = p;
     }
-    for (int i = 0; i < 5; i++)
+    for (int i = 0; i < portCount; i++)
     {
+        // Don't find ourself
+        if (startingPort + i == NWAServer::configuredPort())
+            continue;
         auto piko = new EmuNWAccessClient(this);
         connect(piko, &EmuNWAccessClient::connected, this, &EmuNetworkAccessFactory::onClientConnected);
         connect(piko, &EmuNWAccessClient::connectError, this, &EmuNetworkAccessFactory::onClientConnectionError);
         connect(piko, &EmuNWAccessClient::readyRead, this, &EmuNetworkAccessFactory::onClientReadyRead);
+        connect(piko, &EmuNWAccessClient::disconnected, this, &EmuNetworkAccessFactory::onClientDisconnected);
         clientInfos[piko].checkState = DetectState::NO_CHECK;
         clientInfos[piko].device = nullptr;
         clientInfos[piko].client = piko;
-        clientInfos[piko].doingAttach = false;
+        clientInfos[piko].identified = false;
+        clientInfos[piko].statusKnown = false;
+        clientInfos[piko].lastError = Error::DeviceError::DE_EMUNWA_NO_CLIENT;
+        clientInfos[piko].probeId = 0;
         clientInfos[piko].port = startingPort + i;
     }
     doingDeviceList = false;
     doingDeviceStatus = false;
-    checkedCount = 0;
+    probesRunning = 0;
+    firstRoundDone = false;
     devFacStatus.name = "Emu Network Access";
+    discoveryTimer.setInterval(2000);
+    if (globalSettings->contains("EmuNWADiscoveryInterval"))
+        discoveryTimer.setInterval(qMax(100, globalSettings->value("EmuNWADiscoveryInterval").toInt()));
+    connect(&discoveryTimer, &QTimer::timeout, this, &EmuNetworkAccessFactory::startDiscovery);
 }
 
 
@@ -80,37 +104,25 @@ ADevice *EmuNetworkAccessFactory::attach(QString deviceName)
                 {
                     ci.device->isRetroarch = true;
                 }
+                EmuNetworkAccessDevice* device = ci.device;
+                connect(device, &EmuNetworkAccessDevice::capabilitiesChanged, this, [=] {
+                    capabilitiesCache[device->name() + "|" + device->game()] = device->capabilities();
+                });
             }
             if (ci.device->state() == ADevice::BUSY)
                 return ci.device;
-            sDebug() << "Attach, Checking stuff";
-            ci.doingAttach = true;
-            ci.client->cmdEmulationStatus();
-            ci.client->waitForReadyRead(100);
-            auto rep = ci.client->readReply();
-            ADevice* toret = nullptr;
-            if (rep.isValid)
-            {
-                if (rep["state"] == "no_game")
-                {
-                    toret = ci.device;
-                } else {
-                    ci.client->cmdCoreCurrentInfo();
-                    ci.client->waitForReadyRead(100);
-                    rep = ci.client->readReply();
-                    if (rep.isValid && rep["platform"].toUpper() == "SNES")
-                    {
-                       toret = ci.device;
-                    } else {
-                        //ci.lastError = "Emulator is running a no SNES game";
-                        toret = nullptr;
-                    }
-                }
-            } else {
-                toret = nullptr;
-            }
-            ci.doingAttach = false;
-            return toret;
+            // The discovery keeps the status of the emulator, nothing to wait for here
+            if (!ci.statusKnown)
+                return nullptr;
+            // A game change makes the device drop what it knows, the cache can fill it back
+            ci.device->setGame(ci.game);
+            const QString cacheKey = deviceName + "|" + ci.device->game();
+            if (!ci.device->hasCapabilities() && capabilitiesCache.contains(cacheKey))
+                ci.device->setCapabilities(capabilitiesCache.value(cacheKey));
+            if (ci.emulationState == "no_game" || ci.platform.toUpper() == "SNES")
+                return ci.device;
+            //ci.lastError = "Emulator is running a no SNES game";
+            return nullptr;
         }
     }
     return nullptr;
@@ -128,7 +140,9 @@ bool EmuNetworkAccessFactory::deleteDevice(ADevice *device)
             device->deleteLater();
             it.value().device = nullptr;
             //it.value().client->deleteLater();
-            it.value().deviceName.clear();
+            // Still there, the next DeviceList needs the name
+            if (!it.value().identified)
+                it.value().deviceName.clear();
             return true;
         }
     }
@@ -148,14 +162,10 @@ bool EmuNetworkAccessFactory::hasAsyncListDevices()
 }
 
 
-// FIXME If a wsclient does Attach and another DeviceList
-// This will received the Attach async reply code
 void    EmuNetworkAccessFactory::onClientReadyRead()
 {
     EmuNWAccessClient* client = qobject_cast<EmuNWAccessClient*>(sender());
     ClientInfo &info = clientInfos[client];
-    if (info.doingAttach)
-        return ;
     auto rep = client->readReply();
     sDebug() << rep;
     switch (info.checkState) {
@@ -197,107 +207,190 @@ void    EmuNetworkAccessFactory::onClientReadyRead()
         }
         break;
     }
+    case DetectState::CHECK_EMU_STATUS:
+    {
+        info.statusKnown = rep.isValid;
+        info.emulationState = rep.isValid ? rep["state"] : QString();
+        info.game = rep.isValid && rep["state"] != "no_game" ? rep["game"] : QString();
+        info.platform.clear();
+        if (!rep.isValid || rep["state"] == "no_game")
+        {
+            statusDone(client);
+            break;
+        }
+        info.checkState = DetectState::CHECK_CORE_INFO;
+        client->cmdCoreCurrentInfo();
+        break;
+    }
+    case DetectState::CHECK_CORE_INFO:
+    {
+        info.platform = rep.isValid ? rep["platform"] : QString();
+        statusDone(client);
+        break;
+    }
     default:
         break;
     }
 
 }
 
-void    EmuNetworkAccessFactory::checkStatus()
+void    EmuNetworkAccessFactory::startDiscovery()
 {
-    int cpt = 0;
-    checkedCount = 0;
-    QMutableMapIterator<EmuNWAccessClient*, ClientInfo> it(clientInfos);
-    while (it.hasNext())
+    if (!discoveryTimer.isActive())
+        discoveryTimer.start();
+    // A round is still running, some ports are slow to answer
+    if (probesRunning != 0)
+        return ;
+    for (auto it = clientInfos.begin(); it != clientInfos.end(); ++it)
     {
-        it.next();
-        EmuNWAccessClient* client = it.key();
-        ClientInfo& info = it.value();
-        if (!client->isConnected())
-        {
-            info.checkState = DetectState::CHECK_CONNECTION;
-            client->connectToHost("localhost", info.port);
-            QTimer::singleShot(100, this, [=] {
-                if (!client->isConnected())
-                    checkFailed(client, Error::DeviceError::DE_EMUNWA_NO_CLIENT);
-            });
-        } else {
-            info.checkState = DetectState::CHECK_EMU_INFO;
-            client->cmdEmulatorInfo();
-        }
-        cpt++;
+        probesRunning++;
+        if (it.value().identified)
+            refreshStatus(it.key());
+        else
+            probe(it.key());
     }
+    if (probesRunning == 0)
+        probeDone();
 }
 
-void EmuNetworkAccessFactory::checkFailed(EmuNWAccessClient *client, Error::DeviceError err)
+void    EmuNetworkAccessFactory::probe(EmuNWAccessClient* client)
 {
-    sDebug() << "Check failed : " << err << "checked " << checkedCount + 1 << " / 5";
-    clientInfos[client].checkState = DetectState::NO_CHECK;
-    checkedCount++;
-    if (doingDeviceStatus)
-    {
-        if (err != Error::DeviceError::DE_EMUNWA_NO_CLIENT)
-        {
-            QString piko = QString("Client %1").arg(clientInfos[client].port);
-            devFacStatus.deviceNames.append(piko);
-            devFacStatus.deviceStatus[piko].error = err;
-            clientInfos[client].deviceName.clear();
-        }
-    }
-    if (checkedCount == 5)
+    ClientInfo& info = clientInfos[client];
+    unsigned int probeId = ++info.probeId;
+    if (!client->isConnected())
     {
-        if (doingDeviceList)
-        {
-            doingDeviceList = false;
-            clientInfos[client].deviceName.clear();
-            emit devicesListDone();
-        }
-        if (doingDeviceStatus)
-        {
-            doingDeviceStatus = false;
-            if (devFacStatus.deviceNames.isEmpty())
-                devFacStatus.generalError = Error::DeviceFactoryError::DFE_EMUNWA_NO_CLIENT;
-            emit deviceStatusDone(devFacStatus);
-        }
+        info.checkState = DetectState::CHECK_CONNECTION;
+        client->connectToHost("localhost", info.port);
+        QTimer::singleShot(connectTimeout, this, [=] {
+            if (clientInfos[client].probeId == probeId && clientInfos[client].checkState == DetectState::CHECK_CONNECTION)
+                checkFailed(client, Error::DeviceError::DE_EMUNWA_NO_CLIENT);
+        });
+    } else {
+        info.checkState = DetectState::CHECK_EMU_INFO;
+        client->cmdEmulatorInfo();
     }
+    // Something listening that never answers is not an emulator we can use
+    QTimer::singleShot(probeTimeout, this, [=] {
+        if (clientInfos[client].probeId == probeId && clientInfos[client].checkState != DetectState::NO_CHECK)
+            checkFailed(client, Error::DeviceError::DE_EMUNWA_INCOMPATIBLE_CLIENT);
+    });
+}
+
+void EmuNetworkAccessFactory::checkFailed(EmuNWAccessClient *client, Error::DeviceError err)
+{
+    ClientInfo& info = clientInfos[client];
+    if (info.checkState == DetectState::NO_CHECK)
+        return ;
+    sDebug() << "Check failed on port" << info.port << ":" << err;
+    info.checkState = DetectState::NO_CHECK;
+    info.lastError = err;
+    info.deviceName.clear();
+    if (client->isConnected())
+        client->disconnectFromHost();
+    probeDone();
 }
 
 void EmuNetworkAccessFactory::checkSuccess(EmuNWAccessClient *client)
 {
-    sDebug() << "Check success : checked " << checkedCount + 1 << " / 5";
-    clientInfos[client].checkState = DetectState::NO_CHECK;
+    ClientInfo& info = clientInfos[client];
+    sDebug() << "Check success on port" << info.port << ":" << info.deviceName;
+    info.lastError = Error::DeviceError::DE_NO_ERROR;
+    // Listed once its status is known, so attach can answer
+    refreshStatus(client);
+}
+
+void EmuNetworkAccessFactory::refreshStatus(EmuNWAccessClient *client)
+{
+    ClientInfo& info = clientInfos[client];
+    unsigned int probeId = ++info.probeId;
+    info.checkState = DetectState::CHECK_EMU_STATUS;
+    client->cmdEmulationStatus();
+    // An emulator busy loading a game can be slow, keep the last status
+    QTimer::singleShot(probeTimeout, this, [=] {
+        if (clientInfos[client].probeId == probeId && clientInfos[client].checkState != DetectState::NO_CHECK)
+            statusDone(client);
+    });
+}
+
+void EmuNetworkAccessFactory::statusDone(EmuNWAccessClient *client)
+{
+    ClientInfo& info = clientInfos[client];
+    info.checkState = DetectState::NO_CHECK;
     // The device is created by attach
+    if (!info.identified)
+    {
+        info.identified = true;
+        emit deviceAppeared(info.deviceName);
+    }
+    probeDone();
+}
+
+void EmuNetworkAccessFactory::probeDone()
+{
+    if (probesRunning > 0)
+        probesRunning--;
+    if (probesRunning != 0)
+        return ;
+    firstRoundDone = true;
     if (doingDeviceList)
-        emit newDeviceName(clientInfos[client].deviceName);
+        answerDeviceList();
     if (doingDeviceStatus)
+        answerDevicesStatus();
+}
+
+void EmuNetworkAccessFactory::answerDeviceList()
+{
+    doingDeviceList = false;
+    for (const auto& info : qAsConst(clientInfos))
     {
-        QString &piko = clientInfos[client].deviceName;
-        devFacStatus.deviceNames.append(piko);
-        devFacStatus.deviceStatus[piko].error = Error::DeviceError::DE_NO_ERROR;
+        if (info.identified)
+            emit newDeviceName(info.deviceName);
     }
-    checkedCount++;
-    if (checkedCount == 5)
+    emit devicesListDone();
+}
+
+void EmuNetworkAccessFactory::answerDevicesStatus()
+{
+    doingDeviceStatus = false;
+    devFacStatus.deviceNames.clear();
+    devFacStatus.deviceStatus.clear();
+    devFacStatus.status = Error::DeviceFactoryStatusEnum::DFS_EMUNWA_NO_CLIENT;
+    devFacStatus.generalError = Error::DeviceFactoryError::DFE_NO_ERROR;
+    for (const auto& info : qAsConst(clientInfos))
     {
-        if (doingDeviceList)
+        if (info.identified)
         {
-            doingDeviceList = false;
-            emit devicesListDone();
+            devFacStatus.deviceNames.append(info.deviceName);
+            devFacStatus.deviceStatus[info.deviceName].error = Error::DeviceError::DE_NO_ERROR;
+            continue;
         }
-        if (doingDeviceStatus)
+        if (info.lastError != Error::DeviceError::DE_EMUNWA_NO_CLIENT)
         {
-            doingDeviceStatus = false;
-            emit deviceStatusDone(devFacStatus);
+            QString piko = QString("Client %1").arg(info.port);
+            devFacStatus.deviceNames.append(piko);
+            devFacStatus.deviceStatus[piko].error = info.lastError;
         }
     }
+    if (devFacStatus.deviceNames.isEmpty())
+        devFacStatus.generalError = Error::DeviceFactoryError::DFE_EMUNWA_NO_CLIENT;
+    emit deviceStatusDone(devFacStatus);
 }
 
+// Both are answered right away once the first discovery round is done,
+// queued so the caller gets the signals after returning like before
 bool EmuNetworkAccessFactory::asyncListDevices()
 {
     sDebug() << "Device list";
     if (doingDeviceList)
         return true;
     doingDeviceList = true;
-    checkStatus();
+    if (!firstRoundDone)
+        startDiscovery();
+    else
+        QTimer::singleShot(0, this, [=] {
+            if (doingDeviceList)
+                answerDeviceList();
+        });
     return true;
 }
 
@@ -307,31 +400,31 @@ bool EmuNetworkAccessFactory::devicesStatus()
     if (doingDeviceStatus)
         return true;
     doingDeviceStatus = true;
-    devFacStatus.deviceNames.clear();
-    devFacStatus.deviceStatus.clear();
-    devFacStatus.status = Error::DeviceFactoryStatusEnum::DFS_EMUNWA_NO_CLIENT;
-    devFacStatus.generalError = Error::DeviceFactoryError::DFE_NO_ERROR;
-    checkStatus();
+    if (!firstRoundDone)
+        startDiscovery();
+    else
+        QTimer::singleShot(0, this, [=] {
+            if (doingDeviceStatus)
+                answerDevicesStatus();
+        });
     return true;
 }
 
 void EmuNetworkAccessFactory::onClientDisconnected()
 {
-    sDebug() << "Client disconnected";
-    //return ; // this is kinda useless?
     EmuNWAccessClient* client = qobject_cast<EmuNWAccessClient*>(sender());
-    QMutableMapIterator<EmuNWAccessClient*, ClientInfo> it(clientInfos);
-    while (it.hasNext())
-    {
-        it.next();
-        if (it.value().client == client)
-        {
-            sDebug()  << "Client disconnected, closing " << it.value().deviceName;
-            if (it.value().device != nullptr && it.value().device->state() != ADevice::CLOSED)
-                it.value().device->close();
-            return;
-        }
-    }
+    ClientInfo& info = clientInfos[client];
+    if (!info.identified)
+        return ;
+    sDebug()  << "Client disconnected, closing " << info.deviceName;
+    info.identified = false;
+    info.statusKnown = false;
+    info.lastError = Error::DeviceError::DE_EMUNWA_NO_CLIENT;
+    if (info.device != nullptr && info.device->state() != ADevice::CLOSED)
+        info.device->close();
+    emit deviceDisappeared(info.deviceName);
+    if (info.device == nullptr)
+        info.deviceName.clear();
 }
 
 void EmuNetworkAccessFactory::onClientConnected()
@@ -22,6 +22,7 @@
 #define EMUNETWORKACCESSFACTORY_H
 
 #include <QObject>
+#include <QTimer>
 #include "../devicefactory.h"
 #include "emunetworkaccessdevice.h"
 #include "emunwaccessclient.h"
@@ -39,6 +40,8 @@ public:
         DOING_NAME,
         CHECK_EMU_INFO,
         CHECK_CORE_LIST,
+        CHECK_EMU_STATUS,
+        CHECK_CORE_INFO
     };
     Q_ENUM(DetectState)
 
@@ -57,22 +60,48 @@ private:
         EmuNetworkAccessDevice* device;
         QString                 deviceName;
         enum DetectState        checkState;
-        bool                    doingAttach;
+        bool                    identified;
+        // Last EMULATION_STATUS and CORE_CURRENT_INFO, attach answers from them
+        bool                    statusKnown;
+        QString                 emulationState;
+        QString                 game;
+        QString                 platform;
+        Error::DeviceError      lastError;
+        unsigned int            probeId;
         int                     port;
     };
-    unsigned int checkedCount;
+    /*
+     * Every port of the range is probed at the same time in the background,
+     * an identified emulator keeps its connection until it goes away.
+     * DeviceList and DeviceStatus are answered from what the probes found.
+     * Each round also refreshes the emulation status of the identified emulators for attach.
+    */
+    unsigned int probesRunning;
+    bool    firstRoundDone;
     bool    doingDeviceStatus;
     bool    doingDeviceList;
     DeviceFactoryStatus  devFacStatus;
     unsigned short          startingPort;
+    unsigned short          portCount;
+    int                     connectTimeout;
+    int                     probeTimeout;
+    QTimer                  discoveryTimer;
 
-    void    checkStatus();
+    void    startDiscovery();
+    void    probe(EmuNWAccessClient* client);
     void    checkFailed(EmuNWAccessClient* client, Error::DeviceError);
     void    checkSuccess(EmuNWAccessClient* client);
+    void    refreshStatus(EmuNWAccessClient* client);
+    void    statusDone(EmuNWAccessClient* client);
+    void    probeDone();
+    void    answerDeviceList();
+    void    answerDevicesStatus();
 
     // DeviceFactory interface
 
     QMap<EmuNWAccessClient*, ClientInfo>    clientInfos;
+    // Keyed by device name and game, survives the devices being deleted
+    QMap<QString, EmuNetworkAccessDevice::Capabilities> capabilitiesCache;
 
  private slots:
     void    onClientDisconnected();
@@ -107,17 +107,42 @@ void LuaBridge::onNewConnection()
     allocatedNames << devName;
     LuaBridgeDevice*    newDev = new LuaBridgeDevice(newclient, devName);
     connect(newclient, &QTcpSocket::disconnected, this, &LuaBridge::onClientDisconnected);
-    m_devices.append(newDev);
-    mapSockDev[newclient] = newDev;
+    // The device is only listed once the script answered the handshake
+    connect(newDev, &LuaBridgeDevice::handshakeFinished, this, [=] {
+        if (!handshakes.contains(newclient))
+            return ;
+        sDebug() << "Handshake done" << devName;
+        handshakes.remove(newclient);
+        m_devices.append(newDev);
+        mapSockDev[newclient] = newDev;
+        emit deviceAppeared(newDev->name());
+    });
+    handshakes[newclient] = newDev;
+    newDev->startHandshake();
     newclient->write(QString("SetName|%1\n").arg(devName).toLatin1());
 }
 
 void LuaBridge::onClientDisconnected()
 {
     QTcpSocket* sock = qobject_cast<QTcpSocket*>(sender());
-    LuaBridgeDevice* ldev = mapSockDev[sock];
+    if (handshakes.contains(sock))
+    {
+        LuaBridgeDevice* ldev = handshakes.take(sock);
+        sDebug() << "Lua script closed the connection during the handshake" << ldev->luaName();
+        allocatedNames.removeAll(ldev->luaName());
+        if (allocatedNames.isEmpty())
+            rng->seed(rngSeed);
+        ldev->deleteLater();
+        sock->deleteLater();
+        return ;
+    }
+    // Closing a device the server dropped ends here too, it is already gone
+    if (!mapSockDev.contains(sock))
+        return ;
+    LuaBridgeDevice* ldev = mapSockDev.value(sock);
     sDebug() << "Lua script closed the connection" << ldev->luaName();
     emit ldev->closed();
+    emit deviceDisappeared(ldev->name());
     allocatedNames.removeAll(ldev->luaName());
     if (allocatedNames.isEmpty())
     {
@@ -54,6 +54,7 @@ private:
     QRandomGenerator*           rng;
     quint32                     rngSeed;
     QMap<QTcpSocket*, LuaBridgeDevice*> mapSockDev;
+    QMap<QTcpSocket*, LuaBridgeDevice*> handshakes;
 
 };
 
@@ -24,6 +24,7 @@
 #include <QJsonDocument>
 #include <QJsonObject>
 #include <QLoggingCategory>
+#include <QtEndian>
 
 #include "../rommapping/rommapping.h"
 #include "../rommapping/rominfo.h"
@@ -34,6 +35,15 @@ Q_LOGGING_CATEGORY(log_luaBridgeDevice, "LUABridgeDevice")
 
 #define setState(X_STATE) sDebug() << "Changed state to " << X_STATE << "in" <<  __func__; m_state = X_STATE;
 
+/*
+ * Protocol 2 frames : marker, opcode, payload size (4 bytes big endian) then the payload.
+ * Read and write payloads are ranges of domain (1 byte), address and size (4 bytes each),
+ * write ranges are followed by their data. A read is answered by one 'r' frame with all the data.
+ * Text commands are still used for everything else.
+ */
+static const char   frameMarker = 2;
+static const int    frameHeaderSize = 6;
+
 LuaBridgeDevice::LuaBridgeDevice(QTcpSocket* sock, QString name)
 {
     timer.setInterval(3);
@@ -42,52 +52,108 @@ LuaBridgeDevice::LuaBridgeDevice(QTcpSocket* sock, QString name)
     m_socket = sock;
     m_name = name;
     infoReq = false;
-    romMapping = LoROM;
-    sDebug() << "LUA bridge device created";
-    sock->write("Version\n");
+    putSize = 0;
+    pendingReads = 0;
+    protocolVersion = 1;
     bizhawk = false;
-    if (sock->waitForReadyRead(50))
-    {
-        QByteArray data = sock->readAll();
-        sDebug() << "Version reply : " << data;
-        if (data.indexOf("BizHawk") != -1)
-            bizhawk = true;
-    }
-    getRomMapping();
+    handshakeState = HandshakeState::VERSION;
+    handshakeTimer.setInterval(2000);
+    handshakeTimer.setSingleShot(true);
+    sDebug() << "LUA bridge device created";
     connect(&timer, SIGNAL(timeout()), this, SLOT(onTimerOut()));
+    connect(&handshakeTimer, &QTimer::timeout, this, &LuaBridgeDevice::onHandshakeTimeout);
     connect(m_socket, SIGNAL(readyRead()), this, SLOT(onClientReadyRead()));
 }
 
+/*
+ * The handshake asks for the script version then reads the ROM header to know the mapping.
+ * The Lua script only answers once per emulator frame, so nothing waits on the socket here,
+ * handshakeFinished is emitted when both replies are there or when they timed out.
+ */
+
+void LuaBridgeDevice::startHandshake()
+{
+    sDebug() << "Starting handshake";
+    handshakeState = HandshakeState::VERSION;
+    m_socket->write("Version|2\n");
+    handshakeTimer.start();
+}
+
+bool LuaBridgeDevice::handshakeDone() const
+{
+    return handshakeState == HandshakeState::DONE;
+}
 
-// FIXME
-void    LuaBridgeDevice::getRomMapping()
+void LuaBridgeDevice::requestRomMapping()
 {
     sDebug() << "Trying to get ROM mapping";
+    handshakeState = HandshakeState::ROM_MAPPING;
     if (bizhawk)
         m_socket->write("Read|" + QByteArray::number(0x7FC0) + "|32|CARTROM\n");
     else
         m_socket->write("Read|" +  QByteArray::number(0x00FFC0) + "|32\n");
-    if (m_socket->waitForReadyRead(100))
+    handshakeTimer.start();
+}
+
+void LuaBridgeDevice::processHandshake()
+{
+    int eol;
+    while (handshakeState != HandshakeState::DONE && (eol = dataRead.indexOf('\n')) != -1)
     {
-        QByteArray data;
-        QByteArray dataRead = m_socket->readAll();
-        QJsonDocument   jdoc = QJsonDocument::fromJson(dataRead);
-        QJsonObject     job = jdoc.object();
-        QJsonArray      aData = job["data"].toArray();
-        //sDebug() << aData;
-        foreach (QVariant v, aData.toVariantList())
+        QByteArray line = dataRead.left(eol + 1);
+        dataRead.remove(0, eol + 1);
+        if (handshakeState == HandshakeState::VERSION)
+        {
+            sDebug() << "Version reply : " << line;
+            if (line.indexOf("BizHawk") != -1)
+                bizhawk = true;
+            // Older scripts just ignore the version we ask for
+            QList<QByteArray> parts = line.trimmed().split('|');
+            if (parts.size() > 3 && parts.at(3) == "2")
+                protocolVersion = 2;
+            sDebug() << "Using protocol" << protocolVersion;
+            requestRomMapping();
+            continue;
+        }
+        // A version reply that came after the timeout
+        if (line.startsWith("Version"))
+            continue;
+        readData.clear();
+        if (parseJsonReply(line) && readData.size() == 32)
         {
-            data.append(static_cast<char>(v.toInt()));
+            sDebug() << readData.toHex();
+            struct rom_infos* rInfos = get_rom_info(readData.data());
+            gameName = rInfos->title;
+            sDebug() << gameName << rInfos->title;
+            addressMapper.setRomType(rInfos->type);
+            free(rInfos);
         }
-        sDebug() << data.toHex();
-        //sDebug() << data.at(21);
-        struct rom_infos* rInfos = get_rom_info(data.data());
-        gameName = rInfos->title;
-        sDebug() << gameName << rInfos->title;
-        romMapping = rInfos->type;
-        free(rInfos);
+        readData.clear();
+        finishHandshake();
     }
-    sDebug() << "ROM is " << rommapping_to_name[romMapping] << romMapping;
+}
+
+void LuaBridgeDevice::onHandshakeTimeout()
+{
+    if (handshakeState == HandshakeState::VERSION)
+    {
+        sDebug() << "No version reply, using the defaults";
+        requestRomMapping();
+        return ;
+    }
+    if (handshakeState == HandshakeState::ROM_MAPPING)
+    {
+        sDebug() << "No ROM header reply";
+        finishHandshake();
+    }
+}
+
+void LuaBridgeDevice::finishHandshake()
+{
+    handshakeTimer.stop();
+    handshakeState = HandshakeState::DONE;
+    sDebug() << "ROM is " << rommapping_to_name[addressMapper.romType()];
+    emit handshakeFinished();
 }
 
 /*
@@ -102,94 +168,97 @@ void    LuaBridgeDevice::getRomMapping()
 "7": "System Bus"
  * */
 
-QPair<QByteArray, unsigned int>    LuaBridgeDevice::getBizHawkAddress(unsigned int addr)
+AddressMapper::SplitMode LuaBridgeDevice::splitMode() const
 {
-    QPair<QByteArray, unsigned int> toret;
-    if (addr >= 0xF50000 && addr < 0xF70000)
-    {
-        toret.first = "WRAM";
-        toret.second = addr - 0xF50000;
-        return toret;
-    }
-    if (addr >= 0xE00000)
+    // BizHawk accesses the memory by domain, snes9x only has the SNES bus
+    return bizhawk ? AddressMapper::ByRegion : AddressMapper::ByBusRange;
+}
+
+QPair<QByteArray, unsigned int> LuaBridgeDevice::memoryLocation(const AddressMapper::Piece &piece) const
+{
+    if (!bizhawk)
+        return qMakePair(QByteArray(), static_cast<unsigned int>(piece.busAddress));
+    switch (piece.region)
     {
-        toret.first = "CARTRAM";
-        toret.second = addr - 0xE00000;
-        return toret;
+    case AddressMapper::WRAM:
+        return qMakePair(QByteArray("WRAM"), piece.offset);
+    case AddressMapper::SRAM:
+        return qMakePair(QByteArray("CARTRAM"), piece.offset);
+    default:
+        return qMakePair(QByteArray("CARTROM"), piece.offset);
     }
-    toret.first = "CARTROM";
-    toret.second = addr;
-    return toret;
 }
 
-/* This is from asar code from https://github.com/RPGHacker/asar/blob/master/src/asar/libsmw.h#L125
-*/
+QByteArray LuaBridgeDevice::readCommand(const AddressMapper::Piece &piece)
+{
+    auto location = memoryLocation(piece);
+    QByteArray toret = "Read|" + QByteArray::number(location.second) + "|" + QByteArray::number(piece.size);
+    if (bizhawk)
+        toret += "|" + location.first;
+    return toret + "\n";
+}
 
-static int asarpctosnes(unsigned int addr2, int mapper)
+QByteArray LuaBridgeDevice::writeCommand(const AddressMapper::Piece &piece, const QByteArray &data)
 {
-    int addr = static_cast<unsigned int>(addr2);
-    if (mapper==LoROM)
-    {
-        if (addr>=0x400000) return -1;
-        addr=((addr<<1)&0x7F0000)|(addr&0x7FFF)|0x8000;
-        return addr|0x800000;
-    }
-    if (mapper==HiROM)
-    {
-        if (addr>=0x400000) return -1;
-        return addr|0xC00000;
-    }
-    if (mapper == ExLoROM)
-    {
-        if (addr>=0x800000) return -1;
-        if (addr&0x400000)
-        {
-            addr-=0x400000;
-            addr=((addr<<1)&0x7F0000)|(addr&0x7FFF)|0x8000;
-            return addr;
-        }
-        else
-        {
-            addr=((addr<<1)&0x7F0000)|(addr&0x7FFF)|0x8000;
-            return addr|0x800000;
-        }
-    }
-    if (mapper == ExHiROM)
-    {
-        if (addr>=0x800000) return -1;
-        if (addr&0x400000) return addr;
-        return addr|0xC00000;
-    }
-    return -1;
+    auto location = memoryLocation(piece);
+    QByteArray toSend = "Write|" + QByteArray::number(location.second);
+    if (bizhawk)
+        toSend += "|" + location.first;
+    for (int i = 0; i < data.size(); i++)
+        toSend += "|" + QByteArray::number(static_cast<unsigned char>(data.at(i)));
+    toSend += "\n";
+    return toSend;
 }
 
-unsigned int LuaBridgeDevice::getSnes9xAddress(unsigned int addr)
+QByteArray LuaBridgeDevice::rangeHeader(const AddressMapper::Piece &piece)
 {
-    if (addr >= 0xF50000 && addr < 0xF70000)
-        return addr - 0xF50000 + 0x7E0000;
-    if (addr >= 0xE00000)
-    {
-        enum rom_type mapping = romMapping;
-        if (mapping == ExHiROM)
-            mapping = HiROM;
-        return static_cast<unsigned int>(rommapping_sram_pc_to_snes(addr - 0xE00000, mapping, false));
-    }
-    return static_cast<unsigned int>(asarpctosnes(addr, romMapping));
+    static const QList<QByteArray> domains = QList<QByteArray>() << "System Bus" << "WRAM" << "CARTROM" << "CARTRAM";
+    auto location = memoryLocation(piece);
+    char header[9];
+    header[0] = bizhawk ? static_cast<char>(domains.indexOf(location.first)) : 0;
+    qToBigEndian<quint32>(location.second, header + 1);
+    qToBigEndian<quint32>(piece.size, header + 5);
+    return QByteArray(header, 9);
+}
+
+QByteArray LuaBridgeDevice::frame(char opcode, const QByteArray &payload) const
+{
+    char header[frameHeaderSize];
+    header[0] = frameMarker;
+    header[1] = opcode;
+    qToBigEndian<quint32>(static_cast<quint32>(payload.size()), header + 2);
+    return QByteArray(header, frameHeaderSize) + payload;
 }
 
 void LuaBridgeDevice::getAddrCommand(SD2Snes::space space, unsigned int addr, unsigned int size)
 {
     Q_UNUSED(space)
+    sendReads(addressMapper.map(addr, size, splitMode()));
+}
+
+void LuaBridgeDevice::sendReads(const QList<AddressMapper::Piece> &pieces)
+{
+    if (!AddressMapper::isMapped(pieces, splitMode()))
+    {
+        sDebug() << "Address not mapped for this game";
+        emit protocolError();
+        return ;
+    }
     QByteArray toWrite;
-    if (bizhawk)
+    if (protocolVersion == 2)
     {
-        auto info = getBizHawkAddress(addr);
-        toWrite = "Read|" + QByteArray::number(info.second) + "|" + QByteArray::number(size) + "|"
-                + info.first + "\n";
+        QByteArray ranges;
+        for (const auto& piece : pieces)
+            ranges += rangeHeader(piece);
+        toWrite = frame('R', ranges);
     } else {
-        toWrite = "Read|" + QByteArray::number(getSnes9xAddress(addr)) + "|" + QByteArray::number(size) + "\n";
+        for (const auto& piece : pieces)
+            toWrite += readCommand(piece);
     }
 
+    readData.clear();
+    pendingReads = protocolVersion == 2 ? 1 : pieces.size();
+    markCommandSent();
     sDebug() << ">>" << toWrite;
     sDebug() << "Writen" << m_socket->write(toWrite) << "Bytes";
     setState(BUSY);
@@ -198,15 +267,29 @@ void LuaBridgeDevice::getAddrCommand(SD2Snes::space space, unsigned int addr, un
 void LuaBridgeDevice::putAddrCommand(SD2Snes::space space, unsigned int addr, unsigned int size)
 {
     Q_UNUSED(space)
-    setState(BUSY);
-    putAddr = addr;
-    putSize = size;
+    startPut(addressMapper.map(addr, size, splitMode()));
 }
 
 void LuaBridgeDevice::putAddrCommand(SD2Snes::space space, QList<QPair<unsigned int, quint8> > &args)
 {
     Q_UNUSED(space)
-    Q_UNUSED(args)
+    startPut(addressMapper.map(args, splitMode()));
+}
+
+void LuaBridgeDevice::startPut(const QList<AddressMapper::Piece> &pieces)
+{
+    if (!AddressMapper::isMapped(pieces, splitMode()))
+    {
+        sDebug() << "Address not mapped for this game";
+        emit protocolError();
+        return ;
+    }
+    setState(BUSY);
+    putPieces = pieces;
+    putSize = 0;
+    for (const auto& piece : pieces)
+        putSize += piece.size;
+    putData.clear();
 }
 
 void LuaBridgeDevice::putAddrCommand(SD2Snes::space space, unsigned char flags, unsigned int addr, unsigned int size)
@@ -224,28 +307,29 @@ void LuaBridgeDevice::infoCommand()
 
 void LuaBridgeDevice::writeData(QByteArray data)
 {
-    static unsigned int receivedSize = 0;
-    static QByteArray received = QByteArray();
-    receivedSize += static_cast<unsigned int>(data.size());
-    received += data;
-    sDebug() << "Write data" << receivedSize << putSize;
-    if (receivedSize == putSize)
+    putData += data;
+    sDebug() << "Write data" << putData.size() << putSize;
+    if (static_cast<unsigned int>(putData.size()) == putSize)
     {
+        // Write has no reply, every range goes in one socket write
         QByteArray toSend;
-        if (bizhawk)
+        int offset = 0;
+        for (const auto& piece : qAsConst(putPieces))
         {
-            auto info = getBizHawkAddress(putAddr);
-            toSend = "Write|" + QByteArray::number(info.second) + "|" + info.first;
-        } else {
-            toSend = "Write|" + QByteArray::number(getSnes9xAddress(putAddr));
+            QByteArray pieceData = putData.mid(offset, static_cast<int>(piece.size));
+            if (protocolVersion == 2)
+                toSend += rangeHeader(piece) + pieceData;
+            else
+                toSend += writeCommand(piece, pieceData);
+            offset += static_cast<int>(piece.size);
         }
-        for (int i = 0; i < received.size(); i++)
-            toSend += "|" + QByteArray::number(static_cast<unsigned char>(received.at(i)));
-        toSend += "\n";
+        if (protocolVersion == 2)
+            toSend = frame('W', toSend);
         sDebug() << ">>" << toSend;
         m_socket->write(toSend);
-        receivedSize = 0;
-        received.clear();
+        putData.clear();
+        putPieces.clear();
+        putSize = 0;
         setState(READY);
         emit commandFinished();
     }
@@ -271,6 +355,11 @@ bool LuaBridgeDevice::hasControlCommands()
     return false;
 }
 
+bool LuaBridgeDevice::hasVariaditeCommands()
+{
+    return true;
+}
+
 USB2SnesInfo LuaBridgeDevice::parseInfo(const QByteArray &data)
 {
     Q_UNUSED(data)
@@ -316,48 +405,93 @@ void LuaBridgeDevice::onServerError()
     emit closed();
 }
 
-void LuaBridgeDevice::onClientReadyRead()
+bool LuaBridgeDevice::parseJsonReply(const QByteArray &line)
 {
-    static      QByteArray  dataRead = QByteArray();
+    QJsonParseError jsError;
+    QJsonDocument   jdoc = QJsonDocument::fromJson(line, &jsError);
+    if (jdoc.isNull())
+    {
+        sDebug() << jsError.errorString();
+        return false;
+    }
 
+    QJsonObject     job = jdoc.object();
+    if (!job.contains("data"))
+    {
+        sDebug() << "JSON from lua does not contain the data";
+        return false;
+    }
+    QJsonArray      aData = job["data"].toArray();
+    //sDebug() << aData;
+    foreach (QVariant v, aData.toVariantList())
+    {
+        readData.append(static_cast<char>(v.toInt()));
+    }
+    return true;
+}
+
+// Each Read gives one JSON object on its own line or one frame, a multi range read waits for all of them
+void LuaBridgeDevice::onClientReadyRead()
+{
+    markDataReceived();
     QByteArray  data = m_socket->readAll();
     dataRead += data;
 
-    sDebug() << "<<" << data;
-    if (dataRead.right(1) == "\n")
+    if (protocolVersion == 2)
+        sDebug() << "<<" << data.size() << "bytes";
+    else
+        sDebug() << "<<" << data;
+    if (handshakeState != HandshakeState::DONE)
     {
-        QJsonParseError jsError;
-        QJsonDocument   jdoc = QJsonDocument::fromJson(dataRead, &jsError);
-        if (jdoc.isNull())
-        {
-            sDebug() << jsError.errorString();
-            setState(READY);
-            emit protocolError();
-            dataRead.clear();
+        processHandshake();
+        if (handshakeState != HandshakeState::DONE)
             return ;
-        }
-
-        QJsonObject     job = jdoc.object();
-        if (!job.contains("data"))
+    }
+    while (!dataRead.isEmpty())
+    {
+        if (dataRead.at(0) == frameMarker)
         {
-            sDebug() << "JSON from lua does not contain the data";
-            setState(READY);
-            emit protocolError();
-            dataRead.clear();
-            return ;
+            if (dataRead.size() < frameHeaderSize)
+                break;
+            int size = static_cast<int>(qFromBigEndian<quint32>(dataRead.constData() + 2));
+            if (dataRead.size() < frameHeaderSize + size)
+                break;
+            QByteArray payload = dataRead.mid(frameHeaderSize, size);
+            dataRead.remove(0, frameHeaderSize + size);
+            if (pendingReads == 0)
+            {
+                sDebug() << "Unexpected frame from lua" << size;
+                continue;
+            }
+            readData += payload;
+        } else {
+            int eol = dataRead.indexOf('\n');
+            if (eol == -1)
+                break;
+            QByteArray line = dataRead.left(eol + 1);
+            dataRead.remove(0, eol + 1);
+            if (pendingReads == 0)
+            {
+                sDebug() << "Unexpected data from lua" << line;
+                continue;
+            }
+            if (!parseJsonReply(line))
+            {
+                setState(READY);
+                emit protocolError();
+                dataRead.clear();
+                pendingReads = 0;
+                return ;
+            }
         }
-        QJsonArray      aData = job["data"].toArray();
-        //sDebug() << aData;
-        data.clear();
-        foreach (QVariant v, aData.toVariantList())
+        if (--pendingReads == 0)
         {
-            data.append(static_cast<char>(v.toInt()));
+            //sDebug() << readData;
+            setState(READY);
+            emit getDataReceived(readData);
+            emit commandFinished();
+            readData.clear();
         }
-        //sDebug() << data;
-        setState(READY);
-        emit getDataReceived(data);
-        emit commandFinished();
-        dataRead.clear();
     }
 }
 
@@ -417,5 +551,5 @@ void LuaBridgeDevice::sendCommand(SD2Snes::opcode opcode, SD2Snes::space space,
 void LuaBridgeDevice::getAddrCommand(SD2Snes::space space, QList<QPair<unsigned int, quint8> > &args)
 {
     Q_UNUSED(space)
-    Q_UNUSED(args)
+    sendReads(addressMapper.map(args, splitMode()));
 }
@@ -27,7 +27,7 @@
 #include <QTcpServer>
 #include <QTcpSocket>
 #include <QTimer>
-#include "../rommapping/rommapping.h"
+#include "../rommapping/addressmapper.h"
 
 
 class LuaBridgeDevice : public ADevice
@@ -54,10 +54,16 @@ public:
     QString name() const;
     bool hasFileCommands();
     bool hasControlCommands();
+    bool hasVariaditeCommands();
     USB2SnesInfo parseInfo(const QByteArray &data);
     QList<ADevice::FileInfos> parseLSCommand(QByteArray &dataI);
     QTcpSocket* socket();
     QString luaName() const;
+    void startHandshake();
+    bool handshakeDone() const;
+
+signals:
+    void    handshakeFinished();
 
 public slots:
     bool open();
@@ -68,21 +74,44 @@ private slots:
     void    onClientReadyRead();
     void    onClientDisconnected();
     void    onTimerOut();
+    void    onHandshakeTimeout();
 
 private:
+    enum class HandshakeState {
+        VERSION,
+        ROM_MAPPING,
+        DONE
+    };
+
     QTcpSocket*     m_socket;
     QTimer          timer;
+    QTimer          handshakeTimer;
+    HandshakeState  handshakeState;
     QString         m_name;
-    unsigned int    putAddr;
+    QList<AddressMapper::Piece> putPieces;
     unsigned int    putSize;
+    QByteArray      putData;
+    QByteArray      dataRead;
+    QByteArray      readData;
+    int             pendingReads;
+    int             protocolVersion;
     bool            bizhawk;
-    enum rom_type   romMapping;
+    AddressMapper   addressMapper;
     QString         gameName;
     bool            infoReq;
 
-    void getRomMapping();
-    QPair<QByteArray, unsigned int> getBizHawkAddress(unsigned int usbAddr);
-    unsigned int getSnes9xAddress(unsigned int addr);
+    void requestRomMapping();
+    void processHandshake();
+    void finishHandshake();
+    AddressMapper::SplitMode splitMode() const;
+    QPair<QByteArray, unsigned int> memoryLocation(const AddressMapper::Piece& piece) const;
+    QByteArray   readCommand(const AddressMapper::Piece& piece);
+    QByteArray   writeCommand(const AddressMapper::Piece& piece, const QByteArray& data);
+    QByteArray   rangeHeader(const AddressMapper::Piece& piece);
+    void         sendReads(const QList<AddressMapper::Piece>& pieces);
+    void         startPut(const QList<AddressMapper::Piece>& pieces);
+    QByteArray   frame(char opcode, const QByteArray& payload) const;
+    bool         parseJsonReply(const QByteArray& line);
 };
 
 #endif // LUABRIDGEDEVICE_H
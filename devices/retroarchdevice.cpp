@@ -35,6 +35,8 @@ RetroArchDevice::RetroArchDevice(RetroArchHost* mHost)
     host = mHost;
     //hasRomAccess = !info.gameName.isEmpty();
     m_state = READY;
+    multiPutSize = 0;
+    multiPacketTime = -1;
     sDebug() << "Retroarch device created";
     hostName = mHost->name();
     connect(mHost, &RetroArchHost::infoDone, this, &RetroArchDevice::onRHInfoDone);
@@ -54,7 +56,36 @@ QString RetroArchDevice::name() const
 
 void RetroArchDevice::writeData(QByteArray data)
 {
-    host->writeMemoryData(reqId, data);
+    if (multiPutSize == 0)
+    {
+        host->writeMemoryData(reqId, data);
+        return ;
+    }
+    multiPutData.append(data);
+    if (multiPutData.size() < multiPutSize)
+        return ;
+    // Everything is there, all the writes are queued at once
+    int offset = 0;
+    for (const auto& arg : qAsConst(multiPutArgs))
+    {
+        qint64 id = host->writeMemory(arg.first, arg.second);
+        if (id == -1)
+        {
+            multiIds.clear();
+            multiPutSize = 0;
+            m_state = CLOSED;
+            sDebug() << "Error, bad address";
+            close();
+            emit protocolError();
+            return ;
+        }
+        multiIds.append(id);
+        host->writeMemoryData(id, multiPutData.mid(offset, arg.second));
+        offset += arg.second;
+    }
+    multiPutSize = 0;
+    multiPutData.clear();
+    multiPutArgs.clear();
 }
 
 void RetroArchDevice::infoCommand()
@@ -125,9 +156,29 @@ void RetroArchDevice::onRHInfoFailled(qint64 id)
 
 void RetroArchDevice::onRHGetMemoryDone(qint64 id)
 {
+    if (multiIds.contains(id))
+    {
+        if (multiPacketTime == -1 || host->getMemoryPacketTime() < multiPacketTime)
+            multiPacketTime = host->getMemoryPacketTime();
+        multiDatas[id] = host->getMemoryData();
+        if (multiDatas.size() != multiIds.size())
+            return ;
+        markDataReceived(multiPacketTime);
+        // Replies can come in any order, the data are sent in the requested order
+        QByteArray data;
+        for (qint64 mId : qAsConst(multiIds))
+            data.append(multiDatas.value(mId));
+        multiIds.clear();
+        multiDatas.clear();
+        m_state = READY;
+        emit getDataReceived(data);
+        emit commandFinished();
+        return ;
+    }
     if (id != reqId)
         return;
     sDebug() << "Get memory done";
+    markDataReceived(host->getMemoryPacketTime());
     m_state = READY;
     emit getDataReceived(host->getMemoryData());
     emit commandFinished();
@@ -135,6 +186,16 @@ void RetroArchDevice::onRHGetMemoryDone(qint64 id)
 
 void RetroArchDevice::onRHWriteMemoryDone(qint64 id)
 {
+    if (multiIds.contains(id))
+    {
+        multiIds.removeOne(id);
+        if (!multiIds.isEmpty())
+            return ;
+        sDebug() << "Multi write memory done";
+        m_state = READY;
+        emit commandFinished();
+        return ;
+    }
     if (id != reqId)
         return;
     sDebug() << "Write memory done";
@@ -167,6 +228,11 @@ bool RetroArchDevice::hasControlCommands()
     return false;
 }
 
+bool RetroArchDevice::hasVariaditeCommands()
+{
+    return true;
+}
+
 void RetroArchDevice::fileCommand(SD2Snes::opcode op, QVector<QByteArray> args)
 {
     Q_UNUSED(op);
@@ -206,6 +272,7 @@ void RetroArchDevice::getAddrCommand(SD2Snes::space space, unsigned int addr, un
         emit protocolError();
         return ;
     }
+    markCommandSent();
     reqId = host->getMemory(addr, size);
     if (reqId == -1)
     {
@@ -219,8 +286,34 @@ void RetroArchDevice::getAddrCommand(SD2Snes::space space, unsigned int addr, un
 
 void RetroArchDevice::getAddrCommand(SD2Snes::space space, QList<QPair<unsigned int, quint8> > &args)
 {
-    Q_UNUSED(space);
-    Q_UNUSED(args);
+    sDebug() << "Multi GetAddress " << space << args;
+    m_state = BUSY;
+    if (space != SD2Snes::SNES)
+    {
+        m_state = CLOSED;
+        sDebug() << "Error, bad address space" << space;
+        close();
+        emit protocolError();
+        return ;
+    }
+    multiIds.clear();
+    multiDatas.clear();
+    multiPacketTime = -1;
+    markCommandSent();
+    for (const auto& arg : qAsConst(args))
+    {
+        qint64 id = host->getMemory(arg.first, arg.second);
+        if (id == -1)
+        {
+            multiIds.clear();
+            m_state = CLOSED;
+            sDebug() << "Error, bad address";
+            close();
+            emit protocolError();
+            return ;
+        }
+        multiIds.append(id);
+    }
 }
 
 void RetroArchDevice::putAddrCommand(SD2Snes::space space, unsigned int addr0, unsigned int size)
@@ -249,8 +342,22 @@ void RetroArchDevice::putAddrCommand(SD2Snes::space space, unsigned int addr0, u
 
 void RetroArchDevice::putAddrCommand(SD2Snes::space space, QList<QPair<unsigned int, quint8> > &args)
 {
-    Q_UNUSED(space);
-    Q_UNUSED(args);
+    sDebug() << "Multi PutAddress " << space << args;
+    m_state = BUSY;
+    if (space != SD2Snes::SNES)
+    {
+        m_state = CLOSED;
+        sDebug() << "Error, bad address space" << space;
+        close();
+        emit protocolError();
+        return ;
+    }
+    multiIds.clear();
+    multiPutArgs = args;
+    multiPutData.clear();
+    multiPutSize = 0;
+    for (const auto& arg : qAsConst(args))
+        multiPutSize += arg.second;
 }
 
 void RetroArchDevice::putAddrCommand(SD2Snes::space space, unsigned char flags, unsigned int addr, unsigned int size)
@@ -66,6 +66,7 @@ public:
     QString name() const;
     bool hasFileCommands();
     bool hasControlCommands();
+    bool hasVariaditeCommands();
     USB2SnesInfo parseInfo(const QByteArray &data);
     QList<ADevice::FileInfos> parseLSCommand(QByteArray &dataI);
 
@@ -88,6 +89,14 @@ private:
     RetroArchHost*  host;
     qint64       reqId;
     QString      hostName;
+    // Multi range commands, the host runs all the ranges concurrently
+    QList<qint64>               multiIds;
+    QMap<qint64, QByteArray>    multiDatas;
+    // The earliest first packet of the ranges
+    qint64                      multiPacketTime;
+    QList<QPair<unsigned int, quint8> > multiPutArgs;
+    QByteArray                  multiPutData;
+    int                         multiPutSize;
 
 signals:
     void    checkReturned();
@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "retroarchhex.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define RAHEX_SSE2
+#endif
+
+/*
+ * Both SIMD paths convert the characters to nibbles (or nibbles to characters)
+ * in registers and do the 3 characters per byte gather/scatter in scalar code,
+ * SSE2 has no byte shuffle and it's still far from the bottleneck.
+ */
+
+static const char hexChars[] = "0123456789abcdef";
+
+static inline int   hexValue(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+int RetroArchHex::encodedSize(int size)
+{
+    return size == 0 ? 0 : size * 3 - 1;
+}
+
+int RetroArchHex::decodedSize(int textSize)
+{
+    return (textSize + 1) / 3;
+}
+
+#if defined(__AVX2__)
+
+// Converts 32 characters, return false if the separators are not at the expected place
+static inline bool  toNibbles32(const char* src, unsigned int hexMask, unsigned char* nibbles)
+{
+    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+    const __m256i digit = _mm256_sub_epi8(v, _mm256_set1_epi8('0'));
+    const __m256i isDigit = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+                                             _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+    const __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    const __m256i alpha = _mm256_sub_epi8(lower, _mm256_set1_epi8('a' - 10));
+    const __m256i isAlpha = _mm256_and_si256(_mm256_cmpgt_epi8(lower, _mm256_set1_epi8('a' - 1)),
+                                             _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), lower));
+    const __m256i isSpace = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+    const __m256i nib = _mm256_or_si256(_mm256_and_si256(isDigit, digit), _mm256_and_si256(isAlpha, alpha));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(nibbles), nib);
+    const unsigned int hex = static_cast<unsigned int>(_mm256_movemask_epi8(_mm256_or_si256(isDigit, isAlpha)));
+    const unsigned int space = static_cast<unsigned int>(_mm256_movemask_epi8(isSpace));
+    return hex == hexMask && space == ~hexMask;
+}
+
+static inline void  toChars32(const char* src, unsigned char* high, unsigned char* low)
+{
+    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+    const __m256i mask = _mm256_set1_epi8(0x0F);
+    const __m256i nine = _mm256_set1_epi8(9);
+    const __m256i zero = _mm256_set1_epi8('0');
+    const __m256i letterOffset = _mm256_set1_epi8('a' - '0' - 10);
+    __m256i h = _mm256_and_si256(_mm256_srli_epi16(v, 4), mask);
+    __m256i l = _mm256_and_si256(v, mask);
+    h = _mm256_add_epi8(_mm256_add_epi8(h, zero), _mm256_and_si256(_mm256_cmpgt_epi8(h, nine), letterOffset));
+    l = _mm256_add_epi8(_mm256_add_epi8(l, zero), _mm256_and_si256(_mm256_cmpgt_epi8(l, nine), letterOffset));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(high), h);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(low), l);
+}
+
+#elif defined(RAHEX_SSE2)
+
+static inline bool  toNibbles16(const char* src, unsigned int hexMask, unsigned char* nibbles)
+{
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    const __m128i digit = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+    const __m128i isDigit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                          _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+    const __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    const __m128i alpha = _mm_sub_epi8(lower, _mm_set1_epi8('a' - 10));
+    const __m128i isAlpha = _mm_and_si128(_mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                                          _mm_cmplt_epi8(lower, _mm_set1_epi8('f' + 1)));
+    const __m128i isSpace = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+    const __m128i nib = _mm_or_si128(_mm_and_si128(isDigit, digit), _mm_and_si128(isAlpha, alpha));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(nibbles), nib);
+    const unsigned int hex = static_cast<unsigned int>(_mm_movemask_epi8(_mm_or_si128(isDigit, isAlpha)));
+    const unsigned int space = static_cast<unsigned int>(_mm_movemask_epi8(isSpace));
+    return hex == hexMask && space == (~hexMask & 0xFFFF);
+}
+
+static inline void  toChars16(const char* src, unsigned char* high, unsigned char* low)
+{
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i letterOffset = _mm_set1_epi8('a' - '0' - 10);
+    __m128i h = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+    __m128i l = _mm_and_si128(v, mask);
+    h = _mm_add_epi8(_mm_add_epi8(h, zero), _mm_and_si128(_mm_cmpgt_epi8(h, nine), letterOffset));
+    l = _mm_add_epi8(_mm_add_epi8(l, zero), _mm_and_si128(_mm_cmpgt_epi8(l, nine), letterOffset));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(high), h);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(low), l);
+}
+
+#endif
+
+void RetroArchHex::encode(const char* src, int size, char* dst)
+{
+    int i = 0;
+#if defined(__AVX2__) || defined(RAHEX_SSE2)
+#if defined(__AVX2__)
+    const int block = 32;
+#else
+    const int block = 16;
+#endif
+    unsigned char high[32];
+    unsigned char low[32];
+    // Every byte of a block is followed by a space, so the last byte is never in one
+    for (; i + block < size; i += block)
+    {
+#if defined(__AVX2__)
+        toChars32(src + i, high, low);
+#else
+        toChars16(src + i, high, low);
+#endif
+        char* out = dst + i * 3;
+        for (int j = 0; j < block; j++)
+        {
+            out[j * 3] = static_cast<char>(high[j]);
+            out[j * 3 + 1] = static_cast<char>(low[j]);
+            out[j * 3 + 2] = ' ';
+        }
+    }
+#endif
+    for (; i < size; i++)
+    {
+        const unsigned char c = static_cast<unsigned char>(src[i]);
+        dst[i * 3] = hexChars[c >> 4];
+        dst[i * 3 + 1] = hexChars[c & 0x0F];
+        if (i != size - 1)
+            dst[i * 3 + 2] = ' ';
+    }
+}
+
+int RetroArchHex::decode(const char* src, int textSize, char* dst, int dstSize)
+{
+    while (textSize > 0 && (src[textSize - 1] == '\n' || src[textSize - 1] == '\r' || src[textSize - 1] == ' '))
+        textSize--;
+    if (textSize == 0)
+        return 0;
+    if ((textSize + 1) % 3 != 0 || decodedSize(textSize) > dstSize)
+        return -1;
+    const int size = decodedSize(textSize);
+    int i = 0;
+#if defined(__AVX2__)
+    // 96 characters are 32 bytes, the 3 loads have a different separator pattern
+    static const unsigned int hexMasks[3] = {0xdb6db6db, 0xb6db6db6, 0x6db6db6d};
+    unsigned char nibbles[96];
+    for (; i + 32 < size; i += 32)
+    {
+        const char* in = src + i * 3;
+        if (!toNibbles32(in, hexMasks[0], nibbles) || !toNibbles32(in + 32, hexMasks[1], nibbles + 32)
+                || !toNibbles32(in + 64, hexMasks[2], nibbles + 64))
+            return -1;
+        for (int j = 0; j < 32; j++)
+            dst[i + j] = static_cast<char>((nibbles[j * 3] << 4) | nibbles[j * 3 + 1]);
+    }
+#elif defined(RAHEX_SSE2)
+    // 48 characters are 16 bytes
+    static const unsigned int hexMasks[3] = {0xb6db, 0xdb6d, 0x6db6};
+    unsigned char nibbles[48];
+    for (; i + 16 < size; i += 16)
+    {
+        const char* in = src + i * 3;
+        if (!toNibbles16(in, hexMasks[0], nibbles) || !toNibbles16(in + 16, hexMasks[1], nibbles + 16)
+                || !toNibbles16(in + 32, hexMasks[2], nibbles + 32))
+            return -1;
+        for (int j = 0; j < 16; j++)
+            dst[i + j] = static_cast<char>((nibbles[j * 3] << 4) | nibbles[j * 3 + 1]);
+    }
+#endif
+    for (; i < size; i++)
+    {
+        const char* in = src + i * 3;
+        const int h = hexValue(in[0]);
+        const int l = hexValue(in[1]);
+        if (h == -1 || l == -1 || (i != size - 1 && in[2] != ' '))
+            return -1;
+        dst[i] = static_cast<char>((h << 4) | l);
+    }
+    return size;
+}
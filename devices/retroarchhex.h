@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef RETROARCHHEX_H
+#define RETROARCHHEX_H
+
+/*
+ * RetroArch network commands carry memory as lowercase hex bytes separated
+ * by a space: "0a ff 12". These work directly on buffers without allocating,
+ * with a SSE2/AVX2 path when the compiler targets it.
+ */
+
+namespace RetroArchHex {
+
+// Size of the text for size bytes, without the final new line
+int     encodedSize(int size);
+// Maximum number of bytes a text of textSize characters can hold
+int     decodedSize(int textSize);
+// Write size bytes of src as text in dst that must hold encodedSize(size) characters
+void    encode(const char* src, int size, char* dst);
+// Return the number of bytes written in dst or -1 if the text is not a list of hex bytes
+// A final new line is accepted
+int     decode(const char* src, int textSize, char* dst, int dstSize);
+
+}
+
+#endif // RETROARCHHEX_H
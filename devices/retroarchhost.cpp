@@ -22,12 +22,27 @@
 
 #include <QLoggingCategory>
 #include <QRegularExpression>
+#include <QSettings>
+#include <cstring>
 
 #include "retroarchhost.h"
+#include "retroarchhex.h"
+#include "../adevice.h"
 
 Q_LOGGING_CATEGORY(log_retroarchhost, "RetroArcHost")
 #define sDebug() qCDebug(log_retroarchhost) << m_name
 
+extern QSettings* globalSettings;
+
+// In microseconds, like ADevice::monotonicTime
+static const qint64 commandTimeout = 500000;
+/* RetroArch reads network commands in a 4096 bytes buffer and a reply is one datagram
+ * a byte is 3 characters
+ */
+static const unsigned int readChunkSize = 2048;
+static const unsigned int writeChunkSize = 1024;
+static const int chunkRetries = 3;
+
 
 RetroArchHost::RetroArchHost(QString name, QObject *parent) : QObject(parent)
 {
@@ -41,8 +56,14 @@ RetroArchHost::RetroArchHost(QString name, QObject *parent) : QObject(parent)
     reqId = -1;
     writeId = -1;
     writeSize = 0;
-    commandTimeoutTimer.setInterval(500);
+    m_lastPacketTime = 0;
+    getMemoryTime = 0;
+    infoCache.valid = false;
+    commandWindow = 4;
+    if (globalSettings->contains("RetroArchCommandWindow"))
+        commandWindow = qMax(1, globalSettings->value("RetroArchCommandWindow").toInt());
     commandTimeoutTimer.setSingleShot(true);
+    commandTimeoutTimer.setTimerType(Qt::PreciseTimer);
     connect(&socket, &QUdpSocket::readyRead, this, &RetroArchHost::onReadyRead);
 #if QT_VERSION >= QT_VERSION_CHECK(5,15,0)
     connect(&socket, &QUdpSocket::errorOccurred, this, &RetroArchHost::errorOccured);
@@ -56,7 +77,6 @@ RetroArchHost::RetroArchHost(QString name, QObject *parent) : QObject(parent)
     });
 #endif
     connect(&commandTimeoutTimer, &QTimer::timeout, this, &RetroArchHost::onCommandTimerTimeout);
-    state = None;
 }
 
 void RetroArchHost::setHostAddress(QHostAddress addr, quint16 port)
@@ -65,22 +85,71 @@ void RetroArchHost::setHostAddress(QHostAddress addr, quint16 port)
     m_port = port;
 }
 
+/*
+ * Split a transfer in pieces that fit in a command/datagram
+ * and where the address translation stays linear.
+ */
+
+QList<QPair<unsigned int, unsigned int> > RetroArchHost::splitTransfer(unsigned int address, unsigned int size, unsigned int chunkSize) const
+{
+    QList<QPair<unsigned int, unsigned int> > toret;
+    for (const auto& mapped : addressMapper.map(address, size, AddressMapper::ByBusRange))
+    {
+        address = mapped.address;
+        size = mapped.size;
+        while (size != 0)
+        {
+            unsigned int piece = qMin(size, chunkSize);
+            toret.append(QPair<unsigned int, unsigned int>(address, piece));
+            address += piece;
+            size -= piece;
+        }
+    }
+    return toret;
+}
+
 qint64 RetroArchHost::getMemory(unsigned int address, unsigned int size)
 {
-    int raAddress = translateAddress(address);
-    if (raAddress == -1)
-        return -1; // error
-    QByteArray data = (useReadMemoryAPI ? "READ_CORE_MEMORY " : "READ_CORE_RAM ") + QByteArray::number(raAddress, 16) + " " + QByteArray::number(size) + "\n";
-    getMemorySize = (int)size;
-    return queueCommand(data, GetMemory);
+    const QList<QPair<unsigned int, unsigned int> > pieces = splitTransfer(address, size, readChunkSize);
+    if (pieces.isEmpty())
+        return -1;
+    QList<QByteArray> cmds;
+    for (const auto& piece : pieces)
+    {
+        int raAddress = translateAddress(piece.first);
+        if (raAddress == -1)
+            return -1; // error
+        cmds.append((useReadMemoryAPI ? "READ_CORE_MEMORY " : "READ_CORE_RAM ") + QByteArray::number(raAddress, 16) + " " + QByteArray::number(piece.second) + "\n");
+    }
+    Transfer transfer;
+    transfer.id = nextId();
+    transfer.data.resize(static_cast<int>(size));
+    transfer.remaining = pieces.size();
+    transfer.firstPacketTime = -1;
+    transfers[transfer.id] = transfer;
+    int offset = 0;
+    for (int i = 0; i < pieces.size(); i++)
+    {
+        Chunk chunk;
+        chunk.transferId = transfer.id;
+        chunk.offset = offset;
+        chunk.size = static_cast<int>(pieces.at(i).second);
+        chunk.cmd = cmds.at(i);
+        chunk.retries = 0;
+        chunks[queueCommand(chunk.cmd, GetMemory)] = chunk;
+        offset += chunk.size;
+    }
+    return transfer.id;
 }
 
 qint64 RetroArchHost::writeMemory(unsigned int address, unsigned int size)
 {
-    int raAddress = translateAddress(address);
-    if (raAddress == -1)
-        return -1; // error
-    writeAddress = (int)raAddress;
+    for (const auto& piece : splitTransfer(address, size, writeChunkSize))
+    {
+        if (translateAddress(piece.first) == -1)
+            return -1; // error
+    }
+    writeAddress = address;
     writeSize = (int)size;
     writeMemoryBuffer.clear();
     writeMemoryBuffer.reserve(writeSize);
@@ -95,33 +164,86 @@ void RetroArchHost::writeMemoryData(qint64 id, QByteArray data)
     assert(writeMemoryBuffer.size() <= writeSize);
     if (writeSize == writeMemoryBuffer.size())
     {
-        QByteArray data = (useReadMemoryAPI ? "WRITE_CORE_MEMORY " : "WRITE_CORE_RAM ") + QByteArray::number(writeAddress, 16) + " ";
-        data.append(writeMemoryBuffer.toHex(' '));
-        data.append('\n');
-        if (!useReadMemoryAPI) { // old API does not send a reply
-            queueCommand(data, None, [this](qint64 sentId) {
-                sDebug() << "Write memory done";
-                emit writeMemoryDone(sentId);
-            }, writeId);
-        } else {
-            queueCommand(data, WriteMemory, nullptr, writeId);
+        const QList<QPair<unsigned int, unsigned int> > pieces = splitTransfer(writeAddress, writeSize, writeChunkSize);
+        Transfer transfer;
+        transfer.id = writeId;
+        transfer.remaining = 0;
+        transfer.firstPacketTime = -1;
+        int offset = 0;
+        for (int i = 0; i < pieces.size(); i++)
+        {
+            const auto& piece = pieces.at(i);
+            const int raAddress = translateAddress(piece.first);
+            const int pieceSize = static_cast<int>(piece.second);
+            const QByteArray prefix = (useReadMemoryAPI ? "WRITE_CORE_MEMORY " : "WRITE_CORE_RAM ") + QByteArray::number(raAddress, 16) + " ";
+            QByteArray cmd(prefix.size() + RetroArchHex::encodedSize(pieceSize) + 1, '\n');
+            memcpy(cmd.data(), prefix.constData(), static_cast<size_t>(prefix.size()));
+            RetroArchHex::encode(writeMemoryBuffer.constData() + offset, pieceSize, cmd.data() + prefix.size());
+            offset += pieceSize;
+            if (!useReadMemoryAPI) { // old API does not send a reply, so no retry
+                std::function<void(qint64)> sentCallback = nullptr;
+                if (i == pieces.size() - 1)
+                {
+                    const qint64 doneId = writeId;
+                    sentCallback = [this, doneId](qint64) {
+                        sDebug() << "Write memory done";
+                        emit writeMemoryDone(doneId);
+                    };
+                }
+                queueCommand(cmd, None, sentCallback);
+            } else {
+                Chunk chunk;
+                chunk.transferId = writeId;
+                chunk.offset = offset - pieceSize;
+                chunk.size = pieceSize;
+                chunk.cmd = cmd;
+                chunk.retries = 0;
+                transfer.remaining++;
+                chunks[queueCommand(cmd, WriteMemory)] = chunk;
+            }
+        }
+        if (transfer.remaining != 0)
+            transfers[transfer.id] = transfer;
+        writeMemoryBuffer.clear();
+    }
+}
+
+void RetroArchHost::dropTransfer(qint64 id)
+{
+    transfers.remove(id);
+    QMutableListIterator<Command> it(commandQueue);
+    while (it.hasNext())
+    {
+        const Command& cmd = it.next();
+        if (chunks.contains(cmd.id) && chunks.value(cmd.id).transferId == id)
+        {
+            chunks.remove(cmd.id);
+            it.remove();
         }
     }
+    // The replies of the chunks in flight will be ignored
 }
 
 qint64 RetroArchHost::getInfos()
 {
-    if (state >= ReqInfoVersion && state <= ReqInfoMemory2) {
+    if (infoRunning()) {
         sDebug() << m_name << "Waiting for info done";
         return reqId;
     } else {
         for (const auto& cmd: qAsConst(commandQueue)) {
-            if (cmd.state == ReqInfoVersion) {
+            if (cmd.state == ReqInfoVersion || cmd.state == ReqInfoStatus) {
                 sDebug() << m_name << "Waiting for info";
                 return cmd.id;
             }
         }
+        // We already know this RetroArch, the status tells if the game changed
+        if (infoCache.valid)
+        {
+            sDebug() << m_name << "Doing info with cached infos";
+            return queueCommand("GET_STATUS", ReqInfoStatus);
+        }
         sDebug() << m_name << "Doing info";
+        statusKey.clear();
         return queueCommand("VERSION", ReqInfoVersion);
     }
 }
@@ -169,6 +291,11 @@ QString RetroArchHost::lastInfoError() const
     return m_lastInfoError;
 }
 
+qint64 RetroArchHost::getMemoryPacketTime() const
+{
+    return getMemoryTime;
+}
+
 void RetroArchHost::setInfoFromRomHeader(QByteArray data)
 {
     struct rom_infos* rInfos = get_rom_info(data);
@@ -176,13 +303,31 @@ void RetroArchHost::setInfoFromRomHeader(QByteArray data)
     if (!readMemoryAPI)
         m_gameTile = rInfos->title;
     romType = rInfos->type;
+    addressMapper.setRomType(romType);
     free(rInfos);
 }
 
 
+void RetroArchHost::infoSucceeded()
+{
+    // The old API has no status to know when the game changes
+    if (!statusKey.isEmpty())
+    {
+        infoCache.valid = true;
+        infoCache.statusKey = statusKey;
+        infoCache.version = m_version;
+        infoCache.readMemoryAPI = readMemoryAPI;
+        infoCache.readMemoryHasRomAccess = readMemoryHasRomAccess;
+        infoCache.readRamHasRomAccess = readRamHasRomAccess;
+        infoCache.romType = romType;
+        infoCache.gameTitle = m_gameTile;
+    }
+    emit infoDone(reqId);
+}
+
 void RetroArchHost::makeInfoFail(QString error)
 {
-    state = None;
+    infoCache.valid = false;
     sDebug() << "Info error " << error;
     m_lastInfoError = error;
     emit infoFailed(reqId);
@@ -190,18 +335,19 @@ void RetroArchHost::makeInfoFail(QString error)
 
 void RetroArchHost::onReadyRead()
 {
+    m_lastPacketTime = ADevice::monotonicTime();
     while (socket.hasPendingDatagrams()) {
         QHostAddress sender;
         quint16 senderPort;
-        QByteArray data;
-        data.resize(socket.pendingDatagramSize());
-        socket.readDatagram(data.data(), data.size(), &sender, &senderPort);
-        sDebug() << "<<" << data << "from" << sender << senderPort;
+        // Reuse the same buffer, a memory reply can be a few KB
+        datagram.resize(static_cast<int>(socket.pendingDatagramSize()));
+        socket.readDatagram(datagram.data(), datagram.size(), &sender, &senderPort);
+        sDebug() << "<<" << datagram << "from" << sender << senderPort;
         if (senderPort != m_port || !sender.isEqual(m_address, QHostAddress::TolerantConversion)) {
             sDebug() << "bad sender";
             continue;
         }
-        onPacket(data);
+        onPacket(datagram);
     }
 }
 
@@ -209,34 +355,53 @@ void RetroArchHost::onPacket(QByteArray& data)
 {
     // GET_STATUS PAUSED super_nes,Secret of Evermore,crc32=5756f698
     static const QRegularExpression statusExp("^GET_STATUS (\\w+)(\\s.+)?");
-    commandTimeoutTimer.stop();
+    int index = findInFlight(data);
+    if (index == -1)
+    {
+        sDebug() << "Reply that does not match any command sent";
+        return ;
+    }
+    const Command cmd = inFlight.takeAt(index);
+    armCommandTimer();
 
-    switch(state)
+    switch(cmd.state)
     {
         /*
          * Memory Stuff
          */
         case GetMemory:
         {
-            state = None;
-            QList<QByteArray> tList = data.trimmed().split(' ');
-            tList = tList.mid(2);
-            if (tList.at(0) == "-1")
+            const Chunk chunk = chunks.take(cmd.id);
+            if (!transfers.contains(chunk.transferId))
+                break;
+            Transfer& transfer = transfers[chunk.transferId];
+            if (decodeMemoryReply(data, transfer.data.data() + chunk.offset, chunk.size) != chunk.size)
             {
-                emit getMemoryFailed(reqId);
+                dropTransfer(chunk.transferId);
+                emit getMemoryFailed(chunk.transferId);
                 break;
             }
-            getMemoryDatas = QByteArray::fromHex(tList.join());
-            emit getMemoryDone(reqId);
+            if (transfer.firstPacketTime == -1)
+                transfer.firstPacketTime = m_lastPacketTime;
+            if (--transfer.remaining == 0)
+            {
+                getMemoryDatas = transfer.data;
+                getMemoryTime = transfer.firstPacketTime;
+                transfers.remove(chunk.transferId);
+                emit getMemoryDone(chunk.transferId);
+            }
             break;
         }
         case WriteMemory:
         {
-            state = None;
-            if (readMemoryAPI)
+            const Chunk chunk = chunks.take(cmd.id);
+            if (!transfers.contains(chunk.transferId))
+                break;
+            if (--transfers[chunk.transferId].remaining == 0)
             {
+                transfers.remove(chunk.transferId);
                 sDebug() << "Write memory done";
-                emit writeMemoryDone(reqId);
+                emit writeMemoryDone(chunk.transferId);
             }
             break;
         }
@@ -290,6 +455,29 @@ void RetroArchHost::onPacket(QByteArray& data)
                 break;
             }
             m_gameTile = game;
+            // Same content (the crc32 is part of it), no need to read the ROM header again
+            statusKey = infos;
+            if (infoCache.valid && infoCache.statusKey == statusKey)
+            {
+                sDebug() << "Using cached infos";
+                m_version = infoCache.version;
+                readMemoryAPI = infoCache.readMemoryAPI;
+                readMemoryHasRomAccess = infoCache.readMemoryHasRomAccess;
+                readRamHasRomAccess = infoCache.readRamHasRomAccess;
+                romType = infoCache.romType;
+                addressMapper.setRomType(romType);
+                m_gameTile = infoCache.gameTitle;
+                emit infoDone(reqId);
+                break;
+            }
+            // Unknown content, start from the beginning, the version can have changed too
+            if (infoCache.valid)
+            {
+                infoCache.valid = false;
+                statusKey.clear();
+                doCommandNow({reqId, "VERSION", ReqInfoVersion, nullptr});
+                break;
+            }
             doCommandNow({reqId, "READ_CORE_MEMORY 7E0000 1", ReqInfoRMemoryWRAM, nullptr});
             break;
         }
@@ -312,12 +500,10 @@ void RetroArchHost::onPacket(QByteArray& data)
         case ReqInfoRMemoryHiRomData:
         case ReqInfoRMemoryLoRomData:
         {
-            QList<QByteArray> tList = data.trimmed().split(' ');
-            tList.removeFirst();
-            tList.removeFirst();
-            if (tList.at(0) == "-1")
+            QByteArray header;
+            if (!decodeMemoryReply(data, header))
             {
-                if (state == ReqInfoRMemoryHiRomData)
+                if (cmd.state == ReqInfoRMemoryHiRomData)
                 {
                     doCommandNow({reqId, "READ_CORE_MEMORY FFC0 32", ReqInfoRMemoryLoRomData, nullptr});
                     break;
@@ -328,10 +514,9 @@ void RetroArchHost::onPacket(QByteArray& data)
                     break;
                 }
             }
-            setInfoFromRomHeader(QByteArray::fromHex(tList.join()));
+            setInfoFromRomHeader(header);
             readMemoryHasRomAccess = (romType == HiROM); // see comments in translateAddress()
-            state = None;
-            emit infoDone(reqId);
+            infoSucceeded();
             break;
         }
         // This is the part for the old RA Version
@@ -347,119 +532,212 @@ void RetroArchHost::onPacket(QByteArray& data)
         }
         case ReqInfoRRAMHiRomData:
         {
-            QList<QByteArray> tList = data.trimmed().split(' ');
-            if (tList.at(2) == "-1")
+            QByteArray header;
+            if (!decodeMemoryReply(data, header))
             {
                 readRamHasRomAccess = false;
             } else {
-                tList.removeFirst();
-                tList.removeFirst();
-                setInfoFromRomHeader(QByteArray::fromHex(tList.join()));
+                setInfoFromRomHeader(header);
                 readRamHasRomAccess = true;
             }
-            state = None;
-            emit infoDone(reqId);
+            infoSucceeded();
             break;
         }
         default:
         {
-            sDebug() << "OnReadyRead with unexpected state" << state;
-            state = None;
+            sDebug() << "OnReadyRead with unexpected state" << cmd.state;
             break;
         }
     }
 
-    runCommandQueue(); // send next command if idle
+    runCommandQueue(); // send next commands if there is room
 }
 
+/*
+ * "READ_CORE_MEMORY 7e0010 0a 0b" or "READ_CORE_MEMORY 7e0010 -1 error"
+ * The data are decoded in out without intermediate copies
+ */
+
+int RetroArchHost::decodeMemoryReply(const QByteArray& reply, char* out, int outSize)
+{
+    int start = reply.indexOf(' ');
+    if (start != -1)
+        start = reply.indexOf(' ', start + 1);
+    if (start == -1)
+        return -1;
+    start++;
+    const char* text = reply.constData() + start;
+    const int textSize = reply.size() - start;
+    if (textSize >= 2 && text[0] == '-' && text[1] == '1')
+        return -1;
+    const int size = RetroArchHex::decode(text, textSize, out, outSize);
+    if (size == -1)
+        sDebug() << "Malformed memory reply";
+    return size;
+}
 
-void RetroArchHost::onCommandTimerTimeout()
+bool RetroArchHost::decodeMemoryReply(const QByteArray& reply, QByteArray& out)
+{
+    out.resize(RetroArchHex::decodedSize(reply.size()));
+    const int size = decodeMemoryReply(reply, out.data(), out.size());
+    if (size == -1)
+        return false;
+    out.resize(size);
+    return true;
+}
+
+static QByteArray   commandToken(const QByteArray& data, int n)
 {
-    sDebug() << "Command timed out";
-    if (state >= ReqInfoVersion && state <= ReqInfoMemory2)
+    int start = 0;
+    for (int i = 0; i < n; i++)
     {
-        state = None;
-        makeInfoFail("Timeout of a command");
-    } else {
-        state = None;
-        emit commandTimeout(reqId);
+        start = data.indexOf(' ', start);
+        if (start == -1)
+            return QByteArray();
+        start++;
     }
+    int end = data.indexOf(' ', start);
+    return data.mid(start, end == -1 ? -1 : end - start).trimmed();
+}
 
-    runCommandQueue(); // send next command
+/*
+ * Replies start with the command and the address, like "READ_CORE_MEMORY 7e0010 0a 0b"
+ * VERSION is the only command that does not echo anything, it's always alone since it's an info command
+ * If several commands have the same name and address, the oldest one get the reply
+ */
+
+int RetroArchHost::findInFlight(const QByteArray& reply) const
+{
+    const QByteArray name = commandToken(reply, 0);
+    const bool hasAddress = name.startsWith("READ_CORE_") || name.startsWith("WRITE_CORE_");
+    bool ok;
+    const unsigned int address = hasAddress ? commandToken(reply, 1).toUInt(&ok, 16) : 0;
+    for (int i = 0; i < inFlight.size(); i++)
+    {
+        const QByteArray& cmd = inFlight.at(i).cmd;
+        if (commandToken(cmd, 0) != name)
+            continue;
+        if (hasAddress && commandToken(cmd, 1).toUInt(&ok, 16) != address)
+            continue;
+        return i;
+    }
+    if (!inFlight.isEmpty() && inFlight.first().state == ReqInfoVersion)
+        return 0;
+    return -1;
 }
 
-// ref is https://github.com/tewtal/pusb2snes/blob/master/src/main/python/devices/retroarch.py
+bool RetroArchHost::isInfoState(RetroArchHost::State state)
+{
+    return state >= ReqInfoVersion && state <= ReqInfoMemory2;
+}
 
+bool RetroArchHost::infoRunning() const
+{
+    for (const Command& cmd : inFlight)
+    {
+        if (isInfoState(cmd.state))
+            return true;
+    }
+    return false;
+}
 
-int RetroArchHost::translateAddress(unsigned int address)
+void RetroArchHost::armCommandTimer()
 {
-    int addr = static_cast<int>(address);
-    if (readMemoryAPI)
+    if (inFlight.isEmpty())
     {
-        useReadMemoryAPI = true;
-        // ROM ACCESS
-        if (addr < 0xE00000) {
-            if (romType == HiROM && addr < 0x400000) {
-                // we can simply access all of HiROM from C00000 to FFFFFF
-                return addr + 0xC00000;
-            } else if (romType == LoROM) {
-                // Not supported. Half of LoROM is unmapped for READ_MEMORY in bsnes-mercury
-                return -1;
-            } else {
-                // ExLo, ExHi untested
-                return -1;
-            }
+        commandTimeoutTimer.stop();
+        return ;
+    }
+    qint64 deadline = inFlight.first().deadline;
+    for (const Command& cmd : qAsConst(inFlight))
+        deadline = qMin(deadline, cmd.deadline);
+    qint64 remaining = (deadline - ADevice::monotonicTime()) / 1000;
+    commandTimeoutTimer.start(static_cast<int>(qMax<qint64>(0, remaining)));
+}
+
+void RetroArchHost::onCommandTimerTimeout()
+{
+    // 1 ms of margin, the timer has a millisecond resolution
+    qint64 now = ADevice::monotonicTime() + 1000;
+    QList<Command> expired;
+    QMutableListIterator<Command> it(inFlight);
+    while (it.hasNext())
+    {
+        if (it.next().deadline <= now)
+        {
+            expired.append(it.value());
+            it.remove();
         }
-        // WRAM
-        if (addr >= 0xF50000 && addr <= 0xF70000)
-            return 0x7E0000 + addr - 0xF50000;
-        // SRAM, this does not work properly with the new api
-        // This is a mess anyways xD
-        if (addr >= 0xE00000 && addr < 0xF70000)
+    }
+    armCommandTimer();
+    for (const Command& cmd : qAsConst(expired))
+    {
+        sDebug() << "Command timed out" << cmd.cmd;
+        if (isInfoState(cmd.state))
         {
-            useReadMemoryAPI = false;
-            //if (!hasRomAccess())
-            return addr - 0xE00000 + 0x20000;
-            if (romType == LoROM)
-                //return addr - 0xE00000 + 0x700000;
-                return lorom_sram_pc_to_snes(address - 0xE00000);
-            return lorom_sram_pc_to_snes(address - 0xE00000);
+            makeInfoFail("Timeout of a command");
+            continue;
         }
-        return -1;
-    } else {
-        useReadMemoryAPI = false;
-        // Rom access
-        if (addr < 0xE00000)
+        if (!chunks.contains(cmd.id))
         {
-            if (!hasRomAccess())
-                return -1;
-            if (romType == LoROM)
-                return 0x800000 + (addr + (0x8000 * ((addr + 0x8000) / 0x8000)));
-            if (romType == HiROM)
-            {
-                if (addr < 0x400000)
-                    return addr + 0xC00000;
-                else //exhirom
-                    return addr + 0x400000;
-            }
+            emit commandTimeout(cmd.id);
+            continue;
         }
-        // WRAM access is pretty simple
-        if (addr >= 0xF50000 && addr <= 0xF70000)
+        // UDP, the command or the reply may just be lost, send the chunk again
+        Chunk chunk = chunks.take(cmd.id);
+        if (!transfers.contains(chunk.transferId))
+            continue;
+        if (chunk.retries < chunkRetries)
         {
-            if (hasRomAccess()) {
-                return addr - 0xF50000 + 0x7E0000;
-            } else {
-                return addr - 0xF50000;
-            }
+            chunk.retries++;
+            const qint64 retryId = nextId();
+            chunks[retryId] = chunk;
+            commandQueue.prepend({retryId, chunk.cmd, cmd.state, nullptr, 0});
+            continue;
         }
-        if (addr >= 0xE00000 && addr < 0xF70000)
+        dropTransfer(chunk.transferId);
+        emit commandTimeout(chunk.transferId);
+    }
+
+    runCommandQueue(); // send next commands
+}
+
+// ref is https://github.com/tewtal/pusb2snes/blob/master/src/main/python/devices/retroarch.py
+
+
+int RetroArchHost::translateAddress(unsigned int address)
+{
+    const AddressMapper::Piece piece = addressMapper.map(address);
+    if (readMemoryAPI)
+    {
+        useReadMemoryAPI = true;
+        switch (piece.region)
         {
-            if (!hasRomAccess())
-                return addr - 0xE00000 + 0x20000;
-            if (romType == LoROM)
-                return addr - 0xE00000 + 0x700000;
-            return lorom_sram_pc_to_snes(address - 0xE00000); // Test this
+        // We can simply access all of HiROM from C00000 to FFFFFF
+        // Half of LoROM is unmapped for READ_MEMORY in bsnes-mercury, ExLo, ExHi untested
+        case AddressMapper::ROM:
+            return addressMapper.romType() == HiROM ? piece.busAddress : -1;
+        case AddressMapper::WRAM:
+            return piece.busAddress;
+        // SRAM, this does not work properly with the new api
+        case AddressMapper::SRAM:
+            useReadMemoryAPI = false;
+            return static_cast<int>(piece.offset + 0x20000);
+        default:
+            return -1;
         }
+    }
+    useReadMemoryAPI = false;
+    switch (piece.region)
+    {
+    case AddressMapper::ROM:
+        return hasRomAccess() ? piece.busAddress : -1;
+    // Without ROM access the memory is WRAM then SRAM at 0x20000
+    case AddressMapper::WRAM:
+        return hasRomAccess() ? piece.busAddress : static_cast<int>(piece.offset);
+    case AddressMapper::SRAM:
+        return hasRomAccess() ? piece.busAddress : static_cast<int>(piece.offset + 0x20000);
+    default:
         return -1;
     }
 }
@@ -480,18 +758,27 @@ qint64 RetroArchHost::queueCommand(QByteArray cmd, State newState, std::function
 
 void RetroArchHost::runCommandQueue()
 {
-    while (state == None && !commandQueue.empty()) {
-        doCommandNow(commandQueue.front());
+    while (!commandQueue.empty() && !infoRunning() && inFlight.size() < commandWindow) {
+        // Info commands wait for everything else to be done
+        if (isInfoState(commandQueue.front().state) && !inFlight.isEmpty())
+            break;
+        Command cmd = commandQueue.front();
         commandQueue.pop_front();
+        doCommandNow(cmd);
     }
 }
 
 void RetroArchHost::doCommandNow(const Command& cmd)
 {
-    reqId = cmd.id;
-    state = cmd.state;
+    if (isInfoState(cmd.state))
+        reqId = cmd.id;
     // if state is None, we don't expect a reply
-    if (state != None) commandTimeoutTimer.start();
+    if (cmd.state != None) {
+        Command sent = cmd;
+        sent.deadline = ADevice::monotonicTime() + commandTimeout;
+        inFlight.append(sent);
+        armCommandTimer();
+    }
     writeSocket(cmd.cmd);
     // this is kind of a hack, but we should not run the callback before we returned an id, because it may emit a signal
     auto cb = cmd.sentCallback;
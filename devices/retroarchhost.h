@@ -23,11 +23,13 @@
 #define RETROARCHHOST_H
 
 #include <QHostInfo>
+#include <QMap>
 #include <QObject>
 #include <QTimer>
 #include <QUdpSocket>
 #include <QVersionNumber>
 #include <functional>
+#include "../rommapping/addressmapper.h"
 #include "../rommapping/rominfo.h"
 
 class RetroArchHost : public QObject
@@ -55,6 +57,7 @@ public:
         QByteArray cmd;
         State state;
         std::function<void(qint64)> sentCallback;
+        qint64 deadline;
     };
 
     explicit    RetroArchHost(QString name, QObject *parent = nullptr);
@@ -72,6 +75,8 @@ public:
     bool            hasRomWriteAccess() const;
     QHostAddress    address() const;
     QString         lastInfoError() const;
+    // When the first packet of the last read arrived, the memory was sampled before it
+    qint64          getMemoryPacketTime() const;
 
 
 signals:
@@ -91,6 +96,7 @@ private:
     quint16         m_port;
     QHostAddress    m_address;
     QString         m_lastInfoError;
+    qint64          m_lastPacketTime;
     bool            readRamHasRomAccess;
      // tell that we have a 1.9.0+ RA
     bool            readMemoryAPI;
@@ -105,26 +111,78 @@ private:
      */
     bool            readMemoryHasRomAccess;
     qint64          reqId;
-    State           state;
+    /* Commands sent and waiting for a reply, RetroArch echoes the command
+     * and the address so replies can be matched even with several of them in flight.
+     * Info commands depend on each other and are always alone.
+     */
+    QList<Command>  inFlight;
+    int             commandWindow;
     QTimer          commandTimeoutTimer;
     QList<Command>  commandQueue;
     rom_type        romType;
+    AddressMapper   addressMapper;
     QString         m_gameTile;
+    /* What we got from the last successful info, it's valid for the same
+     * GET_STATUS content (platform, game name and crc32)
+     */
+    struct InfoCache {
+        bool            valid;
+        QString         statusKey;
+        QVersionNumber  version;
+        bool            readMemoryAPI;
+        bool            readMemoryHasRomAccess;
+        bool            readRamHasRomAccess;
+        rom_type        romType;
+        QString         gameTitle;
+    };
+    InfoCache       infoCache;
+    QString         statusKey;
     QUdpSocket      socket;
-    int             getMemorySize;
     QByteArray      getMemoryDatas;
+    qint64          getMemoryTime;
+    QByteArray      datagram;
 
     QByteArray      writeMemoryBuffer;
     int             writeSize;
     unsigned int    writeAddress;
     qint64          writeId;
 
+    /* Big reads and writes are split in chunks sent like any command,
+     * the transfer is done when all its chunks are.
+     */
+    struct Transfer
+    {
+        qint64      id;
+        QByteArray  data;
+        int         remaining;
+        qint64      firstPacketTime;
+    };
+    struct Chunk
+    {
+        qint64      transferId;
+        int         offset;
+        int         size;
+        QByteArray  cmd;
+        int         retries;
+    };
+    QMap<qint64, Transfer>  transfers;
+    QMap<qint64, Chunk>     chunks;
+
     qint64  nextId();
     void    setInfoFromRomHeader(QByteArray data);
     void    makeInfoFail(QString error);
+    void    infoSucceeded();
     void    onReadyRead();
     void    onPacket(QByteArray& data);
+    int     decodeMemoryReply(const QByteArray& reply, char* out, int outSize);
+    bool    decodeMemoryReply(const QByteArray& reply, QByteArray& out);
+    void    dropTransfer(qint64 id);
+    QList<QPair<unsigned int, unsigned int> > splitTransfer(unsigned int address, unsigned int size, unsigned int chunkSize) const;
     void    onCommandTimerTimeout();
+    void    armCommandTimer();
+    int     findInFlight(const QByteArray& reply) const;
+    bool    infoRunning() const;
+    static bool isInfoState(State state);
     int     translateAddress(unsigned int address);
     qint64  queueCommand(QByteArray cmd, State state, std::function<void(qint64)> sentCallback = nullptr, qint64 forceId=-1);
     void    runCommandQueue();
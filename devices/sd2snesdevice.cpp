@@ -38,6 +38,8 @@ SD2SnesDevice::SD2SnesDevice(QString portName)
     connect(&m_port, SIGNAL(requestToSendChanged(bool)), this, SLOT(onRTSChanged(bool)));
     m_state = CLOSED;
     m_getSize = 0;
+    m_streamSize = 0;
+    m_streamStopping = false;
     fileGetCmd = false;
     bytesReceived = 0;
     blockSize = 512;
@@ -93,15 +95,9 @@ void SD2SnesDevice::close()
  *  Only the MV command place the second argument after the first sequence
  */
 
-void    SD2SnesDevice::sendCommand(SD2Snes::opcode opcode, SD2Snes::space space, unsigned char flags, const QByteArray& arg, const QByteArray arg2 = QByteArray())
+QByteArray  SD2SnesDevice::commandBlock(SD2Snes::opcode opcode, SD2Snes::space space, unsigned char flags, const QByteArray& arg, const QByteArray& arg2)
 {
     int filer_size = 512 - 7;
-    blockSize = 512;
-    m_commandFlags = flags;
-    sDebug() << "CMD : " << opcode << space << flags << arg;
-    skipResponse = false;
-    if (opcode == SD2Snes::opcode::PUT)
-        skipResponse = true;
     QByteArray data("USBA");
     data.append(static_cast<char>(opcode));
     data.append(static_cast<char>(space));
@@ -114,9 +110,21 @@ void    SD2SnesDevice::sendCommand(SD2Snes::opcode opcode, SD2Snes::space space,
     if (!arg2.isEmpty() && opcode == SD2Snes::opcode::MV)
         data.replace(8, arg2.size(), arg2);
     sDebug() << ">>" << data.left(8).toHex() << "- 252-272 : " << data.mid(252, 20).toHex();
+    return data;
+}
+
+void    SD2SnesDevice::sendCommand(SD2Snes::opcode opcode, SD2Snes::space space, unsigned char flags, const QByteArray& arg, const QByteArray arg2 = QByteArray())
+{
+    blockSize = 512;
+    m_commandFlags = flags;
+    sDebug() << "CMD : " << opcode << space << flags << arg;
+    skipResponse = false;
+    if (opcode == SD2Snes::opcode::PUT)
+        skipResponse = true;
     m_state = BUSY;
     m_currentCommand = opcode;
-    writeToDevice(data);
+    markCommandSent();
+    writeToDevice(commandBlock(opcode, space, flags, arg, arg2));
 }
 
 
@@ -157,6 +165,7 @@ void    SD2SnesDevice::sendVCommand(SD2Snes::opcode opcode, SD2Snes::space space
         m_putSize = tsize;
     m_state = BUSY;
     m_currentCommand = opcode;
+    markCommandSent();
     writeToDevice(data);
 }
 
@@ -183,6 +192,7 @@ void SD2SnesDevice::spReadyRead()
     static int          bytesGetSent = 0;
     static bool         fileGetSizeSent = false; // This avoid sending it twice
 
+    markDataReceived();
     QByteArray data = m_port.readAll();
     bytesReceived += data.size();
     dataReceived += data;
@@ -214,6 +224,12 @@ void SD2SnesDevice::spReadyRead()
             return;
         }
     }
+    if (m_currentCommand == SD2Snes::opcode::STREAM)
+    {
+        if (readStreamFrames())
+            goto cmdFinished;
+        return;
+    }
     // Most command only need a valid response block
     if (m_currentCommand != SD2Snes::opcode::GET && m_currentCommand != SD2Snes::opcode::VGET
         && m_currentCommand != SD2Snes::opcode::LS)
@@ -345,6 +361,38 @@ bool SD2SnesDevice::checkEndForLs()
     return true;
 }
 
+/*
+ * In STREAM mode the firmware keeps sending the requested region, one frame
+ * padded to the block size each time it samples it, until it receives a new command block.
+ * We stop it with an INFO command, its response block mark the end of the stream.
+ */
+
+bool SD2SnesDevice::readStreamFrames()
+{
+    static const QByteArray responseHeader = QByteArray("USBA").append(static_cast<char>(SD2Snes::opcode::RESPONSE));
+    int frameSize = m_streamSize;
+    if (frameSize % blockSize)
+        frameSize += blockSize - (frameSize % blockSize);
+    while (true)
+    {
+        if (m_streamStopping && dataReceived.size() >= blockSize && dataReceived.startsWith(responseHeader))
+        {
+            dataRead = dataReceived.left(blockSize);
+            m_streamStopping = false;
+            return true;
+        }
+        if (dataReceived.size() < frameSize)
+            break;
+        // A frame is not the reply of a command, it was sampled just before we got it
+        m_commandTime = monotonicTime();
+        m_dataTime = m_commandTime;
+        emit streamDataReceived(dataReceived.left(m_streamSize));
+        dataReceived.remove(0, frameSize);
+    }
+    bytesReceived = dataReceived.size();
+    return false;
+}
+
 void SD2SnesDevice::infoCommand()
 {
     sendCommand(SD2Snes::opcode::INFO, SD2Snes::space::FILE, SD2Snes::server_flags::NONE, QByteArray());
@@ -447,6 +495,11 @@ bool SD2SnesDevice::hasVariaditeCommands()
     return true;
 }
 
+bool SD2SnesDevice::hasStreamCommands()
+{
+    return true;
+}
+
 
 void    SD2SnesDevice::fileCommand(SD2Snes::opcode op, QVector<QByteArray> args)
 {
@@ -530,6 +583,32 @@ void SD2SnesDevice::putAddrCommand(SD2Snes::space space, unsigned int addr, unsi
     sendCommand(SD2Snes::opcode::PUT, space, SD2Snes::server_flags::NONE, data1, data2);
 }
 
+void SD2SnesDevice::streamCommand(SD2Snes::space space, unsigned int addr, unsigned int size)
+{
+    QByteArray data1 = int32ToData(addr);
+    QByteArray data2 = int32ToData(size);
+    m_streamSize = static_cast<int>(size);
+    m_streamStopping = false;
+    sendCommand(SD2Snes::opcode::STREAM, space, SD2Snes::server_flags::STREAM_BURST, data1, data2);
+}
+
+void SD2SnesDevice::stopStreamCommand()
+{
+    if (m_currentCommand != SD2Snes::opcode::STREAM || m_state != BUSY)
+        return ;
+    sDebug() << "Stopping stream";
+    /*
+     * The firmware (usbinterface.c) only leaves its stream loop when a new command block arrives,
+     * frames already queued on the USB link still come before the INFO response block.
+     * The current command stays STREAM until readStreamFrames sees that block,
+     * so the state is set before writing, not by sendCommand.
+     */
+    m_streamStopping = true;
+    m_commandFlags = SD2Snes::server_flags::NONE;
+    markCommandSent();
+    writeToDevice(commandBlock(SD2Snes::opcode::INFO, SD2Snes::space::FILE, SD2Snes::server_flags::NONE, QByteArray(), QByteArray()));
+}
+
 void SD2SnesDevice::putAddrCommand(SD2Snes::space space, QList<QPair<unsigned int, quint8> >& args)
 {
     sendVCommand(SD2Snes::opcode::VPUT, space, SD2Snes::server_flags::NONE, args);
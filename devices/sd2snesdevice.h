@@ -43,6 +43,7 @@ public:
     void            putAddrCommand(SD2Snes::space space, unsigned int addr, unsigned int size);
     void            putAddrCommand(SD2Snes::space space, QList<QPair<unsigned int, quint8> > &args);
     void            putAddrCommand(SD2Snes::space space, unsigned char flags, unsigned int addr, unsigned int size);
+    static QByteArray   commandBlock(SD2Snes::opcode opcode, SD2Snes::space space, unsigned char flags, const QByteArray &arg, const QByteArray &arg2);
     void            sendCommand(SD2Snes::opcode opcode, SD2Snes::space space, unsigned char flags, const QByteArray &arg, const QByteArray arg2);
     void            sendVCommand(SD2Snes::opcode opcode, SD2Snes::space space, unsigned char flags, const QList<QPair<unsigned int, quint8> > &args);
     void            infoCommand();
@@ -53,6 +54,9 @@ public:
     bool            hasFileCommands();
     bool            hasControlCommands();
     bool            hasVariaditeCommands();
+    bool            hasStreamCommands();
+    void            streamCommand(SD2Snes::space space, unsigned int addr, unsigned int size);
+    void            stopStreamCommand();
 
     USB2SnesInfo    parseInfo(const QByteArray &data);
     QList<ADevice::FileInfos> parseLSCommand(QByteArray &dataI);
@@ -90,8 +94,11 @@ private:
     int             m_getSize;
     int             m_putSize;
     int             m_get_expected_size;
+    int             m_streamSize;
+    bool            m_streamStopping;
 
     bool    checkEndForLs();
+    bool    readStreamFrames();
 
     void writeToDevice(const QByteArray &data);
     void beNiceToFirmWare(const QByteArray &data);
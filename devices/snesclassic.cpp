@@ -20,6 +20,7 @@
 
 #include <QEventLoop>
 #include <QLoggingCategory>
+#include <QSettings>
 #include <QThread>
 
 #include "../rommapping/rominfo.h"
@@ -29,6 +30,11 @@ Q_LOGGING_CATEGORY(log_snesclassic, "SNESClassic")
 #define sDebug() qCDebug(log_snesclassic)
 #define sInfo() qCInfo(log_snesclassic)
 
+extern QSettings* globalSettings;
+
+static const QByteArray readErrorReply = QByteArray::fromHex("00004552524f520000");
+static const QByteArray readErrorReply10 = QByteArray::fromHex("00004552524f52000000");
+
 
 SNESClassic::SNESClassic()
 {
@@ -48,6 +54,13 @@ SNESClassic::SNESClassic()
     ramLocation = 0;
     requestInfo = false;
     cmdWasGet = false;
+    expectedAcks = 0;
+    receivedAcks = 0;
+    multiPutSize = 0;
+    replyOffset = 0;
+    pipelineDepth = 4;
+    if (globalSettings->contains("SNESClassicPipelineDepth"))
+        pipelineDepth = qMax(1, globalSettings->value("SNESClassicPipelineDepth").toInt());
     c_rom_infos = nullptr;
 }
 
@@ -56,6 +69,7 @@ void SNESClassic::onSocketReadReady()
     static rom_type infoRequestType = LoROM;
     if (m_state == CLOSED)
         return;
+    markDataReceived();
     QByteArray data = socket->readAll();
     //sDebug() << "Read stuff on socket " << cmdWasGet << " : " << data.size();
     sDebug() << "<<" << data << data.toHex();
@@ -79,14 +93,25 @@ void SNESClassic::onSocketReadReady()
     if (cmdWasGet)
     {
         getData += data;
-        if (getData.left(9) == QByteArray::fromHex("00004552524f520000") || (getSize == 9 && getData.left(10) == QByteArray::fromHex("00004552524f52000000")))
+        while (!inFlightReads.isEmpty())
         {
-            sDebug() << "Error doing a get memory";
-            socket->disconnectFromHost();
-            alive_timer.stop();
-            return ;
+            const unsigned int size = inFlightReads.first().size;
+            const int available = getData.size() - replyOffset;
+            if ((size != 9 && available >= 9 && getData.mid(replyOffset, 9) == readErrorReply) ||
+                (size == 9 && available >= 10 && getData.mid(replyOffset, 10) == readErrorReply10))
+            {
+                sDebug() << "Error doing a get memory";
+                socket->disconnectFromHost();
+                alive_timer.stop();
+                return ;
+            }
+            if (available < static_cast<int>(size))
+                break;
+            replyOffset += static_cast<int>(size);
+            inFlightReads.removeFirst();
         }
-        if (getData.size() == static_cast<int>(getSize))
+        flushReads();
+        if (inFlightReads.isEmpty() && pendingReads.isEmpty() && getData.size() == static_cast<int>(getSize))
         {
             emit getDataReceived(getData);
             getData.clear();
@@ -97,14 +122,28 @@ void SNESClassic::onSocketReadReady()
         }
     } else { // Should be put command
         sDebug() << data;
-        if (data == "OK\n")
+        ackData += data;
+        while (ackData.size() >= 3)
         {
-            goto cmdFinished;
+            QByteArray ack = ackData.left(3);
+            ackData.remove(0, 3);
+            if (ack == "OK\n")
+            {
+                receivedAcks++;
+            }
+            else // write command fail, let's close
+            {
+                ackData.clear();
+                socket->disconnectFromHost();
+                alive_timer.stop();
+                return ;
+            }
         }
-        else if (data == "KO\n") // write command fail, let's close
+        if (receivedAcks == expectedAcks)
         {
-            socket->disconnectFromHost();
-            alive_timer.stop();
+            expectedAcks = 0;
+            receivedAcks = 0;
+            goto cmdFinished;
         }
     }
     return ;
@@ -116,69 +155,148 @@ cmdFinished:
 }
 
 
+// canoe memory is the SNES memory regions one after the other, the bus mapping does not matter
+quint64 SNESClassic::translateAddress(const AddressMapper::Piece& piece) const
+{
+    switch (piece.region)
+    {
+    case AddressMapper::ROM:
+        return romLocation + piece.offset;
+    case AddressMapper::SRAM:
+        return sramLocation + piece.offset;
+    case AddressMapper::WRAM:
+        return ramLocation + piece.offset;
+    default:
+        return 0;
+    }
+}
+
+bool SNESClassic::checkPieces(const QList<AddressMapper::Piece> &pieces)
+{
+    if (AddressMapper::isMapped(pieces, AddressMapper::ByRegion))
+        return true;
+    sDebug() << "Address outside of the memory canoe can access";
+    m_state = READY;
+    emit protocolError();
+    return false;
+}
+
 void SNESClassic::getAddrCommand(SD2Snes::space space, unsigned int addr, unsigned int size)
 {
     Q_UNUSED(space)
+    const QList<AddressMapper::Piece> pieces = addressMapper.map(addr, size, AddressMapper::ByRegion);
+    if (!checkPieces(pieces))
+        return ;
     m_state = BUSY;
-    quint64 memAddr = 0;
-    if (addr >= 0xF50000 && addr < 0xF70000)
-    {
-        memAddr = addr - 0xF50000 + ramLocation;
-        //sDebug() << "RAM read";
-    }
-    if (addr >= 0xE00000 && addr < 0xF50000)
+    startReads();
+    for (const auto& piece : pieces)
     {
-        //sDebug() << "SRAM read";
-        memAddr = addr - 0xE00000 + sramLocation;
+        sDebug() << "Get Addr" << AddressMapper::regionName(piece.region) << translateAddress(piece);
+        queueRead(translateAddress(piece), piece.size);
     }
-    if (addr < 0xE00000)
-    {
-        //sDebug() << "ROM read";
-        memAddr = addr + romLocation;
-    }
-    sDebug() << "Get Addr" << memAddr;
+    markCommandSent();
+    flushReads();
+}
+
+void SNESClassic::startReads()
+{
     cmdWasGet = true;
-    getSize = size;
+    getSize = 0;
     getData.clear();
-    writeSocket("READ_MEM " + canoePid + " " + QByteArray::number(memAddr, 16) + " " + QByteArray::number(size) + "\n");
+    replyOffset = 0;
+    pendingReads.clear();
+    inFlightReads.clear();
+}
+
+void SNESClassic::queueRead(quint64 memAddr, unsigned int size)
+{
+    MemRead read;
+    read.cmd = "READ_MEM " + canoePid + " " + QByteArray::number(memAddr, 16) + " " + QByteArray::number(size) + "\n";
+    read.size = size;
+    pendingReads.append(read);
+    getSize += size;
+}
+
+// Keep up to pipelineDepth READ_MEM waiting for their reply
+void SNESClassic::flushReads()
+{
+    QByteArray toWrite;
+    while (inFlightReads.size() < pipelineDepth && !pendingReads.isEmpty())
+    {
+        inFlightReads.append(pendingReads.takeFirst());
+        toWrite += inFlightReads.last().cmd;
+    }
+    if (toWrite.isEmpty())
+        return ;
+    writeSocket(toWrite);
     alive_timer.start();
 }
 
+// serverstuff handles its commands line by line, the replies come back in the same order
 void SNESClassic::getAddrCommand(SD2Snes::space space, QList<QPair<unsigned int, quint8> > &args)
 {
     Q_UNUSED(space)
-    Q_UNUSED(args)
+    const QList<AddressMapper::Piece> pieces = addressMapper.map(args, AddressMapper::ByRegion);
+    if (!checkPieces(pieces))
+        return ;
+    m_state = BUSY;
+    startReads();
+    for (const auto& piece : pieces)
+        queueRead(translateAddress(piece), piece.size);
+    sDebug() << "Multi Get Addr" << args.size() << getSize;
+    markCommandSent();
+    flushReads();
 }
 
 void SNESClassic::putAddrCommand(SD2Snes::space space, unsigned int addr, unsigned int size)
 {
     Q_UNUSED(space)
     sDebug() << "Put address" << addr;
-    m_state = BUSY;
-    quint64 memAddr = 0;
-    if (addr >= 0xF50000 && addr < 0xF70000)
-    {
-        memAddr = addr - 0xF50000 + ramLocation;
-    }
-    if (addr >= 0xE00000 && addr < 0xF50000)
+    const QList<AddressMapper::Piece> pieces = addressMapper.map(addr, size, AddressMapper::ByRegion);
+    if (!checkPieces(pieces))
+        return ;
+    // Crossing a region needs a WRITE_MEM per region, so the data has to be buffered
+    if (pieces.size() > 1)
     {
-        memAddr = addr - 0xE00000 + sramLocation;
-    }
-    if (addr < 0xE00000)
-    {
-        memAddr = addr + romLocation;
+        startPut(pieces);
+        return ;
     }
+    m_state = BUSY;
+    quint64 memAddr = translateAddress(pieces.first());
     cmdWasGet = false;
+    expectedAcks = 1;
+    receivedAcks = 0;
+    ackData.clear();
     lastPutWrite.clear();
     sDebug() << "Put address" << QString::number(addr, 16) << QString::number(memAddr, 16);
     writeSocket("WRITE_MEM " + canoePid + " " + QByteArray::number(memAddr, 16) + " " + QByteArray::number(size) + "\n");
     alive_timer.start();
 }
 
+// The data are needed to build the WRITE_MEM stream, so nothing is sent before writeData got everything
 void SNESClassic::putAddrCommand(SD2Snes::space space, QList<QPair<unsigned int, quint8> > &args)
 {
     Q_UNUSED(space)
-    Q_UNUSED(args)
+    sDebug() << "Multi Put address" << args.size();
+    const QList<AddressMapper::Piece> pieces = addressMapper.map(args, AddressMapper::ByRegion);
+    if (!checkPieces(pieces))
+        return ;
+    startPut(pieces);
+}
+
+void SNESClassic::startPut(const QList<AddressMapper::Piece>& pieces)
+{
+    m_state = BUSY;
+    cmdWasGet = false;
+    multiPutPieces = pieces;
+    multiPutData.clear();
+    multiPutSize = 0;
+    for (const auto& piece : pieces)
+        multiPutSize += piece.size;
+    expectedAcks = pieces.size();
+    receivedAcks = 0;
+    ackData.clear();
+    lastPutWrite.clear();
 }
 
 void SNESClassic::putAddrCommand(SD2Snes::space space, unsigned char flags, unsigned int addr, unsigned int size)
@@ -202,6 +320,27 @@ void SNESClassic::setState(ADevice::State state)
 
 void SNESClassic::writeData(QByteArray data)
 {
+    if (multiPutSize != 0)
+    {
+        multiPutData += data;
+        if (static_cast<unsigned int>(multiPutData.size()) < multiPutSize)
+            return ;
+        QByteArray toWrite;
+        int offset = 0;
+        for (const auto& piece : qAsConst(multiPutPieces))
+        {
+            toWrite += "WRITE_MEM " + canoePid + " " + QByteArray::number(translateAddress(piece), 16) + " " + QByteArray::number(piece.size) + "\n";
+            toWrite += multiPutData.mid(offset, static_cast<int>(piece.size));
+            offset += static_cast<int>(piece.size);
+        }
+        multiPutSize = 0;
+        multiPutData.clear();
+        multiPutPieces.clear();
+        // lastCmdWrite holds the whole stream, nothing more to resend on reconnect
+        writeSocket(toWrite);
+        alive_timer.start();
+        return ;
+    }
     lastPutWrite += data;
     sDebug() << ">>" << data;
     socket->write(data);
@@ -222,6 +361,11 @@ bool SNESClassic::hasControlCommands()
     return false;
 }
 
+bool SNESClassic::hasVariaditeCommands()
+{
+    return true;
+}
+
 USB2SnesInfo SNESClassic::parseInfo(const QByteArray &data)
 {
     Q_UNUSED(data)
@@ -281,7 +425,20 @@ void SNESClassic::onAliveTimeout()
     socket->connectToHost(myIp, 1042);
     if (socket->waitForConnected(100))
     {
-        writeSocket(lastCmdWrite);
+        receivedAcks = 0;
+        ackData.clear();
+        if (cmdWasGet && !requestInfo)
+        {
+            // Every reply not fully received is asked again
+            getData.truncate(replyOffset);
+            QByteArray toWrite;
+            for (const MemRead& read : qAsConst(inFlightReads))
+                toWrite += read.cmd;
+            writeSocket(toWrite);
+            alive_timer.start();
+        } else {
+            writeSocket(lastCmdWrite);
+        }
         if (!cmdWasGet)
         {
             writeSocket(lastPutWrite);
@@ -22,6 +22,7 @@
 #define SNESCLASSIC_H
 
 #include "../adevice.h"
+#include "../rommapping/addressmapper.h"
 
 #include <QObject>
 #include <QTcpSocket>
@@ -50,6 +51,7 @@ public:
     QString name() const override;
     bool hasFileCommands() override;
     bool hasControlCommands() override;
+    bool hasVariaditeCommands() override;
     bool canAttach();
     void sockConnect(QString ip);
     USB2SnesInfo parseInfo(const QByteArray &data) override;
@@ -81,12 +83,35 @@ private:
     bool                cmdWasGet;
     unsigned int        getSize;
     QByteArray          getData;
+    // READ_MEM are pipelined, the replies are in order so they are split by their sizes
+    struct MemRead {
+        QByteArray      cmd;
+        unsigned int    size;
+    };
+    QList<MemRead>      pendingReads;
+    QList<MemRead>      inFlightReads;
+    int                 replyOffset;
+    int                 pipelineDepth;
     bool                requestInfo;
     QByteArray          lastCmdWrite;
     QByteArray          lastPutWrite;
+    // Put commands can stack several WRITE_MEM, each one is acked by serverstuff
+    int                 expectedAcks;
+    int                 receivedAcks;
+    QByteArray          ackData;
+    AddressMapper       addressMapper;
+    QList<AddressMapper::Piece> multiPutPieces;
+    QByteArray          multiPutData;
+    unsigned int        multiPutSize;
     struct rom_infos*   c_rom_infos;
 
     void                findMemoryLocations();
+    quint64             translateAddress(const AddressMapper::Piece& piece) const;
+    bool                checkPieces(const QList<AddressMapper::Piece>& pieces);
+    void                startPut(const QList<AddressMapper::Piece>& pieces);
+    void                startReads();
+    void                queueRead(quint64 memAddr, unsigned int size);
+    void                flushReads();
     void                executeCommand(QByteArray toExec);
     void                writeSocket(QByteArray toWrite);
     QByteArray          readCommandReturns(QTcpSocket *msocket);
@@ -18,6 +18,7 @@
  * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <QCryptographicHash>
 #include <QLoggingCategory>
 #include <QSettings>
 #include <QtEndian>
@@ -27,10 +28,18 @@ Q_LOGGING_CATEGORY(log_snesclassicfact, "SNESClassic Factory")
 #define sInfo() qCInfo(log_snesclassicfact)
 
 extern QSettings* globalSettings;
-extern bool    dontLogNext;
 
 #define SNES_CLASSIC_IP "169.254.13.37"
 
+// The canoe check interval doubles each time canoe is found unchanged
+static const int watchdogMinInterval = 2000;
+static const int watchdogMaxInterval = 32000;
+
+static const QByteArray readErrorReply = QByteArray::fromHex("00004552524f520000");
+// Rom header, sram and ram pointer reads done to validate the cached locations.
+// Each is longer than an error reply so an error in the middle can be told apart
+static const unsigned int validateReadSizes[] = {20, 16, 12};
+
 #include "snesclassic.h"
 #include "snesclassicfactory.h"
 
@@ -46,10 +55,11 @@ SNESClassicFactory::SNESClassicFactory()
 
     sInfo() << "SNES Classic device will try to connect to " << snesclassicIP;
     checkState = StatusState::NO_CHECK;
-    checkAliveTimer.setInterval(5000);
+    watchdogInterval = watchdogMinInterval;
+    watchdogTimer.setSingleShot(true);
     doingDeviceList = false;
     doingDeviceStatus = false;
-    connect(&checkAliveTimer, &QTimer::timeout, this, &SNESClassicFactory::aliveCheck);
+    connect(&watchdogTimer, &QTimer::timeout, this, &SNESClassicFactory::watchdogCheck);
     connect(socket, &QAbstractSocket::readyRead, this, &SNESClassicFactory::onReadyRead);
     connect(socket, &QAbstractSocket::connected, this, &SNESClassicFactory::onSocketConnected);
     connect(socket, &QAbstractSocket::stateChanged, this, [=] {
@@ -120,7 +130,28 @@ void SNESClassicFactory::onReadyRead()
             dataRecv.chop(4);
         }
     } else {
-        if (dataRecv.size() != readMemSize)
+        if (checkState == StatusState::CHECK_MEMORY_LOCATION_VALIDATE)
+        {
+            // The replies of the validation reads follow each other, any of them can be an error instead
+            int offset = 0;
+            for (unsigned int readSize : validateReadSizes)
+            {
+                if (dataRecv.size() - offset >= readErrorReply.size() && dataRecv.mid(offset, readErrorReply.size()) == readErrorReply)
+                {
+                    sDebug() << "Cached memory location can't be read, doing a full discovery";
+                    dataRecv.clear();
+                    readMemSize = 0;
+                    removeMemoryCache();
+                    resetMemoryAddresses();
+                    startMemoryDiscovery();
+                    return;
+                }
+                if (dataRecv.size() - offset < static_cast<int>(readSize))
+                    return;
+                offset += readSize;
+            }
+            readMemSize = 0;
+        } else if (dataRecv.size() != readMemSize)
         {
             return ;
         } else {
@@ -131,7 +162,6 @@ void SNESClassicFactory::onReadyRead()
     {
     case StatusState::CHECK_ALIVE:
     {
-        dontLogNext = false;
         dataRecv = dataRecv.trimmed();
         // Canoe not running anymore
         if (dataRecv.isEmpty())
@@ -140,7 +170,7 @@ void SNESClassicFactory::onReadyRead()
             device->close();
             socket->close();
 
-            checkAliveTimer.stop();
+            watchdogTimer.stop();
             resetMemoryAddresses();
             checkState = StatusState::NO_CHECK;
             break;
@@ -152,10 +182,15 @@ void SNESClassicFactory::onReadyRead()
         {
             //sDebug() << "Pid is same, nice";
             checkState = StatusState::NO_CHECK;
+            watchdogInterval = qMin(watchdogInterval * 2, watchdogMaxInterval);
+            watchdogTimer.start(watchdogInterval);
             break;
         }
         // We have a new pid, the old addresses are invalid
         resetMemoryAddresses();
+        checkState = StatusState::NO_CHECK;
+        watchdogInterval = watchdogMinInterval;
+        watchdogTimer.start(watchdogInterval);
         checkStuff();
         break;
     }
@@ -180,6 +215,7 @@ void SNESClassicFactory::onReadyRead()
             m_attachError = tr("SNES Classic emulator is not v2.0.14 - has hash " + dataRecv);
             break;
         }
+        canoeHash = dataRecv.trimmed();
         if (oldCanoePid != canoePid)
             resetMemoryAddresses();
         // canoe in demo mode is useless
@@ -200,20 +236,52 @@ void SNESClassicFactory::onReadyRead()
             m_attachError = tr("SNES Classic emulator is running in demo mode.");
             break;
         }
+        canoeGame.clear();
+        const QList<QByteArray> canoeArgs = dataRecv.simplified().split(' ');
+        int romArg = canoeArgs.indexOf("-rom");
+        if (romArg != -1 && romArg + 1 < canoeArgs.size())
+            canoeGame = canoeArgs.at(romArg + 1);
         if (!hasValidMemory())
         {
-            checkState = StatusState::CHECK_MEMORY_LOCATION_READ_RAM_LOC;
-            bool     ok;
-            uint32_t pid = canoePid.toULong(&ok);
-            //(*0x1dff84) + 0x20BEC
-            QString s = QString::asprintf("READ_MEM %u %zx %u\n", pid, 0x1dff84, 4);
-            readMemSize = 4;
-            writeSocket(s.toUtf8());
+            // The same canoe build running the same game uses the same memory layout,
+            // the cached locations are checked in one round trip instead of running pmap:
+            // the rom header, a read of the sram to know it's still mapped and the ram pointer
+            if (loadMemoryCache())
+            {
+                sDebug() << "Validating cached memory location for" << canoeGame;
+                checkState = StatusState::CHECK_MEMORY_LOCATION_VALIDATE;
+                bool     ok;
+                uint32_t pid = canoePid.toULong(&ok);
+                QString s = QString::asprintf("READ_MEM %u %x %u\n", pid, romLocation - 0x38, validateReadSizes[0]);
+                s += QString::asprintf("READ_MEM %u %x %u\n", pid, sramLocation, validateReadSizes[1]);
+                s += QString::asprintf("READ_MEM %u %zx %u\n", pid, 0x1dff84, validateReadSizes[2]);
+                writeSocket(s.toUtf8());
+            } else {
+                startMemoryDiscovery();
+            }
         } else {
             checkSuccess();
         }
         break;
     }
+    case StatusState::CHECK_MEMORY_LOCATION_VALIDATE:
+    {
+        if (isRomHeader(dataRecv.left(validateReadSizes[0])))
+        {
+            // The ram is allocated per process, the pointer is read again like the discovery does
+            const int ramPointerOffset = validateReadSizes[0] + validateReadSizes[1];
+            ramLocation = qFromLittleEndian<quint32>(static_cast<const void*>(dataRecv.constData() + ramPointerOffset)) + 0x20BEC;
+            sDebug() << "Cached memory location is valid" << sramLocation << romLocation << ramLocation;
+            saveMemoryCache();
+            checkSuccess();
+        } else {
+            sDebug() << "Cached memory location does not match, doing a full discovery";
+            removeMemoryCache();
+            resetMemoryAddresses();
+            startMemoryDiscovery();
+        }
+        break;
+    }
     case StatusState::CHECK_MEMORY_LOCATION_READ_RAM_LOC:
     {
         ramLocation = qFromLittleEndian<quint32>(static_cast<const void*>(dataRecv.constData())) + 0x20BEC;
@@ -252,12 +320,6 @@ void SNESClassicFactory::onReadyRead()
             {
                 // The 8196KB rom block is sometimes combined with a 2044KB stack block,
                 // so check for the rom 2044KB into this block.
-                // The proper rom location will start with 5 4-byte values:
-                // 0x00: 0
-                // 0x04: 8392706
-                // 0x08: 256
-                // 0x0C: <rom size>
-                // 0x10: 48
                 bool ok;
                 uint32_t pid = canoePid.toULong(&ok);
                 unsigned int location = ls.at(0).toULong(&ok, 16);
@@ -270,17 +332,18 @@ void SNESClassicFactory::onReadyRead()
         }
         sDebug() << "Mem location" << sramLocation << romLocation << ramLocation;
         if (hasValidMemory())
+        {
+            saveMemoryCache();
             checkSuccess();
+        }
         break;
     }
     case StatusState::CHECK_MEMORY_LOCATION_READ_ROM_CHECK1:
     {
-        const char* data = dataRecv.constData();
-        if (qFromLittleEndian<uint32_t>(data + 4) == 8392706
-            && qFromLittleEndian<uint32_t>(data + 8) == 256
-            && qFromLittleEndian<uint32_t>(data + 16) == 48)
+        if (isRomHeader(dataRecv))
         {
             romLocation = lastPmapLocation + 2044 * 1024 + 0x38;
+            saveMemoryCache();
             checkSuccess();
         } else {
         // If it wasn't there, also check at the start of this block
@@ -295,12 +358,10 @@ void SNESClassicFactory::onReadyRead()
     }
     case StatusState::CHECK_MEMORY_LOCATION_READ_ROM_CHECK2:
     {
-        const char* data = dataRecv.constData();
-        if (qFromLittleEndian<uint32_t>(data + 4) == 8392706
-            && qFromLittleEndian<uint32_t>(data + 8) == 256
-            && qFromLittleEndian<uint32_t>(data + 16) == 48)
+        if (isRomHeader(dataRecv))
         {
             romLocation = lastPmapLocation + 0x38;
+            saveMemoryCache();
             checkSuccess();
         } else {
             checkFailed(Error::DeviceFactoryError::DFE_SNESCLASSIC_MEMORY_LOCATION_NOT_FOUND);
@@ -321,6 +382,7 @@ void SNESClassicFactory::checkSuccess()
         {
             sDebug() << "Creating SNES Classic device";
             device = new SNESClassic();
+            connect(device, &ADevice::closed, &watchdogTimer, &QTimer::stop);
             device->canoePid = canoePid;
             device->setMemoryLocation(ramLocation, sramLocation, romLocation);
             m_devices.append(device);
@@ -328,7 +390,7 @@ void SNESClassicFactory::checkSuccess()
         if (device->state() == ADevice::CLOSED)
         {
             device->sockConnect(snesclassicIP);
-            checkAliveTimer.start();
+            startWatchdog();
         }
         emit newDeviceName(device->name());
         emit devicesListDone();
@@ -352,6 +414,8 @@ void    SNESClassicFactory::checkFailed(Error::DeviceFactoryError err, QString e
 {
     checkState = StatusState::NO_CHECK;
     sDebug() << "Check failed " << err;
+    if (device != nullptr && device->state() != ADevice::CLOSED)
+        watchdogTimer.start(watchdogInterval);
     if (doingDeviceList)
     {
         doingDeviceList = false;
@@ -389,14 +453,29 @@ bool SNESClassicFactory::checkStuff()
     return true;
 }
 
-void SNESClassicFactory::aliveCheck()
+void SNESClassicFactory::startWatchdog()
 {
-    if (checkState == StatusState::NO_CHECK)
+    watchdogInterval = watchdogMinInterval;
+    watchdogTimer.start(watchdogInterval);
+}
+
+/*
+ * READ_MEM are done on canoe memory, so a device receiving data means canoe is still there.
+ * canoe is only checked with pidof when the device was idle for a whole interval.
+ */
+
+void SNESClassicFactory::watchdogCheck()
+{
+    if (device == nullptr || device->state() == ADevice::CLOSED)
+        return ;
+    qint64 idleTime = (ADevice::monotonicTime() - device->lastDataTime()) / 1000;
+    if (device->state() == ADevice::BUSY || idleTime < watchdogInterval || checkState != StatusState::NO_CHECK)
     {
-        dontLogNext = true;
-        checkState = StatusState::CHECK_ALIVE;
-        executeCommand("pidof canoe-shvc");
+        watchdogTimer.start(watchdogInterval);
+        return ;
     }
+    checkState = StatusState::CHECK_ALIVE;
+    executeCommand("pidof canoe-shvc");
 }
 
 QStringList SNESClassicFactory::listDevices()
@@ -509,6 +588,78 @@ bool SNESClassicFactory::devicesStatus()
     return true;
 }
 
+void SNESClassicFactory::startMemoryDiscovery()
+{
+    checkState = StatusState::CHECK_MEMORY_LOCATION_READ_RAM_LOC;
+    bool     ok;
+    uint32_t pid = canoePid.toULong(&ok);
+    //(*0x1dff84) + 0x20BEC
+    QString s = QString::asprintf("READ_MEM %u %zx %u\n", pid, 0x1dff84, 4);
+    readMemSize = 4;
+    writeSocket(s.toUtf8());
+}
+
+// The rom block starts with 5 4-byte values:
+// 0x00: 0
+// 0x04: 8392706
+// 0x08: 256
+// 0x0C: <rom size>
+// 0x10: 48
+bool SNESClassicFactory::isRomHeader(const QByteArray &data) const
+{
+    if (data.size() < 20)
+        return false;
+    const char* header = data.constData();
+    return qFromLittleEndian<uint32_t>(header + 4) == 8392706
+        && qFromLittleEndian<uint32_t>(header + 8) == 256
+        && qFromLittleEndian<uint32_t>(header + 16) == 48;
+}
+
+QString SNESClassicFactory::memoryCacheKey() const
+{
+    if (canoeHash.isEmpty() || canoeGame.isEmpty())
+        return QString();
+    QByteArray key = canoeHash + "|" + canoeGame.toUtf8();
+    return "SNESClassicMemory/" + QCryptographicHash::hash(key, QCryptographicHash::Sha1).toHex();
+}
+
+bool SNESClassicFactory::loadMemoryCache()
+{
+    QString key = memoryCacheKey();
+    if (key.isEmpty() || !globalSettings->contains(key))
+        return false;
+    QStringList locations = globalSettings->value(key).toStringList();
+    if (locations.size() != 3)
+        return false;
+    bool ok[3];
+    ramLocation = locations.at(0).toUInt(&ok[0], 16);
+    sramLocation = locations.at(1).toUInt(&ok[1], 16);
+    romLocation = locations.at(2).toUInt(&ok[2], 16);
+    if (!ok[0] || !ok[1] || !ok[2] || !hasValidMemory())
+    {
+        resetMemoryAddresses();
+        return false;
+    }
+    return true;
+}
+
+void SNESClassicFactory::saveMemoryCache()
+{
+    QString key = memoryCacheKey();
+    if (key.isEmpty())
+        return;
+    globalSettings->setValue(key, QStringList() << QString::number(ramLocation, 16)
+                                                << QString::number(sramLocation, 16)
+                                                << QString::number(romLocation, 16));
+}
+
+void SNESClassicFactory::removeMemoryCache()
+{
+    QString key = memoryCacheKey();
+    if (!key.isEmpty())
+        globalSettings->remove(key);
+}
+
 bool SNESClassicFactory::hasValidMemory()
 {
     return ramLocation != 0 && romLocation != 0 && sramLocation != 0;
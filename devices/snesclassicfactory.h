@@ -48,6 +48,7 @@ public:
         CHECK_PIDCANOE,
         CHECK_CANOE_VERSION,
         CHECK_CANOE_MODE,
+        CHECK_MEMORY_LOCATION_VALIDATE,
         CHECK_MEMORY_LOCATION_READ_RAM_LOC,
         CHECK_MEMORY_LOCATION_PMAP,
         CHECK_MEMORY_LOCATION_READ_ROM_CHECK1,
@@ -61,12 +62,15 @@ private:
     QByteArray          oldCanoePid;
     QByteArray          dataRecv;
     SNESClassic*        device = nullptr;
-    QTimer              checkAliveTimer;
+    QTimer              watchdogTimer;
+    int                 watchdogInterval;
     unsigned int        romLocation = 0;
     unsigned int        sramLocation = 0;
     unsigned int        ramLocation = 0;
     unsigned int        lastPmapLocation = 0;
     unsigned int        readMemSize;
+    QByteArray          canoeHash;
+    QString             canoeGame;
     QString             snesclassicIP;
     bool                checkingState;
     bool                doingDeviceList;
@@ -80,11 +84,18 @@ private:
     /*QByteArray readCommandReturns(QTcpSocket *msocket);
     QByteArray readSocketReturns(QTcpSocket* msocket);*/
     bool    checkStuff();
-    void    aliveCheck();
+    void    startWatchdog();
+    void    watchdogCheck();
 
     bool    hasValidMemory();
 
     void    resetMemoryAddresses();
+    void    startMemoryDiscovery();
+    QString memoryCacheKey() const;
+    bool    loadMemoryCache();
+    void    saveMemoryCache();
+    void    removeMemoryCache();
+    bool    isRomHeader(const QByteArray& data) const;
 
     void    onReadyRead();
     void    onSocketConnected();
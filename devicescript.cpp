@@ -0,0 +1,544 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <QLoggingCategory>
+#include <QStringList>
+#include <cstdlib>
+#include "devicescript.h"
+
+extern "C" {
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+}
+
+Q_LOGGING_CATEGORY(log_devscript, "DeviceScript")
+#define sDebug() qCDebug(log_devscript)
+
+/*
+ * Lua errors are a longjmp : the C functions called by Lua raise them before creating any C++ object,
+ * and what can fail to allocate outside of the script runs in protectedCall, an unprotected error aborts.
+ */
+
+// The instruction count is checked every hookInterval instructions
+static const int            hookInterval = 1000;
+// Per call of snes.read / snes.write
+static const lua_Integer    maxTransferSize = 0x10000;
+static const int            maxEventsPerTick = 64;
+
+DeviceScript::DeviceScript(size_t memoryLimit, int instructionLimit)
+{
+    thread = nullptr;
+    threadRef = LUA_NOREF;
+    pending = DONE;
+    memoryUsed = 0;
+    this->memoryLimit = memoryLimit;
+    this->instructionLimit = instructionLimit;
+    instructionCount = 0;
+    limitReached = false;
+    L = lua_newstate(&DeviceScript::allocate, this);
+    if (L == nullptr)
+        return ;
+    if (!protectedCall(&DeviceScript::openSandbox, nullptr, 0))
+    {
+        lua_close(L);
+        L = nullptr;
+        return ;
+    }
+    lua_sethook(L, &DeviceScript::countHook, LUA_MASKCOUNT, hookInterval);
+}
+
+DeviceScript::~DeviceScript()
+{
+    if (L != nullptr)
+        lua_close(L);
+}
+
+bool DeviceScript::load(const QString &name, const QByteArray &source)
+{
+    if (L == nullptr)
+    {
+        m_errorString = "Not enough memory to create the script";
+        return false;
+    }
+    instructionCount = 0;
+    QByteArray chunkName = "=" + name.toUtf8();
+    // Text only, a precompiled chunk can break the interpreter
+    if (luaL_loadbufferx(L, source.constData(), static_cast<size_t>(source.size()), chunkName.constData(), "t") != LUA_OK
+        || lua_pcall(L, 0, 0, 0) != LUA_OK)
+    {
+        m_errorString = luaError(L);
+        lua_pop(L, 1);
+        return false;
+    }
+    if (!protectedCall(&DeviceScript::checkTick, nullptr, 1))
+        return false;
+    bool hasTick = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    if (!hasTick)
+    {
+        m_errorString = "The script has no tick function";
+        return false;
+    }
+    sDebug() << "Loaded" << name << memoryUsed << "bytes used";
+    return true;
+}
+
+// A new coroutine each tick, one left by a failed tick is dropped
+DeviceScript::Status DeviceScript::startTick()
+{
+    releaseThread();
+    events.clear();
+    instructionCount = 0;
+    if (!protectedCall(&DeviceScript::prepareTick, nullptr, 0))
+        return ERROR;
+    return run(0);
+}
+
+// readData is the data of all the ranges of a snes.read, nothing after a snes.write
+DeviceScript::Status DeviceScript::resume(const QByteArray &readData)
+{
+    if (thread == nullptr)
+    {
+        m_errorString = "The script is not running";
+        return ERROR;
+    }
+    int nargs = 0;
+    if (pending == READ)
+    {
+        unsigned int total = 0;
+        foreach (const Range& range, m_ranges)
+            total += range.second;
+        nargs = m_ranges.size();
+        if (static_cast<unsigned int>(readData.size()) < total || !lua_checkstack(thread, nargs))
+        {
+            m_errorString = "Could not give the read data to the script";
+            releaseThread();
+            return ERROR;
+        }
+        if (!protectedCall(&DeviceScript::pushReadData, const_cast<QByteArray*>(&readData), nargs))
+        {
+            releaseThread();
+            return ERROR;
+        }
+        lua_xmove(L, thread, nargs);
+    }
+    return run(nargs);
+}
+
+QList<DeviceScript::Range> DeviceScript::ranges() const
+{
+    return m_ranges;
+}
+
+QByteArray DeviceScript::writeData() const
+{
+    return m_writeData;
+}
+
+QList<DeviceScript::Event> DeviceScript::takeEvents()
+{
+    QList<Event> toRet = events;
+    events.clear();
+    return toRet;
+}
+
+QString DeviceScript::errorString() const
+{
+    return m_errorString;
+}
+
+DeviceScript::Status DeviceScript::run(int nargs)
+{
+    pending = DONE;
+    int nresults = 0;
+#if LUA_VERSION_NUM >= 504
+    int status = lua_resume(thread, L, nargs, &nresults);
+#else
+    int status = lua_resume(thread, L, nargs);
+    nresults = lua_gettop(thread);
+#endif
+    if (status == LUA_YIELD)
+    {
+        lua_pop(thread, nresults);
+        // Only snes.read and snes.write yield
+        if (pending == DONE)
+        {
+            m_errorString = "Unexpected yield";
+            releaseThread();
+            return ERROR;
+        }
+        return pending;
+    }
+    if (status != LUA_OK)
+    {
+        m_errorString = luaError(thread);
+        releaseThread();
+        return ERROR;
+    }
+    releaseThread();
+    return DONE;
+}
+
+// The function gets data as a light userdata, its results stay on the stack
+bool DeviceScript::protectedCall(int (*function)(lua_State *), void *data, int nresults)
+{
+    lua_pushcfunction(L, function);
+    lua_pushlightuserdata(L, data);
+    if (lua_pcall(L, 1, nresults, 0) == LUA_OK)
+        return true;
+    m_errorString = luaError(L);
+    lua_pop(L, 1);
+    return false;
+}
+
+void DeviceScript::releaseThread()
+{
+    if (threadRef != LUA_NOREF)
+        luaL_unref(L, LUA_REGISTRYINDEX, threadRef);
+    threadRef = LUA_NOREF;
+    thread = nullptr;
+}
+
+// The allocator user data is the script
+DeviceScript *DeviceScript::fromState(lua_State *L)
+{
+    void* ud = nullptr;
+    lua_getallocf(L, &ud);
+    return static_cast<DeviceScript*>(ud);
+}
+
+QString DeviceScript::luaError(lua_State *L)
+{
+    const char* msg = lua_tostring(L, -1);
+    return msg != nullptr ? QString::fromUtf8(msg) : QString("Unknown error");
+}
+
+void *DeviceScript::allocate(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    DeviceScript* script = static_cast<DeviceScript*>(ud);
+    // Without a block osize is the type of the object to create
+    size_t oldSize = ptr != nullptr ? osize : 0;
+    if (nsize == 0)
+    {
+        script->memoryUsed -= oldSize;
+        free(ptr);
+        return nullptr;
+    }
+    if (nsize > oldSize && script->memoryUsed - oldSize + nsize > script->memoryLimit)
+        return nullptr;
+    void* newPtr = realloc(ptr, nsize);
+    if (newPtr != nullptr)
+        script->memoryUsed = script->memoryUsed - oldSize + nsize;
+    return newPtr;
+}
+
+void DeviceScript::countHook(lua_State *L, lua_Debug *ar)
+{
+    Q_UNUSED(ar)
+    DeviceScript* script = fromState(L);
+    if (!script->limitReached)
+    {
+        script->instructionCount += hookInterval;
+        if (script->instructionCount <= script->instructionLimit)
+            return ;
+        script->limitReached = true;
+        // Every instruction fails now so a pcall can't keep the script running
+        lua_sethook(L, &DeviceScript::countHook, LUA_MASKCOUNT, 1);
+    }
+    luaL_error(L, "instruction limit reached");
+}
+
+/*
+ * The hook only sees the Lua instructions, a C function that loops count times
+ * without allocating is charged count instructions before it runs.
+ */
+
+void DeviceScript::charge(lua_State *L, quint64 count)
+{
+    DeviceScript* script = fromState(L);
+    if (!script->limitReached && count <= static_cast<quint64>(script->instructionLimit - script->instructionCount))
+    {
+        script->instructionCount += static_cast<int>(count);
+        return ;
+    }
+    script->limitReached = true;
+    lua_sethook(L, &DeviceScript::countHook, LUA_MASKCOUNT, 1);
+    luaL_error(L, "instruction limit reached");
+}
+
+// Calls the library function in the first upvalue with the arguments
+int DeviceScript::callOriginal(lua_State *L)
+{
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+    return lua_gettop(L);
+}
+
+int DeviceScript::openSandbox(lua_State *L)
+{
+    static const luaL_Reg libs[] = {
+        {"_G", luaopen_base},
+        {LUA_STRLIBNAME, luaopen_string},
+        {LUA_TABLIBNAME, luaopen_table},
+        {LUA_MATHLIBNAME, luaopen_math},
+        {LUA_UTF8LIBNAME, luaopen_utf8},
+        {nullptr, nullptr}
+    };
+    for (const luaL_Reg* lib = libs; lib->func != nullptr; lib++)
+    {
+        luaL_requiref(L, lib->name, lib->func, 1);
+        lua_pop(L, 1);
+    }
+    // Nothing that can load code or reach the files
+    static const char* removed[] = {"dofile", "loadfile", "load", "require", "collectgarbage", nullptr};
+    for (const char** name = removed; *name != nullptr; name++)
+    {
+        lua_pushnil(L);
+        lua_setglobal(L, *name);
+    }
+    // A pattern backtracks in C, nothing bounds its time
+    static const char* removedString[] = {"dump", "find", "match", "gmatch", "gsub", nullptr};
+    lua_getglobal(L, LUA_STRLIBNAME);
+    for (const char** name = removedString; *name != nullptr; name++)
+    {
+        lua_pushnil(L);
+        lua_setfield(L, -2, *name);
+    }
+    lua_getfield(L, -1, "rep");
+    lua_pushcclosure(L, &DeviceScript::luaStringRep, 1);
+    lua_setfield(L, -2, "rep");
+    lua_pop(L, 1);
+    // The length of a table is not bounded by its size, t[1], t[2], t[4]... is enough
+    static const luaL_Reg chargedTable[] = {
+        {"insert", &DeviceScript::luaTableInsert},
+        {"remove", &DeviceScript::luaTableRemove},
+        {"move", &DeviceScript::luaTableMove},
+        {nullptr, nullptr}
+    };
+    lua_getglobal(L, LUA_TABLIBNAME);
+    for (const luaL_Reg* func = chargedTable; func->func != nullptr; func++)
+    {
+        lua_getfield(L, -1, func->name);
+        lua_pushcclosure(L, func->func, 1);
+        lua_setfield(L, -2, func->name);
+    }
+    lua_pop(L, 1);
+    lua_pushcfunction(L, &DeviceScript::luaPrint);
+    lua_setglobal(L, "print");
+    // Finalizers run with the hooks off, the instruction limit could not stop them
+    lua_getglobal(L, "setmetatable");
+    lua_pushcclosure(L, &DeviceScript::luaSetMetatable, 1);
+    lua_setglobal(L, "setmetatable");
+    static const luaL_Reg snesLib[] = {
+        {"read", &DeviceScript::luaRead},
+        {"write", &DeviceScript::luaWrite},
+        {"event", &DeviceScript::luaEvent},
+        {nullptr, nullptr}
+    };
+    luaL_newlib(L, snesLib);
+    lua_setglobal(L, "snes");
+    return 0;
+}
+
+int DeviceScript::checkTick(lua_State *L)
+{
+    lua_pushboolean(L, lua_getglobal(L, "tick") == LUA_TFUNCTION);
+    return 1;
+}
+
+int DeviceScript::prepareTick(lua_State *L)
+{
+    DeviceScript* script = fromState(L);
+    lua_State* thread = lua_newthread(L);
+    lua_sethook(thread, &DeviceScript::countHook, LUA_MASKCOUNT, hookInterval);
+    lua_getglobal(L, "tick");
+    lua_xmove(L, thread, 1);
+    script->threadRef = luaL_ref(L, LUA_REGISTRYINDEX);
+    script->thread = thread;
+    return 0;
+}
+
+int DeviceScript::pushReadData(lua_State *L)
+{
+    DeviceScript* script = fromState(L);
+    const QByteArray* data = static_cast<const QByteArray*>(lua_touserdata(L, 1));
+    int count = script->m_ranges.size();
+    luaL_checkstack(L, count, "too many ranges");
+    int pos = 0;
+    for (int i = 0; i < count; i++)
+    {
+        lua_pushlstring(L, data->constData() + pos, script->m_ranges.at(i).second);
+        pos += static_cast<int>(script->m_ranges.at(i).second);
+    }
+    return count;
+}
+
+// snes.read(address, size, ...) -> data, ...
+int DeviceScript::luaRead(lua_State *L)
+{
+    int nargs = lua_gettop(L);
+    if (nargs == 0 || nargs % 2 != 0)
+        return luaL_error(L, "snes.read expects address and size pairs");
+    lua_Integer total = 0;
+    for (int i = 1; i <= nargs; i += 2)
+    {
+        lua_Integer address = luaL_checkinteger(L, i);
+        lua_Integer size = luaL_checkinteger(L, i + 1);
+        if (address < 0 || address > 0xFFFFFF || size <= 0)
+            return luaL_error(L, "snes.read: invalid range");
+        total += size;
+        if (total > maxTransferSize)
+            return luaL_error(L, "snes.read: more than %d bytes", static_cast<int>(maxTransferSize));
+    }
+    DeviceScript* script = fromState(L);
+    script->m_ranges.clear();
+    script->m_writeData.clear();
+    for (int i = 1; i <= nargs; i += 2)
+        script->m_ranges.append(Range(static_cast<unsigned int>(lua_tointeger(L, i)), static_cast<unsigned int>(lua_tointeger(L, i + 1))));
+    script->pending = READ;
+    return lua_yield(L, 0);
+}
+
+// snes.write(address, data, ...)
+int DeviceScript::luaWrite(lua_State *L)
+{
+    int nargs = lua_gettop(L);
+    if (nargs == 0 || nargs % 2 != 0)
+        return luaL_error(L, "snes.write expects address and data pairs");
+    size_t total = 0;
+    for (int i = 1; i <= nargs; i += 2)
+    {
+        lua_Integer address = luaL_checkinteger(L, i);
+        size_t size = 0;
+        luaL_checklstring(L, i + 1, &size);
+        if (address < 0 || address > 0xFFFFFF || size == 0)
+            return luaL_error(L, "snes.write: invalid range");
+        total += size;
+        if (total > static_cast<size_t>(maxTransferSize))
+            return luaL_error(L, "snes.write: more than %d bytes", static_cast<int>(maxTransferSize));
+    }
+    DeviceScript* script = fromState(L);
+    script->m_ranges.clear();
+    script->m_writeData.clear();
+    for (int i = 1; i <= nargs; i += 2)
+    {
+        size_t size = 0;
+        const char* data = lua_tolstring(L, i + 1, &size);
+        script->m_ranges.append(Range(static_cast<unsigned int>(lua_tointeger(L, i)), static_cast<unsigned int>(size)));
+        script->m_writeData.append(data, static_cast<int>(size));
+    }
+    script->pending = WRITE;
+    return lua_yield(L, 0);
+}
+
+// snes.event(name, (value))
+int DeviceScript::luaEvent(lua_State *L)
+{
+    DeviceScript* script = fromState(L);
+    if (script->events.size() >= maxEventsPerTick)
+        return luaL_error(L, "snes.event: more than %d events in a tick", maxEventsPerTick);
+    const char* name = luaL_checkstring(L, 1);
+    const char* value = lua_isnoneornil(L, 2) ? "" : luaL_tolstring(L, 2, nullptr);
+    Event event;
+    event.name = QString::fromUtf8(name);
+    event.value = QString::fromUtf8(value);
+    script->events.append(event);
+    return 0;
+}
+
+// setmetatable without __gc, then the real one
+int DeviceScript::luaSetMetatable(lua_State *L)
+{
+    if (lua_type(L, 2) == LUA_TTABLE)
+    {
+        lua_pushliteral(L, "__gc");
+        if (lua_rawget(L, 2) != LUA_TNIL)
+            return luaL_error(L, "setmetatable: __gc is not allowed in scripts");
+        lua_pop(L, 1);
+    }
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, lua_gettop(L) - 1, 1);
+    return 1;
+}
+
+// string.rep of empty strings loops count times for nothing
+int DeviceScript::luaStringRep(lua_State *L)
+{
+    size_t size = 0;
+    size_t sepSize = 0;
+    luaL_checklstring(L, 1, &size);
+    luaL_checkinteger(L, 2);
+    luaL_optlstring(L, 3, "", &sepSize);
+    if (size + sepSize == 0)
+    {
+        lua_pushliteral(L, "");
+        return 1;
+    }
+    return callOriginal(L);
+}
+
+// table.insert(t, pos, value) moves the elements after pos
+int DeviceScript::luaTableInsert(lua_State *L)
+{
+    if (lua_gettop(L) == 3)
+    {
+        lua_Unsigned size = static_cast<lua_Unsigned>(luaL_len(L, 1));
+        lua_Unsigned pos = static_cast<lua_Unsigned>(luaL_checkinteger(L, 2));
+        if (pos >= 1 && pos <= size)
+            charge(L, size - pos + 1);
+    }
+    return callOriginal(L);
+}
+
+// table.remove(t, pos) moves the elements after pos
+int DeviceScript::luaTableRemove(lua_State *L)
+{
+    lua_Integer size = luaL_len(L, 1);
+    lua_Integer pos = luaL_optinteger(L, 2, size);
+    if (pos >= 1 && pos <= size)
+        charge(L, static_cast<lua_Unsigned>(size - pos));
+    return callOriginal(L);
+}
+
+// table.move(a1, f, e, t) copies e - f + 1 elements
+int DeviceScript::luaTableMove(lua_State *L)
+{
+    lua_Integer first = luaL_checkinteger(L, 2);
+    lua_Integer end = luaL_checkinteger(L, 3);
+    if (end >= first)
+        charge(L, static_cast<lua_Unsigned>(end) - static_cast<lua_Unsigned>(first) + 1);
+    return callOriginal(L);
+}
+
+int DeviceScript::luaPrint(lua_State *L)
+{
+    int nargs = lua_gettop(L);
+    luaL_checkstack(L, nargs, "too many arguments to print");
+    for (int i = 1; i <= nargs; i++)
+        luaL_tolstring(L, i, nullptr);
+    QStringList parts;
+    for (int i = nargs + 1; i <= 2 * nargs; i++)
+        parts.append(QString::fromUtf8(lua_tostring(L, i)));
+    sDebug() << "Script:" << parts.join(" ");
+    return 0;
+}
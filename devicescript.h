@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef DEVICESCRIPT_H
+#define DEVICESCRIPT_H
+
+#include <QByteArray>
+#include <QList>
+#include <QPair>
+#include <QString>
+
+struct lua_State;
+struct lua_Debug;
+
+/*
+ * A Lua script sent by a client and run by the server next to the device.
+ * The script defines a tick() function, the server calls it at the script interval.
+ * In it snes.read(address, size, ...) returns the memory of one or more ranges and
+ * snes.write(address, data, ...) writes, tick runs in a coroutine so the server is not
+ * blocked while the device works. snes.event(name, value) sends an event to the client.
+ * The sandbox has the base, string, table, math and utf8 libraries without what can load code,
+ * a memory limit and a limit of instructions per tick. A script that hits one is stopped.
+ * The instruction limit is the CPU limit : the library functions that loop in C without a bound
+ * from the memory limit are charged for their loop (table.insert, remove and move), or removed
+ * when their cost can't be known beforehand (string.find, match, gmatch and gsub).
+ */
+
+class DeviceScript
+{
+public:
+    enum Status {
+        DONE,
+        READ,
+        WRITE,
+        ERROR
+    };
+    typedef QPair<unsigned int, unsigned int> Range;
+    struct Event {
+        QString name;
+        QString value;
+    };
+
+    DeviceScript(size_t memoryLimit, int instructionLimit);
+    ~DeviceScript();
+    bool            load(const QString& name, const QByteArray& source);
+    Status          startTick();
+    Status          resume(const QByteArray& readData);
+    QList<Range>    ranges() const;
+    QByteArray      writeData() const;
+    QList<Event>    takeEvents();
+    QString         errorString() const;
+
+private:
+    lua_State*      L;
+    lua_State*      thread;
+    int             threadRef;
+    Status          pending;
+    size_t          memoryUsed;
+    size_t          memoryLimit;
+    int             instructionLimit;
+    int             instructionCount;
+    bool            limitReached;
+    QList<Range>    m_ranges;
+    QByteArray      m_writeData;
+    QList<Event>    events;
+    QString         m_errorString;
+
+    Status                  run(int nargs);
+    bool                    protectedCall(int (*function)(lua_State*), void* data, int nresults);
+    void                    releaseThread();
+    static DeviceScript*    fromState(lua_State* L);
+    static QString          luaError(lua_State* L);
+    static void*            allocate(void* ud, void* ptr, size_t osize, size_t nsize);
+    static void             countHook(lua_State* L, lua_Debug* ar);
+    static void             charge(lua_State* L, quint64 count);
+    static int              callOriginal(lua_State* L);
+    static int              openSandbox(lua_State* L);
+    static int              checkTick(lua_State* L);
+    static int              prepareTick(lua_State* L);
+    static int              pushReadData(lua_State* L);
+    static int              luaRead(lua_State* L);
+    static int              luaWrite(lua_State* L);
+    static int              luaEvent(lua_State* L);
+    static int              luaPrint(lua_State* L);
+    static int              luaSetMetatable(lua_State* L);
+    static int              luaStringRep(lua_State* L);
+    static int              luaTableInsert(lua_State* L);
+    static int              luaTableRemove(lua_State* L);
+    static int              luaTableMove(lua_State* L);
+};
+
+#endif // DEVICESCRIPT_H
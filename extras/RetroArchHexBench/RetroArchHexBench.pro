@@ -0,0 +1,28 @@
+#-------------------------------------------------
+#
+# Benchmark of the RetroArch hex encoding/decoding
+# against the QByteArray based version
+#
+#-------------------------------------------------
+
+QT       += core
+QT       -= gui
+
+TARGET = RetroArchHexBench
+TEMPLATE = app
+CONFIG += console c++11
+CONFIG -= app_bundle
+
+DEFINES += QT_DEPRECATED_WARNINGS
+
+# Use the AVX2 path when the machine support it
+#QMAKE_CXXFLAGS += -mavx2
+
+SOURCES += \
+        main.cpp \
+        ../../devices/retroarchhex.cpp
+
+HEADERS += \
+        ../../devices/retroarchhex.h
+
+INCLUDEPATH += ../../devices/
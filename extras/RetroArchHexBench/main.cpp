@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <QByteArray>
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QList>
+#include <QTextStream>
+#include <cstring>
+#include "retroarchhex.h"
+
+/*
+ * Compare the old QByteArray reply handling of RetroArchHost with RetroArchHex
+ * on replies of the size of the usual reads (a few bytes up to a full WRAM bank)
+ */
+
+static QTextStream out(stdout);
+
+static void    report(const QString& name, int size, int iterations, qint64 nsecs)
+{
+    double mbs = static_cast<double>(size) * iterations / (static_cast<double>(nsecs) / 1e9) / (1024 * 1024);
+    out << QString("%1 %2 bytes : %3 ns per call, %4 MB/s").arg(name, -14).arg(size, 6)
+           .arg(nsecs / iterations, 8).arg(mbs, 0, 'f', 1) << endl;
+}
+
+static void    benchSize(int size)
+{
+    QByteArray data(size, 0);
+    for (int i = 0; i < size; i++)
+        data[i] = static_cast<char>(i * 7 + 3);
+    const QByteArray reply = "READ_CORE_MEMORY 7e0000 " + data.toHex(' ') + "\n";
+    const int iterations = qMax(20, 4000000 / size);
+    QElapsedTimer timer;
+    int check = 0;
+
+    timer.start();
+    for (int i = 0; i < iterations; i++)
+    {
+        QList<QByteArray> tList = reply.trimmed().split(' ');
+        tList = tList.mid(2);
+        QByteArray decoded = QByteArray::fromHex(tList.join());
+        check += decoded.size();
+    }
+    report("Qt decode", size, iterations, timer.nsecsElapsed());
+
+    QByteArray buffer;
+    const int start = reply.indexOf(' ', reply.indexOf(' ') + 1) + 1;
+    timer.start();
+    for (int i = 0; i < iterations; i++)
+    {
+        buffer.resize(RetroArchHex::decodedSize(reply.size() - start));
+        int decoded = RetroArchHex::decode(reply.constData() + start, reply.size() - start, buffer.data(), buffer.size());
+        check += decoded;
+    }
+    report("RAHex decode", size, iterations, timer.nsecsElapsed());
+    if (buffer.left(size) != data)
+        out << "RAHex decode gives a different result" << endl;
+
+    timer.start();
+    for (int i = 0; i < iterations; i++)
+    {
+        QByteArray cmd = "WRITE_CORE_MEMORY 7e0000 ";
+        cmd.append(data.toHex(' '));
+        cmd.append('\n');
+        check += cmd.size();
+    }
+    report("Qt encode", size, iterations, timer.nsecsElapsed());
+
+    QByteArray cmd;
+    timer.start();
+    for (int i = 0; i < iterations; i++)
+    {
+        const QByteArray prefix = "WRITE_CORE_MEMORY 7e0000 ";
+        cmd.resize(prefix.size() + RetroArchHex::encodedSize(size) + 1);
+        memcpy(cmd.data(), prefix.constData(), static_cast<size_t>(prefix.size()));
+        RetroArchHex::encode(data.constData(), size, cmd.data() + prefix.size());
+        cmd[cmd.size() - 1] = '\n';
+        check += cmd.size();
+    }
+    report("RAHex encode", size, iterations, timer.nsecsElapsed());
+    if (cmd.mid(25, cmd.size() - 26) != data.toHex(' '))
+        out << "RAHex encode gives a different result" << endl;
+    out << "(" << check << ")" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+#if defined(__AVX2__)
+    out << "Using AVX2" << endl;
+#elif defined(__SSE2__) || defined(_M_X64)
+    out << "Using SSE2" << endl;
+#else
+    out << "Using scalar code" << endl;
+#endif
+    const QList<int> sizes = QList<int>() << 2 << 64 << 512 << 2048 << 0x2000 << 0x10000;
+    for (int size : sizes)
+        benchSize(size);
+    return 0;
+}
@@ -47,6 +47,7 @@
 
 #include "qskarsnikringlist.hpp"
 #include "wsserver.h"
+#include "nwaserver.h"
 #include "devices/sd2snesfactory.h"
 #include "devices/luabridge.h"
 #include "devices/retroarchfactory.h"
@@ -114,11 +115,6 @@ static void seg_handler(int sig)
 }
 
 
-// Set this to true if you expect lot of flood message
-// It's used for example on the snes classic device that check stuff on a timer
-// and only the relevant information is logged but not the whole snes classic message exchange
-bool    dontLogNext = false;
-
 const unsigned int MAX_LINE_LOG = 2000;
 QFile*  refToLogFile;
 
@@ -130,8 +126,6 @@ void myMessageOutput(QtMsgType type, const QMessageLogContext &context, const QS
     QTextStream*    log = &logfile;
     //QTextStream* log = new QTextStream();
     //cout << msg;
-//    if (dontLogNext)
-//        return ;
 #ifdef QT_NO_DEBUG
     QString logString = QString("%6 %5 - %7: %1").arg(localMsg.constData()).arg(context.category, 20).arg(QDateTime::currentDateTime().toString(Qt::ISODate));
 #else
@@ -211,6 +205,16 @@ void    startServer()
     }
 }
 
+// Local tools only, it listen on localhost
+void    startNWAServer()
+{
+    NWAServer* nwaServer = new NWAServer(&wsServer, &wsServer);
+    quint16 port = NWAServer::configuredPort();
+    QString status = nwaServer->start(QHostAddress::LocalHost, port);
+    if (!status.isEmpty())
+        fprintf(stderr, "Can't start the NWA server on localhost:%d : %s\n", port, status.toLatin1().data());
+}
+
 #include <signal.h>
 
 int main(int ac, char *ag[])
@@ -323,5 +327,7 @@ int main(int ac, char *ag[])
    });
    QTimer::singleShot(100, &startServer);
 #endif
+    if (globalSettings->value("nwaserver").toBool() || app.arguments().contains("-nwaserver"))
+        QTimer::singleShot(100, &startNWAServer);
     return app.exec();
 }
@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <QLoggingCategory>
+#include <algorithm>
+#include "memorywatcher.h"
+
+Q_LOGGING_CATEGORY(log_memorywatcher, "MemoryWatcher")
+#define sDebug() qCDebug(log_memorywatcher)
+
+// Watches closer than that are read with the same range
+static const unsigned int mergeGap = 16;
+// To fit in a variadic command
+static const unsigned int maxRangeSize = 255;
+
+bool MemoryWatcher::conditionFromString(const QString &str, MemoryWatcher::Condition &condition)
+{
+    static const QMap<QString, Condition> names = {
+        {"Changes", CHANGES},
+        {"Equals", EQUALS},
+        {"Greater", GREATER},
+        {"BitSet", BITSET}
+    };
+    if (!names.contains(str))
+        return false;
+    condition = names.value(str);
+    return true;
+}
+
+/*
+ * A watch with the same name from the same client is replaced
+ */
+
+void MemoryWatcher::addWatch(ADevice *device, QWebSocket *owner, const QString &name, unsigned int address, unsigned int size,
+                             MemoryWatcher::Condition condition, quint32 value, quint32 mask, unsigned int debounce)
+{
+    removeWatches(device, owner, name);
+    Watch watch;
+    watch.owner = owner;
+    watch.name = name;
+    watch.address = address;
+    watch.size = size;
+    watch.condition = condition;
+    watch.mask = size == 4 ? mask : mask & ((1u << (size * 8)) - 1);
+    watch.value = value & watch.mask;
+    watch.debounce = static_cast<qint64>(debounce) * 1000;
+    watch.hasValue = false;
+    watch.last = 0;
+    watch.reported = 0;
+    watch.active = false;
+    watch.pendingSince = -1;
+    watch.pendingValue = 0;
+    watch.lastSeen = 0;
+    watches[device].append(watch);
+    sDebug() << device->name() << "watching" << QString::number(address, 16) << "for" << name;
+}
+
+// Without name all the watches of the client are removed
+void MemoryWatcher::removeWatches(ADevice *device, QWebSocket *owner, const QString &name)
+{
+    if (!watches.contains(device))
+        return ;
+    QMutableListIterator<Watch> it(watches[device]);
+    while (it.hasNext())
+    {
+        const Watch& watch = it.next();
+        if (watch.owner == owner && (name.isEmpty() || watch.name == name))
+            it.remove();
+    }
+    if (watches.value(device).isEmpty())
+        watches.remove(device);
+}
+
+void MemoryWatcher::removeOwner(QWebSocket *owner)
+{
+    const QList<ADevice*> devices = watches.keys();
+    for (ADevice* device : devices)
+        removeWatches(device, owner);
+}
+
+void MemoryWatcher::removeDevice(ADevice *device)
+{
+    watches.remove(device);
+}
+
+bool MemoryWatcher::hasWatches(ADevice *device) const
+{
+    return watches.contains(device);
+}
+
+/*
+ * What needs to be read for the watches that were not updated since maxAge (in microseconds).
+ * The close watches are merged in ranges small enough for the variadic commands.
+ */
+
+QList<MemoryWatcher::Range> MemoryWatcher::rangesToRead(ADevice *device, qint64 maxAge) const
+{
+    QList<Range> toRead;
+    qint64 now = ADevice::monotonicTime();
+    for (const Watch& watch : watches.value(device))
+    {
+        if (now - watch.lastSeen >= maxAge)
+            toRead.append(Range(watch.address, watch.size));
+    }
+    std::sort(toRead.begin(), toRead.end());
+    QList<Range> ranges;
+    for (const Range& range : qAsConst(toRead))
+    {
+        if (!ranges.isEmpty())
+        {
+            Range& last = ranges.last();
+            unsigned int end = qMax(last.first + last.second, range.first + range.second);
+            if (range.first <= last.first + last.second + mergeGap && end - last.first <= maxRangeSize)
+            {
+                last.second = end - last.first;
+                continue;
+            }
+        }
+        ranges.append(range);
+    }
+    return ranges;
+}
+
+/*
+ * Memory read for the device starting at address, the watches fully in it are updated
+ */
+
+QList<MemoryWatcher::Event> MemoryWatcher::update(ADevice *device, unsigned int address, const QByteArray &data)
+{
+    QList<Event> events;
+    if (!watches.contains(device))
+        return events;
+    qint64 now = ADevice::monotonicTime();
+    unsigned int end = address + static_cast<unsigned int>(data.size());
+    for (Watch& watch : watches[device])
+    {
+        if (watch.address < address || watch.address + watch.size > end)
+            continue;
+        quint32 value = 0;
+        for (unsigned int i = 0; i < watch.size; i++)
+            value |= static_cast<quint32>(static_cast<quint8>(data.at(static_cast<int>(watch.address - address + i)))) << (i * 8);
+        watch.lastSeen = now;
+        Event event;
+        if (evaluate(watch, value & watch.mask, now, event))
+            events.append(event);
+    }
+    return events;
+}
+
+bool MemoryWatcher::evaluate(MemoryWatcher::Watch &watch, quint32 value, qint64 now, MemoryWatcher::Event &event)
+{
+    quint32 previous = watch.last;
+    bool    firstValue = !watch.hasValue;
+    watch.last = value;
+    watch.hasValue = true;
+    event.owner = watch.owner;
+    event.name = watch.name;
+    event.value = value;
+    if (watch.condition == CHANGES)
+    {
+        if (firstValue || value == watch.reported)
+        {
+            watch.reported = firstValue ? value : watch.reported;
+            watch.pendingSince = -1;
+            return false;
+        }
+        if (watch.pendingSince < 0 || watch.pendingValue != value)
+        {
+            watch.pendingSince = now;
+            watch.pendingValue = value;
+        }
+        if (now - watch.pendingSince < watch.debounce)
+            return false;
+        event.previous = watch.reported;
+        watch.reported = value;
+        watch.pendingSince = -1;
+        return true;
+    }
+    bool conditionTrue = false;
+    switch (watch.condition)
+    {
+    case EQUALS:
+        conditionTrue = value == watch.value;
+        break;
+    case GREATER:
+        conditionTrue = value > watch.value;
+        break;
+    case BITSET:
+        conditionTrue = (value & watch.value) == watch.value;
+        break;
+    default:
+        break;
+    }
+    if (firstValue || !conditionTrue)
+    {
+        watch.active = conditionTrue;
+        watch.pendingSince = -1;
+        return false;
+    }
+    if (watch.active)
+        return false;
+    if (watch.pendingSince < 0)
+    {
+        watch.pendingSince = now;
+        watch.pendingValue = previous;
+    }
+    if (now - watch.pendingSince < watch.debounce)
+        return false;
+    watch.active = true;
+    watch.pendingSince = -1;
+    event.previous = watch.pendingValue;
+    return true;
+}
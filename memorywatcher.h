@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEMORYWATCHER_H
+#define MEMORYWATCHER_H
+
+#include <QList>
+#include <QMap>
+#include <QPair>
+#include <QString>
+#include "adevice.h"
+
+class QWebSocket;
+
+/*
+ * The memory watches the clients put on the devices.
+ * The server gives it the SNES memory it reads for a device and gets back the events to send.
+ * A watch fires when its condition becomes true (or when the value changes for CHANGES)
+ * and stayed so for its debounce time. The first value read is only a reference.
+ */
+
+class MemoryWatcher
+{
+public:
+    enum Condition {
+        CHANGES,
+        EQUALS,
+        GREATER,
+        BITSET
+    };
+    typedef QPair<unsigned int, unsigned int> Range;
+    struct Event {
+        QWebSocket*     owner;
+        QString         name;
+        quint32         value;
+        quint32         previous;
+    };
+
+    static bool     conditionFromString(const QString& str, Condition& condition);
+    void            addWatch(ADevice* device, QWebSocket* owner, const QString& name, unsigned int address, unsigned int size,
+                             Condition condition, quint32 value, quint32 mask, unsigned int debounce);
+    void            removeWatches(ADevice* device, QWebSocket* owner, const QString& name = QString());
+    void            removeOwner(QWebSocket* owner);
+    void            removeDevice(ADevice* device);
+    bool            hasWatches(ADevice* device) const;
+    QList<Range>    rangesToRead(ADevice* device, qint64 maxAge) const;
+    QList<Event>    update(ADevice* device, unsigned int address, const QByteArray& data);
+
+private:
+    struct Watch {
+        QWebSocket*     owner;
+        QString         name;
+        unsigned int    address;
+        unsigned int    size;
+        Condition       condition;
+        quint32         value;
+        quint32         mask;
+        qint64          debounce;
+        bool            hasValue;
+        quint32         last;
+        // The value last reported for CHANGES
+        quint32         reported;
+        bool            active;
+        // When the condition started to be true or the new value appeared, -1 if not.
+        // pendingValue is the new value or the one before the condition was true
+        qint64          pendingSince;
+        quint32         pendingValue;
+        qint64          lastSeen;
+    };
+
+    QMap<ADevice*, QList<Watch> >   watches;
+
+    static bool     evaluate(Watch& watch, quint32 value, qint64 now, Event& event);
+};
+
+#endif // MEMORYWATCHER_H
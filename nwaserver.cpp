@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <QCoreApplication>
+#include <QSettings>
+#include <QtEndian>
+#include "nwaserver.h"
+#include "wsserver.h"
+#include "devicememoryjob.h"
+#include "deviceinfojob.h"
+
+Q_LOGGING_CATEGORY(log_nwaserver, "NWAServer")
+#define sDebug() qCDebug(log_nwaserver)
+#define sInfo() qCInfo(log_nwaserver)
+
+extern QSettings* globalSettings;
+
+static const QStringList supportedCommands = QStringList() << "EMULATOR_INFO" << "EMULATION_STATUS" << "CORE_MEMORIES"
+                                                           << "CORE_READ" << "bCORE_WRITE" << "MY_NAME_IS" << "ATTACH";
+// Bigger than any memory domain, a client can't make us buffer more than that
+static const quint32 maxBinaryBlockSize = 0x1000000;
+
+NWAServer::NWAServer(WSServer* server, QObject *parent) : QObject(parent)
+{
+    wsServer = server;
+    tcpServer = new QTcpServer(this);
+    connect(tcpServer, &QTcpServer::newConnection, this, &NWAServer::onNewConnection);
+    // Same mapping as the emulators in the NWA device
+    domains.append(MemoryDomain{"WRAM", 0xF50000, 0x20000});
+    domains.append(MemoryDomain{"SRAM", 0xE00000, 0x100000});
+    domains.append(MemoryDomain{"CARTROM", 0, 0xE00000});
+}
+
+quint16 NWAServer::configuredPort()
+{
+    if (globalSettings->contains("NWAServerPort"))
+        return static_cast<quint16>(globalSettings->value("NWAServerPort").toUInt());
+    return defaultPort;
+}
+
+QString NWAServer::start(QHostAddress lAddress, quint16 port)
+{
+    if (!tcpServer->listen(lAddress, port))
+        return tcpServer->errorString();
+    sInfo() << "NWA server started : listenning " << lAddress << "port : " << port;
+    return QString();
+}
+
+void NWAServer::onNewConnection()
+{
+    while (tcpServer->hasPendingConnections())
+    {
+        QTcpSocket* socket = tcpServer->nextPendingConnection();
+        sInfo() << "New NWA client from" << socket->peerAddress() << socket->peerPort();
+        ClientInfos infos;
+        infos.name = QString("NWA client %1").arg(socket->peerPort());
+        infos.waitingBinary = false;
+        infos.job = nullptr;
+        clients[socket] = infos;
+        connect(socket, &QTcpSocket::readyRead, this, &NWAServer::onClientReadyRead);
+        connect(socket, &QTcpSocket::disconnected, this, &NWAServer::onClientDisconnected);
+    }
+}
+
+void NWAServer::onClientDisconnected()
+{
+    QTcpSocket* socket = qobject_cast<QTcpSocket*>(sender());
+    sInfo() << clients.value(socket).name << "disconnected";
+    // A running job stays in the device queue, its signals are tied to the socket
+    clients.remove(socket);
+    socket->deleteLater();
+}
+
+void NWAServer::onClientReadyRead()
+{
+    QTcpSocket* socket = qobject_cast<QTcpSocket*>(sender());
+    clients[socket].buffer.append(socket->readAll());
+    parseBuffer(socket);
+    processCommands(socket);
+}
+
+/*
+ * Commands are a line : NAME arguments\n
+ * A binary command (starting with b) is followed by a block : \0 then the size as 4 bytes big endian then the data
+ */
+
+void NWAServer::parseBuffer(QTcpSocket *socket)
+{
+    ClientInfos& infos = clients[socket];
+    while (!infos.buffer.isEmpty())
+    {
+        if (infos.waitingBinary)
+        {
+            if (infos.buffer.size() < 5)
+                return ;
+            if (infos.buffer.at(0) != 0)
+            {
+                sendError(socket, "protocol_error", "Expected a binary block");
+                socket->disconnectFromHost();
+                return ;
+            }
+            quint32 size = qFromBigEndian<quint32>(reinterpret_cast<const uchar*>(infos.buffer.constData() + 1));
+            // Checked before waiting for the data, the size must also fit in an int
+            if (size > maxBinaryBlockSize)
+            {
+                sendError(socket, "protocol_error", QString("Binary block too big (%1 bytes)").arg(size));
+                socket->disconnectFromHost();
+                return ;
+            }
+            if (static_cast<quint32>(infos.buffer.size()) - 5 < size)
+                return ;
+            infos.binaryCommand.data = infos.buffer.mid(5, static_cast<int>(size));
+            infos.buffer.remove(0, static_cast<int>(size) + 5);
+            infos.waitingBinary = false;
+            infos.commands.append(infos.binaryCommand);
+            continue;
+        }
+        int eol = infos.buffer.indexOf('\n');
+        if (eol == -1)
+            return ;
+        QByteArray line = infos.buffer.left(eol).trimmed();
+        infos.buffer.remove(0, eol + 1);
+        if (line.isEmpty())
+            continue;
+        Command cmd;
+        int space = line.indexOf(' ');
+        cmd.name = space == -1 ? line : line.left(space);
+        cmd.arguments = space == -1 ? QByteArray() : line.mid(space + 1).trimmed();
+        cmd.binary = cmd.name.startsWith('b');
+        sDebug() << infos.name << ">>" << cmd.name << cmd.arguments;
+        if (cmd.binary)
+        {
+            infos.binaryCommand = cmd;
+            infos.waitingBinary = true;
+            continue;
+        }
+        infos.commands.append(cmd);
+    }
+}
+
+// Replies must be in the command order, so a command waiting on the device blocks the next ones
+void NWAServer::processCommands(QTcpSocket *socket)
+{
+    while (clients.contains(socket) && clients.value(socket).job == nullptr && !clients.value(socket).commands.isEmpty())
+    {
+        Command cmd = clients[socket].commands.takeFirst();
+        executeCommand(socket, cmd);
+    }
+}
+
+void NWAServer::executeCommand(QTcpSocket *socket, const NWAServer::Command &cmd)
+{
+    ClientInfos& infos = clients[socket];
+    if (cmd.name == "MY_NAME_IS")
+    {
+        infos.name = QString::fromUtf8(cmd.arguments);
+        sendAsciiReply(socket, {{"name", infos.name}});
+        return ;
+    }
+    if (cmd.name == "EMULATOR_INFO")
+    {
+        sendAsciiReply(socket, {{"name", "QUsb2Snes"},
+                                {"version", qApp->applicationVersion()},
+                                {"id", infos.device.isNull() ? QString() : infos.device->name()},
+                                {"nwa_version", "1.0"},
+                                {"commands", supportedCommands.join(",")}});
+        return ;
+    }
+    if (cmd.name == "ATTACH")
+    {
+        cmdAttach(socket, QString::fromUtf8(cmd.arguments));
+        return ;
+    }
+    if (cmd.name == "CORE_MEMORIES")
+    {
+        QList<QPair<QString, QString> > reply;
+        for (const MemoryDomain& domain : qAsConst(domains))
+        {
+            reply.append({"name", domain.name});
+            reply.append({"access", "rw"});
+            reply.append({"size", QString::number(domain.size)});
+        }
+        sendAsciiReply(socket, reply);
+        return ;
+    }
+    if (cmd.name == "EMULATION_STATUS")
+    {
+        cmdEmulationStatus(socket);
+        return ;
+    }
+    if (cmd.name == "CORE_READ")
+    {
+        cmdCoreRead(socket, cmd);
+        return ;
+    }
+    if (cmd.name == "bCORE_WRITE")
+    {
+        cmdCoreWrite(socket, cmd);
+        return ;
+    }
+    sendError(socket, "invalid_command", "Unsupported command " + QString::fromLatin1(cmd.name));
+}
+
+void NWAServer::cmdAttach(QTcpSocket *socket, const QString &deviceName)
+{
+    if (deviceName.isEmpty())
+    {
+        sendError(socket, "invalid_argument", "ATTACH needs a device name");
+        return ;
+    }
+    ADevice* device = wsServer->openDevice(deviceName);
+    if (device == nullptr)
+    {
+        sendError(socket, "not_allowed", wsServer->errorString());
+        return ;
+    }
+    sInfo() << clients.value(socket).name << "attached to" << device->name();
+    clients[socket].device = device;
+    sendAsciiReply(socket, {{"name", device->name()}});
+}
+
+void NWAServer::runJob(QTcpSocket *socket, DeviceJob *job, USB2SnesWS::opcode opcode, std::function<void ()> onFinished)
+{
+    ClientInfos& infos = clients[socket];
+    infos.job = job;
+    // The server delete the job once done, or if the device goes away before
+    connect(job, &DeviceJob::finished, socket, [=] {
+        if (!clients.contains(socket))
+            return ;
+        clients[socket].job = nullptr;
+        onFinished();
+        processCommands(socket);
+    });
+    connect(job, &DeviceJob::failed, socket, [=] {
+        if (!clients.contains(socket))
+            return ;
+        clients[socket].job = nullptr;
+        sendError(socket, "not_allowed", job->errorString());
+        processCommands(socket);
+    });
+    connect(job, &QObject::destroyed, socket, [=] {
+        if (!clients.contains(socket) || clients.value(socket).job != job)
+            return ;
+        clients[socket].job = nullptr;
+        clients[socket].device = nullptr;
+        sendError(socket, "not_allowed", "Device closed");
+        processCommands(socket);
+    });
+    if (infos.device.isNull() || !wsServer->queueDeviceJob(infos.device, job, opcode))
+    {
+        infos.job = nullptr;
+        infos.device = nullptr;
+        delete job;
+        sendError(socket, "not_allowed", "No device attached");
+    }
+}
+
+void NWAServer::cmdEmulationStatus(QTcpSocket *socket)
+{
+    if (clients.value(socket).device.isNull())
+    {
+        sendAsciiReply(socket, {{"state", "no_game"}, {"game", ""}});
+        return ;
+    }
+    DeviceInfoJob* job = new DeviceInfoJob(wsServer);
+    runJob(socket, job, USB2SnesWS::Info, [=] {
+        const QStringList results = job->results();
+        QString game = results.size() > 2 ? results.at(2) : QString();
+        // The sd2snes menu is not a game
+        if (game.isEmpty() || game.endsWith("menu.bin") || game.endsWith("m3nu.bin"))
+            sendAsciiReply(socket, {{"state", "no_game"}, {"game", ""}});
+        else
+            sendAsciiReply(socket, {{"state", "running"}, {"game", game}});
+    });
+}
+
+/*
+ * DOMAIN;offset;size;offset;size...
+ * offsets and sizes are decimal or hex with a $ prefix
+ */
+
+bool NWAServer::parseMemoryArguments(const QByteArray &args, QList<QPair<unsigned int, unsigned int> > &ranges, bool sizeRequired)
+{
+    QList<QByteArray> parts = args.split(';');
+    if (parts.isEmpty())
+        return false;
+    const MemoryDomain* domain = nullptr;
+    for (const MemoryDomain& d : qAsConst(domains))
+    {
+        if (d.name == parts.first().trimmed())
+            domain = &d;
+    }
+    if (domain == nullptr)
+        return false;
+    parts.removeFirst();
+    if (parts.isEmpty())
+        return !sizeRequired;
+    if (parts.size() % 2 != 0)
+        return false;
+    for (int i = 0; i < parts.size(); i += 2)
+    {
+        bool okOffset, okSize;
+        QByteArray offsetStr = parts.at(i).trimmed();
+        QByteArray sizeStr = parts.at(i + 1).trimmed();
+        unsigned int offset = offsetStr.startsWith('$') ? offsetStr.mid(1).toUInt(&okOffset, 16) : offsetStr.toUInt(&okOffset);
+        unsigned int size = sizeStr.startsWith('$') ? sizeStr.mid(1).toUInt(&okSize, 16) : sizeStr.toUInt(&okSize);
+        if (!okOffset || !okSize || size == 0 || offset >= domain->size || size > domain->size - offset)
+            return false;
+        ranges.append(QPair<unsigned int, unsigned int>(domain->usb2snesAddress + offset, size));
+    }
+    return true;
+}
+
+void NWAServer::cmdCoreRead(QTcpSocket *socket, const NWAServer::Command &cmd)
+{
+    QList<QPair<unsigned int, unsigned int> > ranges;
+    if (!parseMemoryArguments(cmd.arguments, ranges, true))
+    {
+        sendError(socket, "invalid_argument", "Invalid memory arguments " + QString::fromLatin1(cmd.arguments));
+        return ;
+    }
+    DeviceMemoryJob* job = new DeviceMemoryJob(wsServer);
+    job->setRead(ranges);
+    runJob(socket, job, USB2SnesWS::GetAddress, [=] {
+        sendBinaryReply(socket, job->data());
+    });
+}
+
+void NWAServer::cmdCoreWrite(QTcpSocket *socket, const NWAServer::Command &cmd)
+{
+    QList<QPair<unsigned int, unsigned int> > ranges;
+    if (!parseMemoryArguments(cmd.arguments, ranges, false))
+    {
+        sendError(socket, "invalid_argument", "Invalid memory arguments " + QString::fromLatin1(cmd.arguments));
+        return ;
+    }
+    // Only the domain, write from its start
+    if (ranges.isEmpty())
+    {
+        QList<QByteArray> parts = cmd.arguments.split(';');
+        parseMemoryArguments(parts.first() + ";0;" + QByteArray::number(cmd.data.size()), ranges, true);
+    }
+    unsigned int total = 0;
+    for (const auto& range : qAsConst(ranges))
+        total += range.second;
+    if (ranges.isEmpty() || total != static_cast<unsigned int>(cmd.data.size()))
+    {
+        sendError(socket, "invalid_argument", QString("Got %1 bytes of data for %2 bytes of memory").arg(cmd.data.size()).arg(total));
+        return ;
+    }
+    DeviceMemoryJob* job = new DeviceMemoryJob(wsServer);
+    job->setWrite(ranges, cmd.data);
+    runJob(socket, job, USB2SnesWS::PutAddress, [=] {
+        sendAsciiReply(socket, {});
+    });
+}
+
+void NWAServer::sendAsciiReply(QTcpSocket *socket, const QList<QPair<QString, QString> > &reply)
+{
+    QByteArray toSend = "\n";
+    for (const auto& entry : reply)
+        toSend += entry.first.toUtf8() + ":" + entry.second.toUtf8() + "\n";
+    toSend += "\n";
+    socket->write(toSend);
+}
+
+void NWAServer::sendBinaryReply(QTcpSocket *socket, const QByteArray &data)
+{
+    QByteArray header(5, 0);
+    qToBigEndian<quint32>(static_cast<quint32>(data.size()), reinterpret_cast<uchar*>(header.data() + 1));
+    socket->write(header);
+    socket->write(data);
+}
+
+void NWAServer::sendError(QTcpSocket *socket, const QString &type, const QString &reason)
+{
+    sInfo() << clients.value(socket).name << "error" << type << reason;
+    sendAsciiReply(socket, {{"error", type}, {"reason", reason}});
+}
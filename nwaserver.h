@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef NWASERVER_H
+#define NWASERVER_H
+
+#include <QObject>
+#include <QPointer>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QLoggingCategory>
+#include <functional>
+#include "adevice.h"
+#include "devicejob.h"
+
+Q_DECLARE_LOGGING_CATEGORY(log_nwaserver)
+
+class WSServer;
+
+/*
+ * Make the devices reachable with the Emulator Network Access protocol.
+ * A client attach to a device with ATTACH <device name> then use the usual
+ * NWA commands, the memory commands go through the device queue of the WSServer
+ * like any other request.
+ */
+
+class NWAServer : public QObject
+{
+    Q_OBJECT
+public:
+    explicit    NWAServer(WSServer* wsServer, QObject *parent = nullptr);
+    QString     start(QHostAddress lAddress, quint16 port);
+    static quint16  configuredPort();
+
+    static const quint16 defaultPort = 0xBEEF + 9;
+
+private slots:
+    void    onNewConnection();
+    void    onClientReadyRead();
+    void    onClientDisconnected();
+
+private:
+    struct Command {
+        QByteArray  name;
+        QByteArray  arguments;
+        QByteArray  data;
+        bool        binary;
+    };
+
+    struct ClientInfos {
+        QString             name;
+        QPointer<ADevice>   device;
+        QByteArray          buffer;
+        QList<Command>      commands;
+        bool                waitingBinary;
+        Command             binaryCommand;
+        DeviceJob*          job;
+    };
+
+    struct MemoryDomain {
+        QByteArray      name;
+        unsigned int    usb2snesAddress;
+        unsigned int    size;
+    };
+
+    WSServer*                       wsServer;
+    QTcpServer*                     tcpServer;
+    QMap<QTcpSocket*, ClientInfos>  clients;
+    QList<MemoryDomain>             domains;
+
+    void    parseBuffer(QTcpSocket* socket);
+    void    processCommands(QTcpSocket* socket);
+    void    executeCommand(QTcpSocket* socket, const Command& cmd);
+    bool    parseMemoryArguments(const QByteArray& args, QList<QPair<unsigned int, unsigned int> >& ranges, bool sizeRequired);
+    void    runJob(QTcpSocket* socket, DeviceJob* job, USB2SnesWS::opcode opcode, std::function<void()> onFinished);
+    void    cmdAttach(QTcpSocket* socket, const QString& deviceName);
+    void    cmdEmulationStatus(QTcpSocket* socket);
+    void    cmdCoreRead(QTcpSocket* socket, const Command& cmd);
+    void    cmdCoreWrite(QTcpSocket* socket, const Command& cmd);
+    void    sendAsciiReply(QTcpSocket* socket, const QList<QPair<QString, QString> >& reply);
+    void    sendBinaryReply(QTcpSocket* socket, const QByteArray& data);
+    void    sendError(QTcpSocket* socket, const QString& type, const QString& reason);
+};
+
+#endif // NWASERVER_H
@@ -0,0 +1,691 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <QtEndian>
+#include <algorithm>
+#include "patchengine.h"
+
+// Everything has to fit in the 24 bits usb2snes addressing
+static const quint64 maxOutputSize = 0x1000000;
+
+PatchEngine::PatchEngine(unsigned int patchSize)
+{
+    this->patchSize = patchSize;
+    m_state = PARSING;
+    m_format = UNKNOWN;
+    received = 0;
+    consumed = 0;
+    crc = 0xFFFFFFFF;
+    headerDone = false;
+    outputOffset = 0;
+    sourceSize = 0;
+    sourceRelative = 0;
+    targetRelative = 0;
+    targetReadLeft = 0;
+}
+
+/*
+ * Give the next part of the patch, return false if the patch is invalid
+ */
+
+bool PatchEngine::feed(const QByteArray &data)
+{
+    if (m_state == FAILED)
+        return false;
+    if (received + static_cast<unsigned int>(data.size()) > patchSize)
+    {
+        fail("Received more data than the patch size");
+        return false;
+    }
+    // UPS and BPS end with the CRC32 of everything before it
+    unsigned int crcEnd = patchSize >= 4 ? patchSize - 4 : 0;
+    if (received < crcEnd)
+        crc = crc32(crc, data.constData(), static_cast<int>(qMin(static_cast<unsigned int>(data.size()), crcEnd - received)));
+    received += data.size();
+    // IPS can have garbage after its end mark
+    if (m_state == PARSING)
+    {
+        buffer.append(data);
+        parse();
+    }
+    if (m_state == PARSING && received == patchSize)
+        fail("The patch is truncated");
+    return m_state != FAILED;
+}
+
+bool PatchEngine::isComplete() const
+{
+    return m_state == COMPLETE && received == patchSize;
+}
+
+bool PatchEngine::hasError() const
+{
+    return m_state == FAILED;
+}
+
+QString PatchEngine::errorString() const
+{
+    return m_errorString;
+}
+
+PatchEngine::Format PatchEngine::format() const
+{
+    return m_format;
+}
+
+void PatchEngine::fail(const QString &error)
+{
+    m_state = FAILED;
+    m_errorString = error;
+    buffer.clear();
+}
+
+/*
+ * Each parse function read one item (header, record, footer) and return
+ * the position after it or -1 if the item is not complete yet.
+ * Nothing is changed until the item is complete so it can be read again with more data.
+ */
+
+void PatchEngine::parse()
+{
+    int pos = 0;
+    if (m_format == UNKNOWN)
+    {
+        if (buffer.size() < 5)
+            return ;
+        if (buffer.startsWith("PATCH"))
+        {
+            m_format = IPS;
+            pos = 5;
+        } else if (buffer.startsWith("UPS1") || buffer.startsWith("BPS1")) {
+            m_format = buffer.startsWith("UPS1") ? UPS : BPS;
+            pos = 4;
+            if (patchSize < 4 + 12)
+            {
+                fail("The patch is too small");
+                return ;
+            }
+        } else {
+            fail("Unknown patch format, only IPS, UPS and BPS are supported");
+            return ;
+        }
+    }
+    while (m_state == PARSING)
+    {
+        int next = -1;
+        switch (m_format)
+        {
+        case IPS:
+            next = parseIPS(pos);
+            break;
+        case UPS:
+            next = parseUPS(pos);
+            break;
+        case BPS:
+            next = parseBPS(pos);
+            break;
+        default:
+            break;
+        }
+        if (next < 0)
+            break;
+        pos = next;
+    }
+    if (m_state == FAILED)
+        return ;
+    buffer.remove(0, pos);
+    consumed += pos;
+    if (m_state == COMPLETE)
+        buffer.clear();
+}
+
+/*
+ * IPS : 'PATCH' then records of a 3 bytes offset, a 2 bytes size and the data.
+ * A size of 0 is a RLE record : a 2 bytes count then the byte to repeat.
+ * Ends with 'EOF'
+ */
+
+int PatchEngine::parseIPS(int pos)
+{
+    int left = buffer.size() - pos;
+    const uchar* p = reinterpret_cast<const uchar*>(buffer.constData()) + pos;
+    if (left < 3)
+        return -1;
+    unsigned int offset = (p[0] << 16) | (p[1] << 8) | p[2];
+    if (offset == 0x454F46)
+    {
+        m_state = COMPLETE;
+        return pos + 3;
+    }
+    if (left < 5)
+        return -1;
+    unsigned int size = (p[3] << 8) | p[4];
+    if (size == 0)
+    {
+        if (left < 8)
+            return -1;
+        unsigned int count = (p[5] << 8) | p[6];
+        if (count != 0 && checkRange(offset, count))
+            overlay(offset, dataSegment(QByteArray(static_cast<int>(count), static_cast<char>(p[7]))));
+        return pos + 8;
+    }
+    if (left < static_cast<int>(5 + size))
+        return -1;
+    if (checkRange(offset, size))
+        overlay(offset, dataSegment(buffer.mid(pos + 5, static_cast<int>(size))));
+    return pos + 5 + static_cast<int>(size);
+}
+
+/*
+ * UPS : 'UPS1', the source and target size then records of a relative offset
+ * and bytes to xor with the source ending with a 0, until the 12 bytes footer.
+ */
+
+int PatchEngine::parseUPS(int pos)
+{
+    if (!headerDone)
+    {
+        quint64 upsSourceSize;
+        quint64 targetSize;
+        if (!readNumber(pos, upsSourceSize) || !readNumber(pos, targetSize))
+            return -1;
+        sourceSize = static_cast<unsigned int>(qMin(upsSourceSize, maxOutputSize));
+        headerDone = true;
+        return pos;
+    }
+    if (consumed + pos >= patchSize - 12)
+        return parseFooter(pos);
+    quint64 skip;
+    if (!readNumber(pos, skip))
+        return -1;
+    int end = buffer.indexOf('\0', pos);
+    if (end < 0)
+        return -1;
+    if (consumed + end >= patchSize - 12)
+    {
+        fail("Invalid UPS record");
+        return -1;
+    }
+    unsigned int size = static_cast<unsigned int>(end - pos);
+    // The ending 0 counts as an unchanged byte
+    if (!checkRange(outputOffset + skip, size + 1))
+        return -1;
+    outputOffset += static_cast<unsigned int>(skip);
+    // The source is 0 after its end, so the xor is the data
+    unsigned int xorSize = outputOffset < sourceSize ? qMin(size, sourceSize - outputOffset) : 0;
+    if (xorSize != 0)
+    {
+        Segment seg;
+        seg.kind = Segment::XOR;
+        seg.size = xorSize;
+        seg.source = 0;
+        seg.data = buffer.mid(pos, static_cast<int>(xorSize));
+        overlay(outputOffset, seg);
+    }
+    if (size > xorSize)
+        overlay(outputOffset + xorSize, dataSegment(buffer.mid(pos + static_cast<int>(xorSize), static_cast<int>(size - xorSize))));
+    outputOffset += size + 1;
+    return end + 1;
+}
+
+/*
+ * BPS : 'BPS1', the source, target and metadata size, the metadata
+ * then actions until the 12 bytes footer.
+ * An action is a number with the command in the 2 low bits and the length - 1 in the others.
+ * SourceRead and TargetRead take the bytes at the output position in the source or the patch,
+ * SourceCopy and TargetCopy are followed by a signed relative offset in the source or the output.
+ * TargetRead data are taken as they arrive since they can be the whole rom.
+ */
+
+int PatchEngine::parseBPS(int pos)
+{
+    if (!headerDone)
+    {
+        quint64 sourceSize;
+        quint64 targetSize;
+        quint64 metadataSize;
+        if (!readNumber(pos, sourceSize) || !readNumber(pos, targetSize) || !readNumber(pos, metadataSize))
+            return -1;
+        if (metadataSize > patchSize)
+        {
+            fail("Invalid BPS metadata size");
+            return -1;
+        }
+        if (static_cast<quint64>(buffer.size() - pos) < metadataSize)
+            return -1;
+        headerDone = true;
+        return pos + static_cast<int>(metadataSize);
+    }
+    if (targetReadLeft != 0)
+    {
+        unsigned int beforeFooter = patchSize - 12 - (consumed + pos);
+        if (beforeFooter == 0)
+        {
+            fail("Invalid BPS action");
+            return -1;
+        }
+        unsigned int size = qMin(qMin(targetReadLeft, beforeFooter), static_cast<unsigned int>(buffer.size() - pos));
+        if (size == 0)
+            return -1;
+        overlay(outputOffset, dataSegment(buffer.mid(pos, static_cast<int>(size))));
+        outputOffset += size;
+        targetReadLeft -= size;
+        return pos + static_cast<int>(size);
+    }
+    if (consumed + pos >= patchSize - 12)
+        return parseFooter(pos);
+    quint64 action;
+    quint64 relative = 0;
+    if (!readNumber(pos, action))
+        return -1;
+    unsigned int command = action & 3;
+    quint64 length = (action >> 2) + 1;
+    if (command >= 2 && !readNumber(pos, relative))
+        return -1;
+    if (consumed + pos > patchSize - 12)
+    {
+        fail("Invalid BPS action");
+        return -1;
+    }
+    if (!checkRange(outputOffset, length))
+        return -1;
+    qint64 delta = static_cast<qint64>(relative >> 1) * ((relative & 1) ? -1 : 1);
+    switch (command)
+    {
+    // The rom is patched in place, nothing to do
+    case 0:
+        outputOffset += static_cast<unsigned int>(length);
+        break;
+    case 1:
+        targetReadLeft = static_cast<unsigned int>(length);
+        break;
+    case 2:
+    {
+        qint64 from = static_cast<qint64>(sourceRelative) + delta;
+        if (from < 0 || !checkRange(static_cast<quint64>(from), length))
+        {
+            fail("Invalid BPS source copy");
+            return -1;
+        }
+        copySource(outputOffset, static_cast<unsigned int>(from), static_cast<unsigned int>(length));
+        sourceRelative = static_cast<unsigned int>(from + length);
+        outputOffset += static_cast<unsigned int>(length);
+        break;
+    }
+    case 3:
+    {
+        qint64 from = static_cast<qint64>(targetRelative) + delta;
+        if (from < 0 || from >= static_cast<qint64>(outputOffset))
+        {
+            fail("Invalid BPS target copy");
+            return -1;
+        }
+        copyTarget(outputOffset, static_cast<unsigned int>(from), static_cast<unsigned int>(length));
+        targetRelative = static_cast<unsigned int>(from + length);
+        outputOffset += static_cast<unsigned int>(length);
+        break;
+    }
+    }
+    return pos;
+}
+
+/*
+ * UPS and BPS footer : source CRC32, target CRC32 and patch CRC32.
+ * Only the patch one can be checked, we never have the whole roms.
+ */
+
+int PatchEngine::parseFooter(int pos)
+{
+    if (consumed + pos != patchSize - 12)
+    {
+        fail("The patch data overlap its footer");
+        return -1;
+    }
+    if (buffer.size() - pos < 12)
+        return -1;
+    quint32 patchCrc = qFromLittleEndian<quint32>(reinterpret_cast<const uchar*>(buffer.constData()) + pos + 8);
+    if (patchCrc != (crc ^ 0xFFFFFFFF))
+    {
+        fail("The patch checksum does not match, the patch is corrupted");
+        return -1;
+    }
+    m_state = COMPLETE;
+    return pos + 12;
+}
+
+// The UPS/BPS variable length number encoding
+bool PatchEngine::readNumber(int &pos, quint64 &number)
+{
+    quint64 data = 0;
+    quint64 shift = 1;
+    int p = pos;
+    while (true)
+    {
+        if (p >= buffer.size())
+            return false;
+        quint8 x = static_cast<quint8>(buffer.at(p++));
+        data += (x & 0x7F) * shift;
+        if (x & 0x80)
+            break;
+        shift <<= 7;
+        data += shift;
+        if (shift > maxOutputSize * 128)
+        {
+            fail("Invalid number in the patch");
+            return false;
+        }
+    }
+    pos = p;
+    number = data;
+    return true;
+}
+
+bool PatchEngine::checkRange(quint64 start, quint64 size)
+{
+    if (start + size > maxOutputSize)
+    {
+        fail("The patch writes past the usb2snes address space");
+        return false;
+    }
+    return true;
+}
+
+PatchEngine::Segment PatchEngine::dataSegment(const QByteArray &data)
+{
+    Segment seg;
+    seg.kind = Segment::DATA;
+    seg.size = static_cast<unsigned int>(data.size());
+    seg.source = 0;
+    seg.data = data;
+    return seg;
+}
+
+PatchEngine::Segment PatchEngine::subSegment(const PatchEngine::Segment &seg, unsigned int skip, unsigned int size)
+{
+    Segment sub = seg;
+    sub.size = size;
+    if (seg.kind == Segment::SOURCE)
+        sub.source += skip;
+    else
+        sub.data = seg.data.mid(static_cast<int>(skip), static_cast<int>(size));
+    return sub;
+}
+
+/*
+ * Put a segment over what is already there, like applying the records one after the other.
+ * It's merged with the previous one when they follow each other.
+ */
+
+void PatchEngine::overlay(unsigned int start, const PatchEngine::Segment &seg)
+{
+    unsigned int end = start + seg.size;
+    auto it = segments.lowerBound(start);
+    if (it != segments.begin())
+    {
+        auto prev = it;
+        --prev;
+        unsigned int prevStart = prev.key();
+        unsigned int prevEnd = prevStart + prev.value().size;
+        if (prevEnd > start)
+        {
+            Segment old = prev.value();
+            prev.value() = subSegment(old, 0, start - prevStart);
+            if (prevEnd > end)
+                segments.insert(end, subSegment(old, end - prevStart, prevEnd - end));
+            it = segments.lowerBound(start);
+        }
+    }
+    while (it != segments.end() && it.key() < end)
+    {
+        unsigned int oldEnd = it.key() + it.value().size;
+        if (oldEnd > end)
+        {
+            Segment rest = subSegment(it.value(), end - it.key(), oldEnd - end);
+            segments.erase(it);
+            segments.insert(end, rest);
+            break;
+        }
+        it = segments.erase(it);
+    }
+    it = segments.lowerBound(start);
+    if (it != segments.begin())
+    {
+        auto prev = it;
+        --prev;
+        Segment& prevSeg = prev.value();
+        if (prev.key() + prevSeg.size == start && prevSeg.kind == seg.kind)
+        {
+            if (seg.kind == Segment::DATA)
+            {
+                prevSeg.data.append(seg.data);
+                prevSeg.size += seg.size;
+                return ;
+            }
+            if (seg.kind == Segment::SOURCE && prevSeg.source + prevSeg.size == seg.source)
+            {
+                prevSeg.size += seg.size;
+                return ;
+            }
+        }
+    }
+    segments.insert(start, seg);
+}
+
+void PatchEngine::copySource(unsigned int start, unsigned int source, unsigned int size)
+{
+    // Already there
+    if (source == start)
+        return ;
+    Segment seg;
+    seg.kind = Segment::SOURCE;
+    seg.size = size;
+    seg.source = source;
+    overlay(start, seg);
+}
+
+/*
+ * Copy a part of the output already done, the copy can overlap itself
+ * to repeat a pattern so it's done by chunk of the distance between the two.
+ */
+
+void PatchEngine::copyTarget(unsigned int start, unsigned int target, unsigned int size)
+{
+    unsigned int period = start - target;
+    while (size != 0)
+    {
+        unsigned int chunk = qMin(size, period);
+        QList<Segment> pieces = targetPieces(target, chunk);
+        if (size > chunk && pieces.size() == 1 && pieces.first().kind == Segment::DATA)
+        {
+            QByteArray run;
+            run.reserve(static_cast<int>(size));
+            while (static_cast<unsigned int>(run.size()) < size)
+                run.append(pieces.first().data);
+            run.truncate(static_cast<int>(size));
+            overlay(start, dataSegment(run));
+            return ;
+        }
+        unsigned int pieceStart = start;
+        for (const Segment& piece : qAsConst(pieces))
+        {
+            if (piece.kind == Segment::SOURCE)
+                copySource(pieceStart, piece.source, piece.size);
+            else
+                overlay(pieceStart, piece);
+            pieceStart += piece.size;
+        }
+        start += chunk;
+        target += chunk;
+        size -= chunk;
+    }
+}
+
+// What is in the output at this place, the holes are the untouched source
+QList<PatchEngine::Segment> PatchEngine::targetPieces(unsigned int start, unsigned int size) const
+{
+    QList<Segment> toret;
+    unsigned int end = start + size;
+    unsigned int cur = start;
+    Segment hole;
+    hole.kind = Segment::SOURCE;
+    auto it = segments.upperBound(start);
+    if (it != segments.constBegin())
+    {
+        auto prev = it;
+        --prev;
+        if (prev.key() + prev.value().size > start)
+            it = prev;
+    }
+    while (cur < end)
+    {
+        unsigned int next = (it == segments.constEnd() || it.key() >= end) ? end : it.key();
+        if (next > cur)
+        {
+            hole.size = next - cur;
+            hole.source = cur;
+            toret.append(hole);
+            cur = next;
+            continue;
+        }
+        unsigned int segEnd = qMin(end, it.key() + it.value().size);
+        toret.append(subSegment(it.value(), cur - it.key(), segEnd - cur));
+        cur = segEnd;
+        ++it;
+    }
+    return toret;
+}
+
+/*
+ * The parts of the original rom needed to make the writes, merged and sorted
+ */
+
+QList<PatchEngine::Range> PatchEngine::sourceRanges() const
+{
+    QList<Range> ranges;
+    QMapIterator<unsigned int, Segment> it(segments);
+    while (it.hasNext())
+    {
+        it.next();
+        const Segment& seg = it.value();
+        if (seg.kind == Segment::DATA)
+            continue;
+        ranges.append(Range(seg.kind == Segment::SOURCE ? seg.source : it.key(), seg.size));
+    }
+    std::sort(ranges.begin(), ranges.end());
+    QList<Range> merged;
+    for (const Range& range : qAsConst(ranges))
+    {
+        if (!merged.isEmpty() && range.first <= merged.last().first + merged.last().second)
+        {
+            Range& last = merged.last();
+            last.second = qMax(last.first + last.second, range.first + range.second) - last.first;
+        } else {
+            merged.append(range);
+        }
+    }
+    return merged;
+}
+
+/*
+ * The content of sourceRanges(), one after the other
+ */
+
+bool PatchEngine::setSourceData(const QByteArray &data)
+{
+    sourceData.clear();
+    int pos = 0;
+    for (const Range& range : sourceRanges())
+    {
+        if (pos + static_cast<int>(range.second) > data.size())
+            return false;
+        sourceData[range.first] = data.mid(pos, static_cast<int>(range.second));
+        pos += static_cast<int>(range.second);
+    }
+    return pos == data.size();
+}
+
+QByteArray PatchEngine::sourceBytes(unsigned int offset, unsigned int size) const
+{
+    auto it = sourceData.upperBound(offset);
+    if (it == sourceData.constBegin())
+        return QByteArray(static_cast<int>(size), 0);
+    --it;
+    return it.value().mid(static_cast<int>(offset - it.key()), static_cast<int>(size));
+}
+
+/*
+ * The final writes, sorted and with the contiguous segments merged
+ */
+
+QList<PatchEngine::Write> PatchEngine::writes() const
+{
+    QList<Write> toret;
+    QMapIterator<unsigned int, Segment> it(segments);
+    while (it.hasNext())
+    {
+        it.next();
+        const Segment& seg = it.value();
+        QByteArray bytes;
+        switch (seg.kind)
+        {
+        case Segment::DATA:
+            bytes = seg.data;
+            break;
+        case Segment::SOURCE:
+            bytes = sourceBytes(seg.source, seg.size);
+            break;
+        case Segment::XOR:
+            bytes = sourceBytes(it.key(), seg.size);
+            for (int i = 0; i < bytes.size(); i++)
+                bytes[i] = static_cast<char>(bytes.at(i) ^ seg.data.at(i));
+            break;
+        }
+        if (!toret.isEmpty() && toret.last().offset + static_cast<unsigned int>(toret.last().data.size()) == it.key())
+        {
+            toret.last().data.append(bytes);
+        } else {
+            Write w;
+            w.offset = it.key();
+            w.data = bytes;
+            toret.append(w);
+        }
+    }
+    return toret;
+}
+
+quint32 PatchEngine::crc32(quint32 crc, const char *data, int size)
+{
+    static quint32 table[256];
+    static bool tableDone = false;
+    if (!tableDone)
+    {
+        for (quint32 i = 0; i < 256; i++)
+        {
+            quint32 c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+        tableDone = true;
+    }
+    for (int i = 0; i < size; i++)
+        crc = table[(crc ^ static_cast<quint8>(data[i])) & 0xFF] ^ (crc >> 8);
+    return crc;
+}
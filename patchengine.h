@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PATCHENGINE_H
+#define PATCHENGINE_H
+
+#include <QByteArray>
+#include <QList>
+#include <QMap>
+#include <QPair>
+#include <QString>
+
+/*
+ * Parse an IPS, UPS or BPS patch as its data arrive and turn it into a list
+ * of coalesced writes: adjacent and overlapping records end up in one write.
+ * UPS and BPS describe the patched ROM from the original one, this is applied
+ * in place so the bytes of the original ROM they need are listed
+ * by sourceRanges() and must be given back with setSourceData() before writes().
+ */
+
+class PatchEngine
+{
+public:
+    enum Format {
+        UNKNOWN,
+        IPS,
+        UPS,
+        BPS
+    };
+    typedef QPair<unsigned int, unsigned int> Range;
+    struct Write {
+        unsigned int    offset;
+        QByteArray      data;
+    };
+
+    explicit PatchEngine(unsigned int patchSize);
+    bool            feed(const QByteArray& data);
+    bool            isComplete() const;
+    bool            hasError() const;
+    QString         errorString() const;
+    Format          format() const;
+    QList<Range>    sourceRanges() const;
+    bool            setSourceData(const QByteArray& data);
+    QList<Write>    writes() const;
+
+private:
+    enum State {
+        PARSING,
+        COMPLETE,
+        FAILED
+    };
+    // A part of the patched rom, what is not covered by one is left untouched
+    struct Segment {
+        enum Kind {
+            DATA,   // the bytes in data
+            SOURCE, // a copy of the original rom starting at source
+            XOR     // the original rom xored with data
+        };
+        Kind            kind;
+        unsigned int    size;
+        unsigned int    source;
+        QByteArray      data;
+    };
+
+    State           m_state;
+    Format          m_format;
+    QString         m_errorString;
+    unsigned int    patchSize;
+    unsigned int    received;
+    // Absolute position in the patch of the first byte of buffer
+    unsigned int    consumed;
+    QByteArray      buffer;
+    quint32         crc;
+    bool            headerDone;
+    unsigned int    outputOffset;
+    unsigned int    sourceSize;
+    unsigned int    sourceRelative;
+    unsigned int    targetRelative;
+    unsigned int    targetReadLeft;
+    QMap<unsigned int, Segment>     segments;
+    QMap<unsigned int, QByteArray>  sourceData;
+
+    void            fail(const QString& error);
+    void            parse();
+    int             parseIPS(int pos);
+    int             parseUPS(int pos);
+    int             parseBPS(int pos);
+    int             parseFooter(int pos);
+    bool            readNumber(int& pos, quint64& number);
+    bool            checkRange(quint64 start, quint64 size);
+    void            overlay(unsigned int start, const Segment& seg);
+    void            copySource(unsigned int start, unsigned int source, unsigned int size);
+    void            copyTarget(unsigned int start, unsigned int target, unsigned int size);
+    QList<Segment>  targetPieces(unsigned int start, unsigned int size) const;
+    QByteArray      sourceBytes(unsigned int offset, unsigned int size) const;
+    static Segment  dataSegment(const QByteArray& data);
+    static Segment  subSegment(const Segment& seg, unsigned int skip, unsigned int size);
+    static quint32  crc32(quint32 crc, const char* data, int size);
+};
+
+#endif // PATCHENGINE_H
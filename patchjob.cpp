@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <QLoggingCategory>
+#include "patchjob.h"
+
+Q_LOGGING_CATEGORY(log_patchjob, "PatchJob")
+#define sDebug() qCDebug(log_patchjob)
+
+// The sd2snes variadic commands take at most 8 ranges of 255 bytes
+static const int maxVariadicRanges = 8;
+static const unsigned int maxVariadicSize = 255;
+
+PatchJob::PatchJob(unsigned int patchSize, bool hook, QObject *parent) : DeviceJob(parent), engine(patchSize)
+{
+    this->hook = hook;
+    reading = false;
+    commandIndex = 0;
+    timeoutTimer.setSingleShot(true);
+    timeoutTimer.setInterval(5000);
+    connect(&timeoutTimer, &QTimer::timeout, this, &PatchJob::onTimeout);
+    receiveTimer.setSingleShot(true);
+    receiveTimer.setInterval(10000);
+    connect(&receiveTimer, &QTimer::timeout, this, &PatchJob::onReceiveTimeout);
+}
+
+bool PatchJob::feed(const QByteArray &data)
+{
+    bool wasReceived = patchReceived();
+    bool ok = engine.feed(data);
+    if (m_device == nullptr)
+        return ok;
+    if (patchReceived())
+        receiveTimer.stop();
+    else
+        receiveTimer.start();
+    if (!wasReceived && patchReceived())
+        QTimer::singleShot(0, this, &PatchJob::onPatchReceived);
+    return ok;
+}
+
+bool PatchJob::patchReceived() const
+{
+    return engine.isComplete() || engine.hasError();
+}
+
+void PatchJob::start(ADevice *device)
+{
+    m_device = device;
+    connect(device, &ADevice::getDataReceived, this, &PatchJob::onDeviceGetDataReceived);
+    connect(device, &ADevice::commandFinished, this, &PatchJob::onDeviceCommandFinished);
+    connect(device, &ADevice::protocolError, this, &PatchJob::onDeviceProtocolError);
+    // finished/failed must not be emitted while the server is still starting the job
+    if (patchReceived())
+        QTimer::singleShot(0, this, &PatchJob::onPatchReceived);
+    else
+        receiveTimer.start();
+}
+
+void PatchJob::abort()
+{
+    timeoutTimer.stop();
+    receiveTimer.stop();
+    DeviceJob::abort();
+}
+
+void PatchJob::onPatchReceived()
+{
+    if (m_device == nullptr)
+        return ;
+    if (engine.hasError())
+    {
+        fail("Patch: " + engine.errorString());
+        return ;
+    }
+    QList<Range> sourceRanges = engine.sourceRanges();
+    sDebug() << "Patch received, reading" << sourceRanges.size() << "ranges of the original rom";
+    if (sourceRanges.isEmpty())
+    {
+        startWrites();
+        return ;
+    }
+    reading = true;
+    readData.clear();
+    setCommands(sourceRanges, QList<QByteArray>());
+    startOperation();
+}
+
+/*
+ * The order of the writes does not matter, except for the hook flags,
+ * so the small ones are grouped first and the ones needing a command each follow.
+ */
+
+void PatchJob::setCommands(const QList<Range> &ranges, const QList<QByteArray> &datas)
+{
+    bool variadic = m_device->hasVariaditeCommands();
+    QList<Command> packed;
+    QList<Command> singles;
+    Command first;
+    Command last;
+    first.flags = 0;
+    last.flags = 0;
+    for (int i = 0; i < ranges.size(); i++)
+    {
+        Command single;
+        single.ranges.append(ranges.at(i));
+        single.flags = 0;
+        if (!datas.isEmpty())
+            single.data = datas.at(i);
+        if (hook && !reading && (i == 0 || i == ranges.size() - 1))
+        {
+            if (i == 0)
+                single.flags |= SD2Snes::server_flags::CLRX;
+            if (i == ranges.size() - 1)
+                single.flags |= SD2Snes::server_flags::SETX;
+            if (i == 0)
+                first = single;
+            else
+                last = single;
+            continue;
+        }
+        if (!variadic || ranges.at(i).second > maxVariadicSize)
+        {
+            singles.append(single);
+            continue;
+        }
+        if (packed.isEmpty() || packed.last().ranges.size() == maxVariadicRanges)
+        {
+            Command pack;
+            pack.flags = 0;
+            packed.append(pack);
+        }
+        packed.last().ranges.append(ranges.at(i));
+        packed.last().data.append(single.data);
+    }
+    commands.clear();
+    if (!first.ranges.isEmpty())
+        commands.append(first);
+    commands.append(packed);
+    commands.append(singles);
+    if (!last.ranges.isEmpty())
+        commands.append(last);
+    commandIndex = 0;
+}
+
+void PatchJob::startWrites()
+{
+    reading = false;
+    QList<PatchEngine::Write> writes = engine.writes();
+    QList<Range> ranges;
+    QList<QByteArray> datas;
+    unsigned int total = 0;
+    for (const PatchEngine::Write& write : qAsConst(writes))
+    {
+        ranges.append(Range(write.offset, static_cast<unsigned int>(write.data.size())));
+        datas.append(write.data);
+        total += static_cast<unsigned int>(write.data.size());
+    }
+    setCommands(ranges, datas);
+    sDebug() << "Writing" << total << "bytes in" << writes.size() << "writes with" << commands.size() << "commands";
+    startOperation();
+}
+
+void PatchJob::startOperation()
+{
+    if (m_device == nullptr)
+        return ;
+    if (commandIndex >= commands.size())
+    {
+        if (!reading)
+        {
+            finish();
+            return ;
+        }
+        // Put the original bytes back in the order of the ranges
+        QMap<unsigned int, QByteArray> sourceBytes;
+        int pos = 0;
+        for (const Command& command : qAsConst(commands))
+        {
+            for (const Range& range : command.ranges)
+            {
+                sourceBytes[range.first] = readData.mid(pos, static_cast<int>(range.second));
+                pos += static_cast<int>(range.second);
+            }
+        }
+        QByteArray source;
+        for (const QByteArray& bytes : qAsConst(sourceBytes))
+            source.append(bytes);
+        if (pos != readData.size() || !engine.setSourceData(source))
+        {
+            fail(QString("Patch: got %1 bytes of the original rom instead of %2").arg(readData.size()).arg(pos));
+            return ;
+        }
+        startWrites();
+        return ;
+    }
+    const Command& command = commands.at(commandIndex);
+    commandIndex++;
+    unsigned int size = 0;
+    QList<QPair<unsigned int, quint8> > args;
+    for (const Range& range : command.ranges)
+    {
+        args.append(QPair<unsigned int, quint8>(range.first, static_cast<quint8>(range.second)));
+        size += range.second;
+    }
+    // Big transfers can take a while on the sd2snes
+    timeoutTimer.start(5000 + static_cast<int>(size / 64));
+    if (reading)
+    {
+        if (command.ranges.size() > 1)
+            m_device->getAddrCommand(SD2Snes::space::SNES, args);
+        else
+            m_device->getAddrCommand(SD2Snes::space::SNES, command.ranges.first().first, size);
+        return ;
+    }
+    if (command.ranges.size() > 1)
+        m_device->putAddrCommand(SD2Snes::space::SNES, args);
+    else if (command.flags != 0)
+        m_device->putAddrCommand(SD2Snes::space::SNES, command.flags, command.ranges.first().first, size);
+    else
+        m_device->putAddrCommand(SD2Snes::space::SNES, command.ranges.first().first, size);
+    m_device->writeData(command.data);
+}
+
+void PatchJob::onDeviceGetDataReceived(QByteArray data)
+{
+    if (reading)
+        readData.append(data);
+}
+
+void PatchJob::onDeviceCommandFinished()
+{
+    timeoutTimer.stop();
+    // The device can finish a command while we are still starting it
+    QTimer::singleShot(0, this, &PatchJob::startOperation);
+}
+
+void PatchJob::onDeviceProtocolError()
+{
+    timeoutTimer.stop();
+    fail("Patch: device error");
+}
+
+void PatchJob::onTimeout()
+{
+    fail("Patch: the device did not answer in time");
+}
+
+void PatchJob::onReceiveTimeout()
+{
+    fail("Patch: the patch data did not arrive in time");
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PATCHJOB_H
+#define PATCHJOB_H
+
+#include <QTimer>
+#include "devicejob.h"
+#include "patchengine.h"
+
+/*
+ * Apply a patch sent with PutIPS to the SNES memory of a device.
+ * The patch data are given with feed() as they arrive, once it's complete
+ * the job reads the original bytes UPS and BPS need then sends the coalesced writes.
+ * Small writes are packed in the variadic commands if the device has them.
+ * A hook patch clears the sd2snes hook flag with its first write and sets it with the last one.
+ */
+
+class PatchJob : public DeviceJob
+{
+    Q_OBJECT
+public:
+    explicit PatchJob(unsigned int patchSize, bool hook, QObject *parent = nullptr);
+    bool    feed(const QByteArray& data);
+    bool    patchReceived() const;
+    void    start(ADevice* device);
+    void    abort();
+
+private slots:
+    void    onDeviceGetDataReceived(QByteArray data);
+    void    onDeviceCommandFinished();
+    void    onDeviceProtocolError();
+    void    onTimeout();
+    void    onReceiveTimeout();
+    void    onPatchReceived();
+    void    startOperation();
+
+private:
+    typedef PatchEngine::Range Range;
+    struct Command {
+        QList<Range>    ranges;
+        unsigned char   flags;
+        QByteArray      data;
+    };
+
+    PatchEngine     engine;
+    bool            hook;
+    bool            reading;
+    QList<Command>  commands;
+    int             commandIndex;
+    QByteArray      readData;
+    QTimer          timeoutTimer;
+    // The client has this long between two pieces of the patch, the job owns the device meanwhile
+    QTimer          receiveTimer;
+
+    void    setCommands(const QList<Range>& ranges, const QList<QByteArray>& datas);
+    void    startWrites();
+};
+
+#endif // PATCHJOB_H
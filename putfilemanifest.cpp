@@ -0,0 +1,234 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QLoggingCategory>
+#include <QSaveFile>
+#include <QSettings>
+#include "putfilemanifest.h"
+
+Q_LOGGING_CATEGORY(log_putfilemanifest, "PutFileManifest")
+#define sDebug() qCDebug(log_putfilemanifest)
+#define sInfo() qCInfo(log_putfilemanifest)
+
+extern QSettings*          globalSettings;
+
+PutFileManifest::PutFileManifest()
+{
+    loaded = false;
+}
+
+PutFileManifest::~PutFileManifest()
+{
+    for (Upload& up : uploads)
+        delete up.hash;
+}
+
+QString PutFileManifest::filePath()
+{
+    return QFileInfo(globalSettings->fileName()).absolutePath() + "/putfile-manifest.json";
+}
+
+QString PutFileManifest::normalizePath(const QString& path)
+{
+    QString toret = QDir::cleanPath(path);
+    if (!toret.startsWith("/"))
+        toret.prepend("/");
+    return toret;
+}
+
+void PutFileManifest::load()
+{
+    if (loaded)
+        return ;
+    loaded = true;
+    QFile file(filePath());
+    if (!file.open(QIODevice::ReadOnly))
+        return ;
+    QJsonObject root = QJsonDocument::fromJson(file.readAll()).object();
+    for (auto devIt = root.constBegin(); devIt != root.constEnd(); ++devIt)
+    {
+        QJsonObject files = devIt.value().toObject();
+        for (auto it = files.constBegin(); it != files.constEnd(); ++it)
+        {
+            QJsonObject jEntry = it.value().toObject();
+            Entry entry;
+            entry.size = static_cast<quint64>(jEntry["size"].toDouble());
+            entry.uploadTime = QDateTime::fromString(jEntry["uploaded"].toString(), Qt::ISODate);
+            entry.sha256 = QByteArray::fromHex(jEntry["sha256"].toString().toLatin1());
+            entries[devIt.key()][it.key()] = entry;
+        }
+    }
+    sDebug() << "Loaded manifest from" << filePath();
+}
+
+void PutFileManifest::save()
+{
+    QJsonObject root;
+    for (auto devIt = entries.constBegin(); devIt != entries.constEnd(); ++devIt)
+    {
+        QJsonObject files;
+        for (auto it = devIt.value().constBegin(); it != devIt.value().constEnd(); ++it)
+        {
+            QJsonObject jEntry;
+            jEntry["size"] = static_cast<double>(it.value().size);
+            jEntry["uploaded"] = it.value().uploadTime.toString(Qt::ISODate);
+            jEntry["sha256"] = QString::fromLatin1(it.value().sha256.toHex());
+            files[it.key()] = jEntry;
+        }
+        if (!files.isEmpty())
+            root[devIt.key()] = files;
+    }
+    QSaveFile file(filePath());
+    if (!file.open(QIODevice::WriteOnly))
+    {
+        sInfo() << "Can't write the manifest" << filePath() << file.errorString();
+        return ;
+    }
+    file.write(QJsonDocument(root).toJson());
+    file.commit();
+}
+
+/*
+ * An entry written before the device was reconnected needs to be checked on the device,
+ * the file could have been removed from somewhere else (like the sd2snes menu).
+ */
+
+PutFileManifest::CheckResult PutFileManifest::check(const QString& device, const QString& path, quint64 size, const QByteArray& sha256)
+{
+    load();
+    QString nPath = normalizePath(path);
+    if (!entries.value(device).contains(nPath))
+        return CheckResult::Mismatch;
+    const Entry entry = entries.value(device).value(nPath);
+    if (entry.size != size || entry.sha256 != sha256)
+        return CheckResult::Mismatch;
+    if (!verified.value(device).contains(nPath))
+        return CheckResult::NeedVerification;
+    return CheckResult::Match;
+}
+
+void PutFileManifest::setVerified(const QString& device, const QString& path)
+{
+    verified[device].insert(normalizePath(path));
+}
+
+void PutFileManifest::remove(const QString& device, const QString& path)
+{
+    load();
+    QString nPath = normalizePath(path);
+    bool changed = false;
+    QMutableMapIterator<QString, Entry> it(entries[device]);
+    while (it.hasNext())
+    {
+        it.next();
+        // Removing a directory forget everything in it
+        if (it.key() == nPath || it.key().startsWith(nPath + "/"))
+        {
+            verified[device].remove(it.key());
+            it.remove();
+            changed = true;
+        }
+    }
+    if (changed)
+        save();
+}
+
+void PutFileManifest::rename(const QString& device, const QString& path, const QString& newPath)
+{
+    load();
+    QString nPath = normalizePath(path);
+    QString nNewPath = normalizePath(newPath);
+    if (!entries.value(device).contains(nPath))
+    {
+        remove(device, nNewPath);
+        return ;
+    }
+    Entry entry = entries[device].take(nPath);
+    verified[device].remove(nPath);
+    entries[device][nNewPath] = entry;
+    verified[device].insert(nNewPath);
+    save();
+}
+
+void PutFileManifest::forgetSession(const QString& device)
+{
+    verified.remove(device);
+    abortUpload(device);
+}
+
+void PutFileManifest::beginUpload(const QString& device, const QString& path, quint64 size)
+{
+    abortUpload(device);
+    // The file will be replaced, even if the upload fail
+    remove(device, path);
+    Upload up;
+    up.path = normalizePath(path);
+    up.size = size;
+    up.received = 0;
+    up.hash = new QCryptographicHash(QCryptographicHash::Sha256);
+    uploads[device] = up;
+}
+
+void PutFileManifest::addUploadData(const QString& device, const QByteArray& data)
+{
+    if (!uploads.contains(device))
+        return ;
+    Upload& up = uploads[device];
+    up.hash->addData(data);
+    up.received += static_cast<quint64>(data.size());
+}
+
+void PutFileManifest::finishUpload(const QString& device)
+{
+    if (!uploads.contains(device))
+        return ;
+    Upload up = uploads.take(device);
+    if (up.received == up.size)
+    {
+        Entry entry;
+        entry.size = up.size;
+        entry.uploadTime = QDateTime::currentDateTimeUtc();
+        entry.sha256 = up.hash->result();
+        entries[device][up.path] = entry;
+        verified[device].insert(up.path);
+        sDebug() << "Recorded" << up.path << "for" << device << entry.sha256.toHex();
+        save();
+    } else {
+        sInfo() << "Upload of" << up.path << "incomplete, not recorded" << up.received << "/" << up.size;
+    }
+    delete up.hash;
+}
+
+void PutFileManifest::abortUpload(const QString& device)
+{
+    if (!uploads.contains(device))
+        return ;
+    delete uploads.take(device).hash;
+}
+
+bool PutFileManifest::isUploading(const QString& device) const
+{
+    return uploads.contains(device);
+}
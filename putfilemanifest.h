@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef PUTFILEMANIFEST_H
+#define PUTFILEMANIFEST_H
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QMap>
+#include <QSet>
+#include <QString>
+
+/*
+ * Remember what was uploaded with PutFile on each device (path, size, upload time and sha256)
+ * so a client can know that a file is already there without sending it again.
+ * It's saved in putfile-manifest.json next to the configuration file.
+ */
+
+class PutFileManifest
+{
+public:
+    enum class CheckResult {
+        Match,
+        Mismatch,
+        NeedVerification
+    };
+
+    PutFileManifest();
+    ~PutFileManifest();
+    CheckResult check(const QString& device, const QString& path, quint64 size, const QByteArray& sha256);
+    void        setVerified(const QString& device, const QString& path);
+    void        remove(const QString& device, const QString& path);
+    void        rename(const QString& device, const QString& path, const QString& newPath);
+    void        forgetSession(const QString& device);
+
+    void        beginUpload(const QString& device, const QString& path, quint64 size);
+    void        addUploadData(const QString& device, const QByteArray& data);
+    void        finishUpload(const QString& device);
+    void        abortUpload(const QString& device);
+    bool        isUploading(const QString& device) const;
+
+private:
+    struct Entry {
+        quint64     size;
+        QDateTime   uploadTime;
+        QByteArray  sha256;
+    };
+
+    struct Upload {
+        QString             path;
+        quint64             size;
+        quint64             received;
+        QCryptographicHash* hash;
+    };
+
+    bool                                    loaded;
+    QMap<QString, QMap<QString, Entry> >    entries;
+    // Files known to be on the device since it was (re)connected
+    QMap<QString, QSet<QString> >           verified;
+    QMap<QString, Upload>                   uploads;
+
+    void            load();
+    void            save();
+    static QString  filePath();
+    static QString  normalizePath(const QString& path);
+};
+
+#endif // PUTFILEMANIFEST_H
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "addressmapper.h"
+
+#include <algorithm>
+
+static const unsigned int sramStart = 0xE00000;
+static const unsigned int wramStart = 0xF50000;
+static const unsigned int wramEnd = 0xF70000;
+static const unsigned int addressSpaceEnd = 0x1000000;
+// The smallest linear part of a mapping, HiROM SRAM is 0x2000 per bank
+static const unsigned int stepSize = 0x2000;
+
+/*
+ * Where a ROM or SRAM offset lands on the SNES bus, -1 when it's not mapped.
+ * ROM follows what asar does, banks 7E and 7F are always WRAM.
+ */
+
+namespace {
+
+template<rom_type Type> struct BusMapping;
+
+template<> struct BusMapping<LoROM>
+{
+    static int rom(unsigned int offset)
+    {
+        if (offset >= 0x400000)
+            return -1;
+        return static_cast<int>(0x800000 | ((offset << 1) & 0x7F0000) | (offset & 0x7FFF) | 0x8000);
+    }
+    static int sram(unsigned int offset)
+    {
+        return lorom_sram_pc_to_snes(offset);
+    }
+};
+
+template<> struct BusMapping<HiROM>
+{
+    static int rom(unsigned int offset)
+    {
+        if (offset >= 0x400000)
+            return -1;
+        return static_cast<int>(0xC00000 + offset);
+    }
+    static int sram(unsigned int offset)
+    {
+        if (offset >= 0x40000)
+            return -1;
+        return hirom_sram_pc_to_snes(offset);
+    }
+};
+
+template<> struct BusMapping<ExLoROM>
+{
+    static int rom(unsigned int offset)
+    {
+        if (offset < 0x400000)
+            return BusMapping<LoROM>::rom(offset);
+        if (offset >= 0x7F0000)
+            return -1;
+        offset -= 0x400000;
+        return static_cast<int>(((offset << 1) & 0x7F0000) | (offset & 0x7FFF) | 0x8000);
+    }
+    static int sram(unsigned int offset)
+    {
+        return BusMapping<LoROM>::sram(offset);
+    }
+};
+
+template<> struct BusMapping<ExHiROM>
+{
+    static int rom(unsigned int offset)
+    {
+        if (offset < 0x400000)
+            return BusMapping<HiROM>::rom(offset);
+        if (offset >= 0x7E0000)
+            return -1;
+        return static_cast<int>(offset);
+    }
+    static int sram(unsigned int offset)
+    {
+        return BusMapping<HiROM>::sram(offset);
+    }
+};
+
+}
+
+AddressMapper::AddressMapper(rom_type type)
+{
+    setRomType(type);
+}
+
+rom_type AddressMapper::romType() const
+{
+    return m_romType;
+}
+
+void AddressMapper::setRomType(rom_type type)
+{
+    if (!table.isEmpty() && type == m_romType)
+        return ;
+    m_romType = type;
+    switch (type)
+    {
+    case HiROM:
+        buildTable<HiROM>();
+        break;
+    case ExLoROM:
+        buildTable<ExLoROM>();
+        break;
+    case ExHiROM:
+        buildTable<ExHiROM>();
+        break;
+    default:
+        buildTable<LoROM>();
+    }
+}
+
+template<rom_type Type>
+void AddressMapper::buildTable()
+{
+    table.clear();
+    for (unsigned int address = 0; address < sramStart; address += stepSize)
+        appendStep(ROM, address, 0, BusMapping<Type>::rom(address));
+    for (unsigned int address = sramStart; address < wramStart; address += stepSize)
+        appendStep(SRAM, address, sramStart, BusMapping<Type>::sram(address - sramStart));
+    for (unsigned int address = wramStart; address < wramEnd; address += stepSize)
+        appendStep(WRAM, address, wramStart, static_cast<int>(0x7E0000 + address - wramStart));
+    for (unsigned int address = wramEnd; address < addressSpaceEnd; address += stepSize)
+        appendStep(INVALID, address, wramEnd, -1);
+}
+
+// Steps that continue the previous range are merged in it
+void AddressMapper::appendStep(Region region, unsigned int address, unsigned int regionStart, int busAddress)
+{
+    if (!table.isEmpty())
+    {
+        Range& last = table.last();
+        bool linear = last.busStart == -1 ? busAddress == -1
+                                          : busAddress == last.busStart + static_cast<int>(address - last.start);
+        if (last.region == region && last.end == address && linear)
+        {
+            last.end = address + stepSize;
+            return ;
+        }
+    }
+    table.append(Range{address, address + stepSize, region, regionStart, busAddress});
+}
+
+AddressMapper::Piece AddressMapper::map(unsigned int address) const
+{
+    QList<Piece> pieces;
+    appendPieces(pieces, address, 1, ByBusRange);
+    return pieces.first();
+}
+
+QList<AddressMapper::Piece> AddressMapper::map(unsigned int address, unsigned int size, SplitMode mode) const
+{
+    QList<Piece> toret;
+    appendPieces(toret, address, size, mode);
+    return toret;
+}
+
+void AddressMapper::appendPieces(QList<Piece> &pieces, unsigned int address, unsigned int size, SplitMode mode) const
+{
+    auto range = std::upper_bound(table.cbegin(), table.cend(), address, [](unsigned int addr, const Range& r) {
+        return addr < r.end;
+    });
+    bool first = true;
+    while (size != 0)
+    {
+        if (range == table.cend())
+        {
+            pieces.append(Piece{INVALID, address, address - wramEnd, -1, size});
+            return ;
+        }
+        Piece piece;
+        piece.region = range->region;
+        piece.address = address;
+        piece.offset = address - range->regionStart;
+        piece.busAddress = range->busStart == -1 ? -1 : range->busStart + static_cast<int>(address - range->start);
+        piece.size = qMin(size, range->end - address);
+        if (!first && mode == ByRegion && pieces.last().region == piece.region)
+            pieces.last().size += piece.size;
+        else
+            pieces.append(piece);
+        first = false;
+        address += piece.size;
+        size -= piece.size;
+        ++range;
+    }
+}
+
+bool AddressMapper::isMapped(const QList<Piece> &pieces, SplitMode mode)
+{
+    for (const Piece& piece : pieces)
+    {
+        if (piece.region == INVALID || (mode == ByBusRange && piece.busAddress == -1))
+            return false;
+    }
+    return true;
+}
+
+const char* AddressMapper::regionName(Region region)
+{
+    switch (region)
+    {
+    case ROM:
+        return "ROM";
+    case SRAM:
+        return "SRAM";
+    case WRAM:
+        return "WRAM";
+    default:
+        return "INVALID";
+    }
+}
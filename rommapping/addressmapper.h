@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef ADDRESSMAPPER_H
+#define ADDRESSMAPPER_H
+
+#include <QList>
+#include <QPair>
+#include <QVector>
+
+#include "rommapping.h"
+
+/*
+ * Translate the FXPak address space (ROM at 0, SRAM at 0xE00000, WRAM at 0xF50000)
+ * to memory regions and to the SNES bus of a ROM type.
+ * The mapping is compiled in a sorted table of linear ranges when the ROM type is set,
+ * a request is split where it crosses from a range to another.
+ */
+
+class AddressMapper
+{
+public:
+    enum Region {
+        ROM,
+        SRAM,
+        WRAM,
+        INVALID
+    };
+
+    enum SplitMode {
+        // Only split when changing region, for backends that access the memory by region
+        ByRegion,
+        // Also split where the SNES bus address is not linear anymore
+        ByBusRange
+    };
+
+    struct Piece {
+        Region          region;
+        unsigned int    address;    // FXPak address
+        unsigned int    offset;     // Offset in the region
+        int             busAddress; // -1 if not mapped on the bus, only meaningful with ByBusRange
+        unsigned int    size;
+    };
+
+    explicit AddressMapper(rom_type type = LoROM);
+    rom_type        romType() const;
+    void            setRomType(rom_type type);
+    Piece           map(unsigned int address) const;
+    QList<Piece>    map(unsigned int address, unsigned int size, SplitMode mode) const;
+    template<typename T>
+    QList<Piece>    map(const QList<QPair<unsigned int, T> >& requests, SplitMode mode) const
+    {
+        QList<Piece> toret;
+        for (const auto& request : requests)
+            appendPieces(toret, request.first, request.second, mode);
+        return toret;
+    }
+    static bool     isMapped(const QList<Piece>& pieces, SplitMode mode);
+    static const char* regionName(Region region);
+
+private:
+    struct Range {
+        unsigned int    start;
+        unsigned int    end;
+        Region          region;
+        unsigned int    regionStart;
+        int             busStart;
+    };
+
+    rom_type        m_romType;
+    QVector<Range>  table;
+
+    template<rom_type Type>
+    void            buildTable();
+    void            appendStep(Region region, unsigned int address, unsigned int regionStart, int busAddress);
+    void            appendPieces(QList<Piece>& pieces, unsigned int address, unsigned int size, SplitMode mode) const;
+};
+
+#endif // ADDRESSMAPPER_H
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <QLoggingCategory>
+#include "scriptjob.h"
+
+Q_LOGGING_CATEGORY(log_scriptjob, "ScriptJob")
+#define sDebug() qCDebug(log_scriptjob)
+
+ScriptJob::ScriptJob(QSharedPointer<DeviceScript> script, QObject *parent) : DeviceJob(parent)
+{
+    this->script = script;
+    memoryJob = nullptr;
+    reading = false;
+}
+
+QList<DeviceScript::Event> ScriptJob::events() const
+{
+    return m_events;
+}
+
+void ScriptJob::start(ADevice *device)
+{
+    m_device = device;
+    // finished/failed must not be emitted while the server is still starting the job
+    QTimer::singleShot(0, this, &ScriptJob::startTick);
+}
+
+void ScriptJob::abort()
+{
+    if (memoryJob != nullptr)
+    {
+        memoryJob->abort();
+        memoryJob->deleteLater();
+        memoryJob = nullptr;
+    }
+    DeviceJob::abort();
+}
+
+void ScriptJob::startTick()
+{
+    if (m_device == nullptr)
+        return ;
+    process(script->startTick());
+}
+
+void ScriptJob::onMemoryJobFinished()
+{
+    QByteArray data = reading ? memoryJob->data() : QByteArray();
+    memoryJob->deleteLater();
+    memoryJob = nullptr;
+    process(script->resume(data));
+}
+
+void ScriptJob::onMemoryJobFailed()
+{
+    QString error = memoryJob->errorString();
+    memoryJob->deleteLater();
+    memoryJob = nullptr;
+    fail("Script: " + error);
+}
+
+// Runs the script until it waits for the device or its tick is done
+void ScriptJob::process(DeviceScript::Status status)
+{
+    m_events.append(script->takeEvents());
+    switch (status)
+    {
+    case DeviceScript::DONE:
+        finish();
+        return ;
+    case DeviceScript::ERROR:
+        fail(script->errorString());
+        return ;
+    case DeviceScript::READ:
+    case DeviceScript::WRITE:
+        break;
+    }
+    reading = status == DeviceScript::READ;
+    memoryJob = new DeviceMemoryJob(this);
+    if (reading)
+        memoryJob->setRead(script->ranges());
+    else
+        memoryJob->setWrite(script->ranges(), script->writeData());
+    connect(memoryJob, &DeviceJob::finished, this, &ScriptJob::onMemoryJobFinished);
+    connect(memoryJob, &DeviceJob::failed, this, &ScriptJob::onMemoryJobFailed);
+    sDebug() << (reading ? "Reading" : "Writing") << script->ranges().size() << "ranges";
+    memoryJob->start(m_device);
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2018 Sylvain "Skarsnik" Colinet.
+ *
+ * This file is part of the QUsb2Snes project.
+ * (see https://github.com/Skarsnik/QUsb2snes).
+ *
+ * QUsb2Snes is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * QUsb2Snes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SCRIPTJOB_H
+#define SCRIPTJOB_H
+
+#include <QSharedPointer>
+#include <QTimer>
+#include "devicejob.h"
+#include "devicememoryjob.h"
+#include "devicescript.h"
+
+/*
+ * One tick of a DeviceScript. The device is owned until the tick function returns,
+ * so the reads and writes of the script are not mixed with the requests of other clients.
+ * The events sent by the script during the tick are in events().
+ */
+
+class ScriptJob : public DeviceJob
+{
+    Q_OBJECT
+public:
+    explicit ScriptJob(QSharedPointer<DeviceScript> script, QObject *parent = nullptr);
+    QList<DeviceScript::Event>  events() const;
+    void    start(ADevice* device);
+    void    abort();
+
+private slots:
+    void    startTick();
+    void    onMemoryJobFinished();
+    void    onMemoryJobFailed();
+
+private:
+    QSharedPointer<DeviceScript>    script;
+    DeviceMemoryJob*                memoryJob;
+    bool                            reading;
+    QList<DeviceScript::Event>      m_events;
+
+    void    process(DeviceScript::Status status);
+};
+
+#endif // SCRIPTJOB_H
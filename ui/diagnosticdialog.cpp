@@ -32,7 +32,11 @@ void DiagnosticDialog::sendRequest(QString opCode, QStringList operands)
 
     jObj["Opcode"] = opCode;
     if (!operands.isEmpty())
+    {
+        for (const QString& op : operands)
+            jOp.append(op);
         jObj["Operands"] = jOp;
+    }
     testSocket.sendTextMessage(QJsonDocument(jObj).toJson());
 }
 
@@ -82,17 +86,55 @@ DiagnosticDialog::DiagnosticDialog(QWidget *parent) :
                 ui->deviceWebsocketInfosLabel->setText("Founds devices : " + devices.join("-"));
                 socketState = TestSocketState::INFO;
                 sendRequest("Attach", QStringList() << devices.first());
+                // Attach has no reply
+                sendRequest("Info");
             }
             break;
         }
         case TestSocketState::INFO :
         {
             QStringList devices = getJsonResults(msg);
+            if (devices.size() < 3)
+                break;
             ui->deviceInternalInfosLabel->setText("Type : " + devices.at(1) + " - Version : " + devices.at(0) + " - Rom : " + devices.at(2));
+            ui->benchmarkLabel->setText(tr("Benchmark will only read WRAM: small reads, a batch of small reads (VGET) if the device supports it and a 32KB bulk read"));
+            ui->benchmarkButton->setEnabled(true);
+            break;
+        }
+        case TestSocketState::BENCHMARK :
+        {
+            QStringList results = getJsonResults(msg);
+            QString text;
+            // name, count, p50, p90, p99, max, bytes/s
+            for (int i = 0; i + 6 < results.size(); i += 7)
+            {
+                text.append(QString("%1 (%2) : p50 %3 us - p90 %4 us - p99 %5 us - max %6 us - %7 B/s\n")
+                            .arg(results.at(i), results.at(i + 1), results.at(i + 2), results.at(i + 3),
+                                 results.at(i + 4), results.at(i + 5), results.at(i + 6)));
+            }
+            ui->benchmarkLabel->setText(text.trimmed());
+            ui->benchmarkButton->setEnabled(true);
+            socketState = TestSocketState::INFO;
             break;
         }
+        default:
+            break;
         }
     });
+    connect(&testSocket, &QWebSocket::disconnected, this, [=] {
+        if (socketState == TestSocketState::BENCHMARK)
+            ui->benchmarkLabel->setText(tr("Benchmark failed, look at the log for more informations"));
+        ui->benchmarkButton->setEnabled(false);
+    });
+    connect(ui->benchmarkButton, &QPushButton::clicked, this, &DiagnosticDialog::onBenchmarkButtonClicked);
+}
+
+void DiagnosticDialog::onBenchmarkButtonClicked()
+{
+    socketState = TestSocketState::BENCHMARK;
+    ui->benchmarkButton->setEnabled(false);
+    ui->benchmarkLabel->setText(tr("Running benchmark..."));
+    sendRequest("Benchmark");
 }
 
 void DiagnosticDialog::setWSServer(WSServer *serv)
@@ -29,13 +29,15 @@ private:
     enum TestSocketState {
         NONE,
         DEVICELIST,
-        INFO
+        INFO,
+        BENCHMARK
     };
 
     WSServer* server;
     QWebSocket testSocket;
     TestSocketState socketState;
     void sendRequest(QString opCode, QStringList operands = QStringList());
+    void onBenchmarkButtonClicked();
 };
 
 #endif // DIAGNOSTICDIALOG_H
@@ -119,21 +119,38 @@ Q_NAMESPACE
     Menu, // Get back to the menu TOTEST
     Reset, // Reset TOTEST
     Binary, // TODO Send data directly to the sd2snes I guess?
-    Stream, // TODO
-    Fence, // TODO
+    Stream, // Stream a memory region [offset, size, (interval)]->frame, frame, ... Stream with no argument stop it->{}
+            // STREAM_BURST flag use the device streaming (sd2snes) instead of polling, this lock the device
+    Fence, // Wait for all the previous commands on the device to be done [(token)]->{(token)}
+    Watch, // Get an event when a memory condition is met [name, offset, size, condition, (value), (mask), (debounce)]->{name}
+           // then {"Event":{"Name", "Value", "Previous"}} each time it fires
+    Unwatch, // Remove a watch, all your watches without name [(name)]->{(name)}
+    ScriptLoad, // Run a Lua script next to the device, replace the one with the same name [name, source, (interval)]->{name}
+                // then {"Event":{"Script", "Name", "Value"}} for its events and {"Event":{"Script", "Error"}} if it stops
+    ScriptUnload, // Stop a script, all your scripts without name [(name)]->{(name)}
 
     GetAddress, // Get the value of the address, space is important [offset, size]->datarequested TOFIX multiarg form
     PutAddress, // put value to the address  [offset, size] then send the binary data.
                 // Also support multiple request in one [offset1, size1, offset2, size2] TOFIX work on size check/boundary
-    PutIPS, // Apply a patch - [name, size] then send binary data
+    PutIPS, // Apply a IPS, UPS or BPS patch - [name, size] then send binary data
             // a special name is 'hook' for the sd2snes
+    // Read-modify-write without other commands in between, size is 1, 2 or 4 bytes, little endian
+    AtomicAdd, // [offset, size, value]->{oldvalue}
+    AtomicOr, // [offset, size, value]->{oldvalue}
+    AtomicAnd, // [offset, size, value]->{oldvalue}
+    AtomicXor, // [offset, size, value]->{oldvalue}
+    CompareAndSwap, // Write newvalue if the value is expected [offset, size, expected, newvalue]->{oldvalue}
 
     GetFile, // Get a file - [filepath]->{size}->filedata
     PutFile, // Post a file -  [filepath, size] then send the binary data
     List, // LS command - [dirpath]->{typefile1, namefile1, typefile2, namefile2...}
     Remove, // remove a file [filepath]
     Rename, // rename a file [filepath, newfilename]
-    MakeDir // create a directory [dirpath]
+    MakeDir, // create a directory [dirpath]
+    CheckFile, // Check if a file sent with PutFile is already on the device [filepath, size, sha256]->{Match|Mismatch}
+
+    // Diagnostic
+    Benchmark // Measure the device [(scratchoffset, scratchsize)]->{name, count, p50, p90, p99, max, bytespersec, name...}
     };
     Q_ENUM_NS(opcode)
 
@@ -18,6 +18,7 @@
  * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include "devicememoryjob.h"
 #include "wsserver.h"
 #include <QJsonArray>
 #include <QJsonDocument>
@@ -26,6 +27,8 @@
 #include <QMetaObject>
 #include <QMetaObject>
 #include <QSettings>
+#include <QTimer>
+#include <QtEndian>
 
 Q_LOGGING_CATEGORY(log_wsserver, "WSServer")
 #define sDebug() qCDebug(log_wsserver)
@@ -94,9 +97,10 @@ void WSServer::onNewConnection()
     wi.byteReceived = 0;
     wi.pendingAttach = false;
     wi.recvData.clear();
-    wi.ipsSize = 0;
+    wi.patchJob = nullptr;
     wi.expectedDataSize = 0;
     wi.legacy = server->serverPort() == USB2SnesWS::legacyPort;
+    wi.deviceEvents = false;
 
     wsInfos[newSocket] = wi;
     sInfo() << "New connection accepted " << wi.name << newSocket->origin() << newSocket->peerAddress();
@@ -143,6 +147,8 @@ void WSServer::addDeviceFactory(DeviceFactory *devFact)
         connect(devFact, &DeviceFactory::newDeviceName, this, &WSServer::onNewDeviceName);
         connect(devFact, &DeviceFactory::devicesListDone, this, &WSServer::onDeviceListDone);
     }
+    connect(devFact, &DeviceFactory::deviceAppeared, this, &WSServer::onDeviceAppeared);
+    connect(devFact, &DeviceFactory::deviceDisappeared, this, &WSServer::onDeviceDisappeared);
     deviceFactories.append(devFact);
 }
 
@@ -316,7 +322,14 @@ void WSServer::onTextMessageReceived(QString message)
     {
         ADevice* dev = wsInfo.attachedTo;
         sDebug() << "Device is " << dev->state();
-        if (dev->state() == ADevice::READY && pendingRequests[dev].isEmpty())
+        // Stopping a stream can't wait in the queue behind the stream itself
+        if (req->opcode == USB2SnesWS::Stream && req->arguments.isEmpty())
+        {
+            cmdStopStream(req);
+            return ;
+        }
+        // Some devices are READY while waiting for the data of a put, the request is still running
+        if (dev->state() == ADevice::READY && pendingRequests[dev].isEmpty() && currentRequests.value(dev) == nullptr)
         {
             if ((isControlCommand(req->opcode) && !dev->hasControlCommands()) ||
                  (isFileCommand(req->opcode) && !dev->hasFileCommands()))
@@ -371,18 +384,13 @@ void WSServer::onBinaryMessageReceived(QByteArray data)
         clientError(ws);
         return;
     }
-    // IPS stuff, please don't queue IPS data ~~
-    if (infos.ipsSize != 0)
+    // Patch stuff, the job parses the data as they arrive, please don't queue patch data ~~
+    if (infos.patchJob != nullptr)
     {
-        sDebug() << "Data sent are IPS data";
-        infos.ipsData.append(data);
-        if (infos.ipsData.size() == infos.ipsSize)
-        {
-            infos.recvData.clear();
-            infos.byteReceived = 0;
-            infos.ipsSize = 0;
-            processIpsData(ws);
-        }
+        sDebug() << "Data sent are patch data";
+        infos.patchJob->feed(data);
+        if (infos.patchJob->patchReceived())
+            infos.patchJob = nullptr;
         return ;
     }
     sDebug() << "Current put size : " << infos.currentPutSize << "Expected size" << infos.expectedDataSize;
@@ -406,9 +414,9 @@ void WSServer::onBinaryMessageReceived(QByteArray data)
         {
             infos.currentPutSize -= data.size();
             infos.expectedDataSize = infos.currentPutSize;
-            dev->writeData(data);
+            writeDeviceData(dev, data);
         } else { // There is too much data
-            dev->writeData(data.left(infos.currentPutSize));
+            writeDeviceData(dev, data.left(infos.currentPutSize));
             setError(ErrorType::ProtocolError, "Sending too much binary data");
             clientError(ws);
         }
@@ -424,7 +432,7 @@ void WSServer::onBinaryMessageReceived(QByteArray data)
     {
         infos.currentPutSize -= data.size();
         infos.expectedDataSize -= data.size();
-        dev->writeData(data);
+        writeDeviceData(dev, data);
         return ;
     }
 
@@ -437,7 +445,7 @@ void WSServer::onBinaryMessageReceived(QByteArray data)
     unsigned int currentSize = infos.currentPutSize;
     infos.currentPutSize = 0;
     infos.expectedDataSize -= currentSize;
-    dev->writeData(data.left(currentSize));
+    writeDeviceData(dev, data.left(currentSize));
     return ;
             /*QByteArray toWrite = data.left(infos.currentPutSize);
             data = data.mid(infos.currentPutSize);
@@ -506,6 +514,9 @@ void WSServer::onClientError(QAbstractSocket::SocketError)
 void WSServer::onDeviceCommandFinished()
 {
     ADevice*  device = qobject_cast<ADevice*>(sender());
+    // The job handle the device commands itself
+    if (currentRequests.value(device) != nullptr && currentRequests.value(device)->job != nullptr)
+        return ;
     if (devicesInfos[device].currentWS != nullptr)
     {
         processDeviceCommandFinished(device);
@@ -513,8 +524,25 @@ void WSServer::onDeviceCommandFinished()
         //QMetaObject::invokeMethod(this, "processCommandQueue", Qt::QueuedConnection, Q_ARG(ADevice*, device));
         processCommandQueue(device);
     }
-    else
+    else {
         sDebug() << "Received finished command while no socket to receive it";
+        // The client left while its request was running, don't stall the other clients
+        if (currentRequests.value(device) != nullptr)
+        {
+            disconnect(device, &ADevice::getDataReceived, this, &WSServer::onDeviceGetDataReceived);
+            disconnect(device, &ADevice::streamDataReceived, this, &WSServer::onDeviceStreamDataReceived);
+            // The file operation was still done
+            updatePutFileManifest(device, currentRequests.value(device));
+            delete currentRequests[device];
+            currentRequests[device] = nullptr;
+            processCommandQueue(device);
+        } else if (!pendingRequests.value(device).isEmpty())
+        {
+            // Late answer of a job that timed out while the device was busy,
+            // the queue waited for the device to be ready
+            processCommandQueue(device);
+        }
+    }
 }
 
 void WSServer::onDeviceProtocolError()
@@ -537,13 +565,46 @@ void WSServer::onDeviceClosed()
 void WSServer::onDeviceGetDataReceived(QByteArray data)
 {
     ADevice*  device = qobject_cast<ADevice*>(sender());
+    // What a job reads is for the job, it sends its own results
+    if (currentRequests.value(device) != nullptr && currentRequests.value(device)->job != nullptr)
+        return ;
     if (devicesInfos.value(device).currentWS == nullptr)
     {
         sDebug() << "NOOP Sending get data to nothing" << device->name();
         return ;
     }
-    sDebug() << "Sending " << data.size() << "to" << wsInfos.value(devicesInfos[device].currentWS).name;
-    devicesInfos[device].currentWS->sendBinaryMessage(data);
+    QWebSocket* ws = devicesInfos.value(device).currentWS;
+    // A stream frame is only sent when complete
+    if (devicesInfos.value(device).currentCommand == USB2SnesWS::Stream && streams.contains(ws))
+    {
+        streams[ws].frame.append(data);
+        return ;
+    }
+    MRequest* req = currentRequests.value(device);
+    if (req != nullptr && req->opcode == USB2SnesWS::GetAddress && req->space == SD2Snes::space::SNES
+        && memoryWatcher.hasWatches(device))
+        req->readData.append(data);
+    if (req != nullptr && !req->timestampSent && req->flags.contains("TIMESTAMP"))
+    {
+        req->timestampSent = true;
+        data.prepend(timestampHeader(device));
+    }
+    sDebug() << "Sending " << data.size() << "to" << wsInfos.value(ws).name;
+    ws->sendBinaryMessage(data);
+}
+
+void WSServer::onDeviceStreamDataReceived(QByteArray data)
+{
+    ADevice*  device = qobject_cast<ADevice*>(sender());
+    QWebSocket* ws = devicesInfos.value(device).currentWS;
+    if (ws == nullptr || !streams.contains(ws))
+    {
+        sDebug() << "NOOP Sending stream data to nothing" << device->name();
+        return ;
+    }
+    if (streams.value(ws).timestamp)
+        data.prepend(timestampHeader(device));
+    ws->sendBinaryMessage(data);
 }
 
 // Used for Get File
@@ -564,6 +625,11 @@ void        WSServer::processCommandQueue(ADevice* device)
         devicesInfos[device].currentCommand = req->opcode;
         devicesInfos[device].currentWS = req->owner;
         req->wasPending = true;
+        if (req->job != nullptr)
+        {
+            startDeviceJob(req, device, req->job);
+            return ;
+        }
         // Request is no longer in queue, so expected data need to not go in queue
         // if not already here.
         /*if (req->opcode == USB2SnesWS::PutAddress)
@@ -660,6 +726,47 @@ void    WSServer::cleanUpDevice(ADevice* device)
     }
     if (devInfo.currentWS != nullptr)
         devInfo.currentWS = nullptr;
+    MRequest* current = currentRequests.value(device);
+    if (current != nullptr && current->job != nullptr)
+    {
+        current->job->abort();
+        current->job->deleteLater();
+        current->job = nullptr;
+    }
+    // Queued jobs will never run, their owner knows it when they are destroyed
+    QMutableListIterator<MRequest*> pit(pendingRequests[device]);
+    while (pit.hasNext())
+    {
+        MRequest* mReq = pit.next();
+        if (mReq->job != nullptr)
+        {
+            mReq->job->deleteLater();
+            pit.remove();
+            delete mReq;
+        }
+    }
+    QMutableMapIterator<QWebSocket*, StreamInfos> sit(streams);
+    while (sit.hasNext())
+    {
+        sit.next();
+        if (sit.value().device == device)
+            sit.remove();
+    }
+    putFileManifest.forgetSession(manifestDevice(device));
+    // Another cart can be plugged before it's opened again
+    devInfo.cartIdentity.clear();
+    devInfo.identityQueried = false;
+    memoryWatcher.removeDevice(device);
+#ifdef QUSB2SNES_SCRIPTING
+    QMutableMapIterator<QWebSocket*, QMap<QString, ScriptInfos> > scit(scripts);
+    while (scit.hasNext())
+    {
+        scit.next();
+        // The scripts of a client are all on its device
+        if (scit.value().isEmpty() || scit.value().first().device == device)
+            scit.remove();
+    }
+#endif
     DeviceFactory* devFact = mapDevFact[device];
     mapDevFact.remove(device);
     disconnect(device, nullptr, this, nullptr);
@@ -697,7 +804,32 @@ void WSServer::cleanUpSocket(QWebSocket *ws)
         {
             req->owner = nullptr;
             req->state = RequestState::CANCELLED;
+            if (req->opcode == USB2SnesWS::Stream && streams.value(ws).burst)
+                dev->stopStreamCommand();
+            // Nothing will finish this request (like one that failed to execute
+            // or a patch still waiting for its data), free the device
+            // We can be called from the request execution, so not right now
+            if (dev->state() == ADevice::READY && (req->job == nullptr || req->job == wInfo.patchJob))
+            {
+                if (req->job != nullptr)
+                {
+                    req->job->abort();
+                    req->job->deleteLater();
+                    req->job = nullptr;
+                }
+                currentRequests[dev] = nullptr;
+                QTimer::singleShot(0, this, [=] {
+                    delete req;
+                    if (devices.contains(dev) && currentRequests.value(dev) == nullptr && dev->state() == ADevice::READY)
+                        processCommandQueue(dev);
+                });
+            }
         }
+        streams.remove(ws);
+        memoryWatcher.removeOwner(ws);
+#ifdef QUSB2SNES_SCRIPTING
+        scripts.remove(ws);
+#endif
         // Removing pending request that are tied to this ws
         QMutableListIterator<MRequest*>    it(pendingRequests[dev]);
         while(it.hasNext())
@@ -749,6 +881,145 @@ void    WSServer::sendReply(QWebSocket* ws, QString args)
     sendReply(ws, QStringList() << args);
 }
 
+/*
+ * Header put before read data when the client use the TIMESTAMP flag
+ * 3 little endian 64 bits values, in microseconds on the server monotonic clock:
+ * when the device probably sampled the data, when we received it and now.
+ */
+
+QByteArray  WSServer::timestampHeader(ADevice* device)
+{
+    QByteArray header(24, 0);
+    qToLittleEndian<qint64>(device->sampleTimeEstimate(), header.data());
+    qToLittleEndian<qint64>(device->lastDataTime(), header.data() + 8);
+    qToLittleEndian<qint64>(ADevice::monotonicTime(), header.data() + 16);
+    return header;
+}
+
+/*
+ * Watches polling, what the streams and the clients GetAddress did not read recently
+ * is read with a job in the device queue, the next poll is scheduled when it's done.
+ * WatchInterval in the config is the time between two polls in milliseconds.
+ */
+
+void    WSServer::scheduleWatchPoll(ADevice* device)
+{
+    if (watchPolls.contains(device))
+        return ;
+    watchPolls.insert(device);
+    int interval = globalSettings->value("WatchInterval", 100).toInt();
+    QTimer::singleShot(interval, this, [=] {
+        if (!devices.contains(device) || !memoryWatcher.hasWatches(device))
+        {
+            watchPolls.remove(device);
+            return ;
+        }
+        QList<MemoryWatcher::Range> ranges = memoryWatcher.rangesToRead(device, static_cast<qint64>(interval) * 1000);
+        if (ranges.isEmpty())
+        {
+            watchPolls.remove(device);
+            scheduleWatchPoll(device);
+            return ;
+        }
+        DeviceMemoryJob* job = new DeviceMemoryJob(this);
+        job->setRead(ranges);
+        connect(job, &DeviceJob::finished, this, [=] {
+            QByteArray data = job->data();
+            int pos = 0;
+            for (const MemoryWatcher::Range& range : ranges)
+            {
+                updateWatches(device, range.first, data.mid(pos, static_cast<int>(range.second)));
+                pos += static_cast<int>(range.second);
+            }
+        });
+        // Done, failed or dropped with the device, the job is always deleted
+        connect(job, &QObject::destroyed, this, [=] {
+            watchPolls.remove(device);
+            if (devices.contains(device) && memoryWatcher.hasWatches(device))
+                scheduleWatchPoll(device);
+        });
+        if (!queueDeviceJob(device, job, USB2SnesWS::Watch))
+            delete job;
+    });
+}
+
+void    WSServer::updateWatches(ADevice* device, unsigned int address, const QByteArray& data)
+{
+    const QList<MemoryWatcher::Event> events = memoryWatcher.update(device, address, data);
+    for (const MemoryWatcher::Event& event : events)
+    {
+        QJsonObject jEvent;
+        jEvent["Name"] = event.name;
+        jEvent["Value"] = QString::number(event.value, 16);
+        jEvent["Previous"] = QString::number(event.previous, 16);
+        sendEvent(event.owner, jEvent);
+    }
+}
+
+#ifdef QUSB2SNES_SCRIPTING
+
+/*
+ * Scripts, each tick is a job in the device queue and the next one is scheduled
+ * interval milliseconds after it is done. A script that fails is unloaded.
+ */
+
+void    WSServer::scheduleScriptTick(QWebSocket* ws, const QString& name)
+{
+    const ScriptInfos infos = scripts.value(ws).value(name);
+    QSharedPointer<DeviceScript> script = infos.script;
+    ADevice* device = infos.device;
+    QTimer::singleShot(infos.interval, this, [=] {
+        // Unloaded or replaced since
+        if (scripts.value(ws).value(name).script != script || !devices.contains(device))
+            return ;
+        ScriptJob* job = new ScriptJob(script, this);
+        connect(job, &DeviceJob::finished, this, [=] {
+            sendScriptEvents(ws, name, job->events());
+        });
+        connect(job, &DeviceJob::failed, this, [=] {
+            sendScriptEvents(ws, name, job->events());
+            if (scripts.value(ws).value(name).script != script)
+                return ;
+            sInfo() << "Script" << name << "of" << wsInfos.value(ws).name << "stopped :" << job->errorString();
+            scripts[ws].remove(name);
+            QJsonObject jEvent;
+            jEvent["Script"] = name;
+            jEvent["Error"] = job->errorString();
+            sendEvent(ws, jEvent);
+        });
+        connect(job, &QObject::destroyed, this, [=] {
+            if (scripts.value(ws).value(name).script == script)
+                scheduleScriptTick(ws, name);
+        });
+        if (!queueDeviceJob(device, job, USB2SnesWS::ScriptLoad))
+            delete job;
+    });
+}
+
+void    WSServer::sendScriptEvents(QWebSocket* ws, const QString& name, const QList<DeviceScript::Event>& events)
+{
+    for (const DeviceScript::Event& event : events)
+    {
+        QJsonObject jEvent;
+        jEvent["Script"] = name;
+        jEvent["Name"] = event.name;
+        jEvent["Value"] = event.value;
+        sendEvent(ws, jEvent);
+    }
+}
+
+#endif
+
+void    WSServer::sendEvent(QWebSocket* ws, const QJsonObject& event)
+{
+    if (!wsInfos.contains(ws))
+        return ;
+    QJsonObject jObj;
+    jObj["Event"] = event;
+    sDebug() << wsInfos.value(ws).name << ">>" << QJsonDocument(jObj).toJson();
+    ws->sendTextMessage(QJsonDocument(jObj).toJson());
+}
+
 bool    WSServer::isV2WebSocket(QWebSocket *ws)
 {
     return false;
@@ -25,10 +25,19 @@
 #include <QtWebSockets/QWebSocket>
 #include <QtWebSockets/QWebSocketServer>
 #include <QDebug>
+#include <QJsonObject>
 #include <QLoggingCategory>
 #include <QMetaEnum>
+#include <QSet>
 #include "adevice.h"
 #include "devicefactory.h"
+#include "devicejob.h"
+#include "memorywatcher.h"
+#include "patchjob.h"
+#include "putfilemanifest.h"
+#ifdef QUSB2SNES_SCRIPTING
+#include "scriptjob.h"
+#endif
 
 Q_DECLARE_LOGGING_CATEGORY(log_wsserver)
 
@@ -70,6 +79,9 @@ private:
         MRequest() {
             id = gId++;
             wasPending = false;
+            fromStream = false;
+            timestampSent = false;
+            job = nullptr;
         }
         quint64             id;
         QWebSocket*         owner;
@@ -80,6 +92,11 @@ private:
         QStringList         flags;
         RequestState        state;
         bool                wasPending;
+        bool                fromStream;
+        bool                timestampSent;
+        DeviceJob*          job;
+        // What a GetAddress read, kept for the watches
+        QByteArray          readData;
         friend QDebug              operator<<(QDebug debug, const MRequest& req);
     private:
         static quint64      gId;
@@ -96,18 +113,41 @@ private:
         //QList<unsigned int>     pendingPutSizes;
         //QList<QByteArray>       pendingPutDatas;
         QByteArray              recvData;
-        QByteArray              ipsData;
-        unsigned int            ipsSize;
+        PatchJob*               patchJob;
         unsigned int            byteReceived;
         bool                    pendingAttach;
         bool                    legacy;
+        bool                    deviceEvents;
     };
 
     struct DeviceInfos {
         QWebSocket*         currentWS;
         USB2SnesWS::opcode  currentCommand;
+        // Firmware and model from an Info done at attach, part of the manifest key
+        QString             cartIdentity;
+        bool                identityQueried;
     };
 
+    struct StreamInfos {
+        ADevice*            device;
+        SD2Snes::space      space;
+        unsigned int        address;
+        unsigned int        size;
+        int                 interval;
+        bool                burst;
+        bool                timestamp;
+        bool                stopRequested;
+        QByteArray          frame;
+    };
+
+#ifdef QUSB2SNES_SCRIPTING
+    struct ScriptInfos {
+        ADevice*                        device;
+        QSharedPointer<DeviceScript>    script;
+        int                             interval;
+    };
+#endif
+
 public:
     struct MiniDeviceInfos {
        QString  name;
@@ -136,6 +176,8 @@ public:
     void        addTrusted(QString origin);
     ServerStatus  serverStatus() const;
     void        requestDeviceStatus();
+    ADevice*    openDevice(const QString& deviceName);
+    bool        queueDeviceJob(ADevice* device, DeviceJob* job, USB2SnesWS::opcode opcode);
 
 signals:
     void    error();
@@ -158,10 +200,16 @@ private slots:
     void    onDeviceProtocolError();
     void    onDeviceClosed();
     void    onDeviceGetDataReceived(QByteArray data);
+    void    onDeviceStreamDataReceived(QByteArray data);
     void    onDeviceSizeGet(unsigned int size);
     void    onNewDeviceName(QString name);
     void    onDeviceListDone();
     void    onDeviceFactoryStatusDone(DeviceFactory::DeviceFactoryStatus);
+    void    onDeviceJobFinished();
+    void    onDeviceJobFailed();
+    void    onCartIdentityDone();
+    void    onDeviceAppeared(QString name);
+    void    onDeviceDisappeared(QString name);
 
 private:
     QMetaEnum                           cmdMetaEnum;
@@ -188,6 +236,14 @@ private:
     QStringList                         deviceList;
 
     QMap<ADevice*, QList<MRequest*> >   pendingRequests;
+    QMap<QWebSocket*, StreamInfos>      streams;
+    PutFileManifest                     putFileManifest;
+    MemoryWatcher                       memoryWatcher;
+    // Devices with a watch poll scheduled or running
+    QSet<ADevice*>                      watchPolls;
+#ifdef QUSB2SNES_SCRIPTING
+    QMap<QWebSocket*, QMap<QString, ScriptInfos> >  scripts;
+#endif
 
     int                                 factoryStatusCount;
     int                                 factoryStatusDoneCount;
@@ -200,12 +256,27 @@ private:
     void        executeRequest(MRequest* req);
     void        executeServerRequest(MRequest *req);
     void        processDeviceCommandFinished(ADevice* device);
+    void        writeDeviceData(ADevice* device, const QByteArray& data);
+    void        updatePutFileManifest(ADevice* device, MRequest* req);
+    QString     manifestDevice(ADevice* device) const;
+    void        queryCartIdentity(ADevice* device);
+    void        startDeviceJob(MRequest* req, ADevice* device, DeviceJob* job);
+    ADevice*    deviceRunningJob(DeviceJob* job) const;
     Q_INVOKABLE void        processCommandQueue(ADevice* device);
 
     void        asyncDeviceList();
     QStringList getDevicesList();
     void        cmdAttach(MRequest* req);
-    void        processIpsData(QWebSocket* ws);
+    void        cmdStopStream(MRequest* req);
+    void        scheduleStreamRead(QWebSocket* ws);
+    void        scheduleWatchPoll(ADevice* device);
+    void        updateWatches(ADevice* device, unsigned int address, const QByteArray& data);
+#ifdef QUSB2SNES_SCRIPTING
+    void        scheduleScriptTick(QWebSocket* ws, const QString& name);
+    void        sendScriptEvents(QWebSocket* ws, const QString& name, const QList<DeviceScript::Event>& events);
+#endif
+    void        sendEvent(QWebSocket* ws, const QJsonObject& event);
+    QByteArray  timestampHeader(ADevice* device);
     void        sendReply(QWebSocket* ws, const QStringList& args);
     void        sendReply(QWebSocket* ws, QString args);
     void        sendReplyV2(QWebSocket *ws, QString args);
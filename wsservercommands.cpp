@@ -18,22 +18,31 @@
  * along with QUsb2Snes.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include "ipsparse.h"
+#include "checkfilejob.h"
+#include "deviceatomicjob.h"
+#include "devicebenchmark.h"
+#include "deviceinfojob.h"
+#include "patchjob.h"
 #include "wsserver.h"
+#include <QDir>
+#include <QFileInfo>
 #include <QLoggingCategory>
 #include <QSerialPortInfo>
+#include <QSettings>
+#include <QTimer>
 #ifndef QUSB2SNES_NOGUI
   #include <QApplication>
 #else
   #include <QCoreApplication>
 #endif
 
+extern QSettings*          globalSettings;
 
 bool    WSServer::isFileCommand(USB2SnesWS::opcode opcode)
 {
     return (opcode == USB2SnesWS::GetFile || opcode == USB2SnesWS::PutFile || opcode == USB2SnesWS::List ||
             opcode == USB2SnesWS::Rename || opcode == USB2SnesWS::MakeDir || opcode == USB2SnesWS::Rename ||
-            opcode == USB2SnesWS::Remove);
+            opcode == USB2SnesWS::Remove || opcode == USB2SnesWS::CheckFile);
 }
 
 bool    WSServer::isControlCommand(USB2SnesWS::opcode opcode)
@@ -60,6 +69,8 @@ void WSServer::executeServerRequest(MRequest* req)
     switch (req->opcode)
     {
     case USB2SnesWS::DeviceList : {
+        if (req->flags.contains("DEVICE_EVENTS"))
+            wsInfos[ws].deviceEvents = true;
         if (numberOfAsyncFactory == 0) {
             QStringList l = getDevicesList();
             sendReply(ws, l);
@@ -173,6 +184,7 @@ void    WSServer::executeRequest(MRequest *req)
             return ;
         }
         bool ok;
+        putFileManifest.beginUpload(manifestDevice(device), req->arguments.at(0), req->arguments.at(1).toUInt(&ok, 16));
         device->putFile(req->arguments.at(0).toLatin1(), req->arguments.at(1).toUInt(&ok, 16));
         req->state = RequestState::WAITINGREPLY;
         wsInfos[ws].commandState = ClientCommandState::WAITINGBDATAREPLY;
@@ -203,6 +215,40 @@ void    WSServer::executeRequest(MRequest *req)
         req->state = RequestState::WAITINGREPLY;
         break;
     }
+    case USB2SnesWS::CheckFile : {
+        if (req->arguments.size() != 3)
+        {
+            setError(ErrorType::CommandError, "CheckFile command take 3 arguments (file, SizeInHex, Sha256InHex)");
+            clientError(ws);
+            return ;
+        }
+        bool ok;
+        quint64 size = req->arguments.at(1).toULongLong(&ok, 16);
+        QByteArray sha256 = QByteArray::fromHex(req->arguments.at(2).toLatin1());
+        if (!ok || sha256.size() != 32)
+        {
+            setError(ErrorType::CommandError, "CheckFile - invalid size or sha256");
+            clientError(ws);
+            return ;
+        }
+        PutFileManifest::CheckResult result = putFileManifest.check(manifestDevice(device), req->arguments.at(0), size, sha256);
+        // Uploaded before the device was reconnected, make sure the file is still the same.
+        // This reads the whole file back, a client can ask for the manifest answer only
+        if (result == PutFileManifest::CheckResult::NeedVerification && !req->flags.contains("NO_VERIFY"))
+        {
+            startDeviceJob(req, device, new CheckFileJob(req->arguments.at(0), size, sha256, this));
+            break;
+        }
+        if (result == PutFileManifest::CheckResult::NeedVerification)
+            sendReply(ws, "Unverified");
+        else
+            sendReply(ws, result == PutFileManifest::CheckResult::Match ? "Match" : "Mismatch");
+        req->state = RequestState::DONE;
+        currentRequests[device] = nullptr;
+        delete req;
+        processCommandQueue(device);
+        return ;
+    }
 
     /*
     * Address command
@@ -271,7 +317,8 @@ void    WSServer::executeRequest(MRequest *req)
                     MRequest* newReq = new MRequest();
                     newReq->owner = ws;
                     newReq->state = RequestState::NEW;
-                    newReq->space = SD2Snes::space::SNES;
+                    newReq->space = req->space;
+                    newReq->flags = req->flags;
                     newReq->timeCreated = QTime::currentTime();
                     newReq->wasPending = false;
                     newReq->opcode = USB2SnesWS::GetAddress;
@@ -372,6 +419,281 @@ void    WSServer::executeRequest(MRequest *req)
         break;
     }
 
+    /*
+     * Watches, the server reads the memory and tells the client when a condition is met
+     */
+    case USB2SnesWS::Watch : {
+        if (req->arguments.size() < 4 || req->arguments.size() > 7)
+        {
+            setError(ErrorType::CommandError, "Watch command take 4 to 7 arguments (Name, AddressInHex, Size, Condition, [ValueInHex], [MaskInHex], [DebounceInHex])");
+            clientError(ws);
+            return ;
+        }
+        bool okAddr, okSize;
+        bool okValue = true;
+        bool okMask = true;
+        bool okDebounce = true;
+        unsigned int addr = req->arguments.at(1).toUInt(&okAddr, 16);
+        unsigned int size = req->arguments.at(2).toUInt(&okSize, 16);
+        MemoryWatcher::Condition condition = MemoryWatcher::CHANGES;
+        bool validCondition = MemoryWatcher::conditionFromString(req->arguments.at(3), condition);
+        quint32 value = req->arguments.size() > 4 ? req->arguments.at(4).toUInt(&okValue, 16) : 0;
+        quint32 mask = req->arguments.size() > 5 ? req->arguments.at(5).toUInt(&okMask, 16) : 0xFFFFFFFF;
+        unsigned int debounce = req->arguments.size() > 6 ? req->arguments.at(6).toUInt(&okDebounce, 16) : 0;
+        if (!okAddr || !okSize || (size != 1 && size != 2 && size != 4) || !validCondition
+                || !okValue || !okMask || !okDebounce || (condition != MemoryWatcher::CHANGES && req->arguments.size() < 5))
+        {
+            setError(ErrorType::CommandError, "Watch : invalid arguments, the size is 1, 2 or 4 and the condition Changes, Equals, Greater or BitSet with a value");
+            clientError(ws);
+            return ;
+        }
+        if (req->space != SD2Snes::space::SNES)
+        {
+            setError(ErrorType::CommandError, "Watch : only the SNES space can be watched");
+            clientError(ws);
+            return ;
+        }
+        memoryWatcher.addWatch(device, ws, req->arguments.at(0), addr, size, condition, value, mask, debounce);
+        scheduleWatchPoll(device);
+        sendReply(ws, req->arguments.at(0));
+        req->state = RequestState::DONE;
+        currentRequests[device] = nullptr;
+        delete req;
+        processCommandQueue(device);
+        return ;
+    }
+    case USB2SnesWS::Unwatch : {
+        memoryWatcher.removeWatches(device, ws, req->arguments.isEmpty() ? QString() : req->arguments.at(0));
+        sendReply(ws, req->arguments);
+        req->state = RequestState::DONE;
+        currentRequests[device] = nullptr;
+        delete req;
+        processCommandQueue(device);
+        return ;
+    }
+
+    /*
+     * Scripts, a Lua script sent by the client runs its tick function on the server, see devicescript.h
+     * ScriptMemoryLimit (in KB) and ScriptInstructionLimit (per tick) in the config are the limits of a script.
+     */
+#ifdef QUSB2SNES_SCRIPTING
+    case USB2SnesWS::ScriptLoad : {
+        if (req->arguments.size() < 2 || req->arguments.size() > 3)
+        {
+            setError(ErrorType::CommandError, "ScriptLoad command take 2 or 3 arguments (Name, Source, [IntervalInHex])");
+            clientError(ws);
+            return ;
+        }
+        bool okInterval = true;
+        int interval = req->arguments.size() > 2 ? req->arguments.at(2).toInt(&okInterval, 16) : 16;
+        const QString& name = req->arguments.at(0);
+        if (!okInterval || interval <= 0)
+        {
+            setError(ErrorType::CommandError, "ScriptLoad : invalid interval");
+            clientError(ws);
+            return ;
+        }
+        if (!scripts.value(ws).contains(name) && scripts.value(ws).size() >= 8)
+        {
+            setError(ErrorType::CommandError, "ScriptLoad : a client can only have 8 scripts");
+            clientError(ws);
+            return ;
+        }
+        size_t memoryLimit = globalSettings->value("ScriptMemoryLimit", 1024).toUInt() * 1024;
+        int instructionLimit = globalSettings->value("ScriptInstructionLimit", 1000000).toInt();
+        QSharedPointer<DeviceScript> script(new DeviceScript(memoryLimit, instructionLimit));
+        if (!script->load(name, req->arguments.at(1).toUtf8()))
+        {
+            setError(ErrorType::CommandError, "ScriptLoad : " + script->errorString());
+            clientError(ws);
+            return ;
+        }
+        ScriptInfos infos;
+        infos.device = device;
+        infos.script = script;
+        infos.interval = interval;
+        scripts[ws][name] = infos;
+        scheduleScriptTick(ws, name);
+        sendReply(ws, name);
+        req->state = RequestState::DONE;
+        currentRequests[device] = nullptr;
+        delete req;
+        processCommandQueue(device);
+        return ;
+    }
+    case USB2SnesWS::ScriptUnload : {
+        if (req->arguments.isEmpty())
+            scripts.remove(ws);
+        else if (scripts.contains(ws))
+            scripts[ws].remove(req->arguments.at(0));
+        sendReply(ws, req->arguments);
+        req->state = RequestState::DONE;
+        currentRequests[device] = nullptr;
+        delete req;
+        processCommandQueue(device);
+        return ;
+    }
+#else
+    case USB2SnesWS::ScriptLoad :
+    case USB2SnesWS::ScriptUnload : {
+        setError(ErrorType::CommandError, "This QUsb2Snes was built without scripting");
+        clientError(ws);
+        return ;
+    }
+#endif
+
+    /*
+     * Atomic operations, a job does the read and the write so nothing can go between them
+     */
+    case USB2SnesWS::AtomicAdd :
+    case USB2SnesWS::AtomicOr :
+    case USB2SnesWS::AtomicAnd :
+    case USB2SnesWS::AtomicXor :
+    case USB2SnesWS::CompareAndSwap : {
+        QString opName = cmdMetaEnum.valueToKey(req->opcode);
+        bool cas = req->opcode == USB2SnesWS::CompareAndSwap;
+        if (req->arguments.size() != (cas ? 4 : 3))
+        {
+            setError(ErrorType::CommandError, opName + (cas ? " command take 4 arguments (AddressInHex, Size, ExpectedInHex, ValueInHex)"
+                                                            : " command take 3 arguments (AddressInHex, Size, ValueInHex)"));
+            clientError(ws);
+            return ;
+        }
+        bool okAddr, okSize, okValue;
+        bool okExpected = true;
+        unsigned int addr = req->arguments.at(0).toUInt(&okAddr, 16);
+        unsigned int size = req->arguments.at(1).toUInt(&okSize, 16);
+        quint32 value = req->arguments.last().toUInt(&okValue, 16);
+        quint32 expected = 0;
+        if (cas)
+            expected = req->arguments.at(2).toUInt(&okExpected, 16);
+        bool validSize = size == 1 || size == 2 || size == 4;
+        quint64 maxValue = validSize ? (Q_UINT64_C(1) << (size * 8)) - 1 : 0;
+        if (!okAddr || !okSize || !okValue || !okExpected || !validSize || value > maxValue || expected > maxValue)
+        {
+            setError(ErrorType::CommandError, opName + " : invalid arguments, the size is 1, 2 or 4 and the values must fit in it");
+            clientError(ws);
+            return ;
+        }
+        DeviceAtomicJob::Operation operation = DeviceAtomicJob::COMPARE_AND_SWAP;
+        if (req->opcode == USB2SnesWS::AtomicAdd)
+            operation = DeviceAtomicJob::ADD;
+        if (req->opcode == USB2SnesWS::AtomicOr)
+            operation = DeviceAtomicJob::OR;
+        if (req->opcode == USB2SnesWS::AtomicAnd)
+            operation = DeviceAtomicJob::AND;
+        if (req->opcode == USB2SnesWS::AtomicXor)
+            operation = DeviceAtomicJob::XOR;
+        DeviceAtomicJob* atomic = new DeviceAtomicJob(this);
+        atomic->setOperation(operation, req->space, addr, size, value, expected);
+        startDeviceJob(req, device, atomic);
+        break;
+    }
+
+    /*
+     * Fence
+     * The device queue is processed in order and a request is only done when all
+     * its data were written, so when we reach the fence everything sent before is done.
+     */
+    case USB2SnesWS::Fence : {
+        sendReply(ws, req->arguments);
+        req->state = RequestState::DONE;
+        sInfo() << "Fence reached - " << *req << "processed in " << req->timeCreated.msecsTo(QTime::currentTime()) << " ms";
+        currentRequests[device] = nullptr;
+        delete req;
+        processCommandQueue(device);
+        return ;
+    }
+
+    /*
+     * Stream
+     */
+    case USB2SnesWS::Stream : {
+        if (req->arguments.size() < 2 || req->arguments.size() > 3)
+        {
+            setError(ErrorType::CommandError, "Stream command take 2 or 3 arguments (AddressInHex, SizeInHex, [IntervalInHex])");
+            clientError(ws);
+            return ;
+        }
+        bool okAddr, okSize;
+        bool okInterval = true;
+        unsigned int address = req->arguments.at(0).toUInt(&okAddr, 16);
+        unsigned int size = req->arguments.at(1).toUInt(&okSize, 16);
+        int interval = req->arguments.size() == 3 ? req->arguments.at(2).toInt(&okInterval, 16) : 0;
+        if (!okAddr || !okSize || !okInterval || interval < 0)
+        {
+            setError(ErrorType::CommandError, "Stream : invalid arguments, the address, size and interval are positive hex numbers");
+            clientError(ws);
+            return ;
+        }
+        if (size == 0)
+        {
+            setError(ErrorType::CommandError, "Stream - trying to read 0 byte");
+            clientError(ws);
+            return ;
+        }
+        if (!req->fromStream)
+        {
+            if (streams.contains(ws))
+            {
+                setError(ErrorType::CommandError, "Stream - a stream is already running for this client");
+                clientError(ws);
+                return ;
+            }
+            StreamInfos si;
+            si.device = device;
+            si.space = req->space;
+            si.address = address;
+            si.size = size;
+            si.interval = interval;
+            si.burst = req->flags.contains("STREAM_BURST") && device->hasStreamCommands();
+            si.timestamp = req->flags.contains("TIMESTAMP");
+            si.stopRequested = false;
+            streams[ws] = si;
+            sDebug() << "Starting a stream on" << device->name() << (si.burst ? "using the device" : "by polling");
+        }
+        streams[ws].frame.clear();
+        if (streams.value(ws).burst)
+        {
+            connect(device, &ADevice::streamDataReceived, this, &WSServer::onDeviceStreamDataReceived, Qt::UniqueConnection);
+            device->streamCommand(req->space, address, size);
+        } else {
+            connect(device, &ADevice::getDataReceived, this, &WSServer::onDeviceGetDataReceived, Qt::UniqueConnection);
+            device->getAddrCommand(req->space, address, size);
+        }
+        req->state = RequestState::WAITINGREPLY;
+        break;
+    }
+
+    /*
+     * Diagnostic
+     */
+    case USB2SnesWS::Benchmark : {
+        if (req->arguments.size() != 0 && req->arguments.size() != 2)
+        {
+            setError(ErrorType::CommandError, "Benchmark command take 0 or 2 arguments (ScratchAddressInHex, ScratchSizeInHex)");
+            clientError(ws);
+            return ;
+        }
+        DeviceBenchmark* bench = new DeviceBenchmark(this);
+        if (req->arguments.size() == 2)
+        {
+            bool okAddr, okSize;
+            unsigned int addr = req->arguments.at(0).toUInt(&okAddr, 16);
+            unsigned int size = req->arguments.at(1).toUInt(&okSize, 16);
+            if (!okAddr || !okSize || size == 0)
+            {
+                delete bench;
+                setError(ErrorType::CommandError, "Benchmark : invalid scratch area");
+                clientError(ws);
+                return ;
+            }
+            bench->setScratchArea(addr, size);
+        }
+        startDeviceJob(req, device, bench);
+        break;
+    }
+
     /*
      * PutIPS
     */
@@ -383,9 +705,30 @@ void    WSServer::executeRequest(MRequest *req)
             return ;
         }
         bool    ok;
-        req->state = RequestState::WAITINGREPLY;
-        wsInfos[ws].commandState = ClientCommandState::WAITINGBDATAREPLY;
-        wsInfos[ws].ipsSize = req->arguments.at(1).toUInt(&ok, 16);
+        unsigned int patchSize = req->arguments.at(1).toUInt(&ok, 16);
+        if (!ok || patchSize == 0)
+        {
+            setError(ErrorType::CommandError, "PutIPS : invalid patch size");
+            clientError(ws);
+            return ;
+        }
+        PatchJob* patch = new PatchJob(patchSize, req->arguments.at(0) == "hook", this);
+        WSInfos& wInfos = wsInfos[ws];
+        wInfos.commandState = ClientCommandState::WAITINGBDATAREPLY;
+        wInfos.patchJob = patch;
+        startDeviceJob(req, device, patch);
+        // The patch data sent while the request was queued are waiting in recvData,
+        // the rest goes to the job as it arrives so it's no longer expected
+        if (req->wasPending)
+        {
+            QByteArray queued = wInfos.recvData.left(static_cast<int>(patchSize));
+            wInfos.recvData.remove(0, queued.size());
+            wInfos.expectedDataSize -= patchSize;
+            if (!queued.isEmpty())
+                patch->feed(queued);
+            if (patch->patchReceived())
+                wInfos.patchJob = nullptr;
+        }
         break;
     }
     default:
@@ -417,14 +760,14 @@ void    WSServer::executeRequest(MRequest *req)
             wsInfos[ws].recvData.remove(0, wsInfos[ws].currentPutSize);
             wsInfos[ws].expectedDataSize -= wsInfos[ws].currentPutSize;
             wsInfos[ws].currentPutSize = 0;
-            device->writeData(toSend);
+            writeDeviceData(device, toSend);
             wsInfos[ws].commandState = ClientCommandState::WAITINGREPLY;
 
         } else {
             if (!wsInfos[ws].recvData.isEmpty() && wsInfos[ws].recvData.size() < wsInfos[ws].currentPutSize)
             {
                 sDebug() << "We have SOME data for the queued command " << wsInfos[ws].expectedDataSize;
-                device->writeData(wsInfos[ws].recvData);
+                writeDeviceData(device, wsInfos[ws].recvData);
                 wsInfos[ws].expectedDataSize -= wsInfos[ws].recvData.size();
                 wsInfos[ws].currentPutSize -= wsInfos[ws].recvData.size();
                 wsInfos[ws].recvData.clear();
@@ -479,8 +822,11 @@ void    WSServer::processDeviceCommandFinished(ADevice* device)
     }
     case USB2SnesWS::Rename :
     case USB2SnesWS::Remove :
-    case USB2SnesWS::MakeDir :
     case USB2SnesWS::PutFile :
+        updatePutFileManifest(device, currentRequests.value(device));
+        sendReplyV2(info.currentWS, "");
+        break;
+    case USB2SnesWS::MakeDir :
     case USB2SnesWS::PutAddress :
     case USB2SnesWS::Menu :
     case USB2SnesWS::Reset :
@@ -493,6 +839,46 @@ void    WSServer::processDeviceCommandFinished(ADevice* device)
     {
         disconnect(device, &ADevice::getDataReceived, this, &WSServer::onDeviceGetDataReceived);
         //disconnect(device, SIGNAL(sizeGet(uint)), this, SLOT(onDeviceSizeGet(uint)));
+        // The watches don't need to read what the client just did
+        // A split request only read its first range, the data stop before the next ones
+        MRequest* req = currentRequests.value(device);
+        if (req != nullptr && !req->readData.isEmpty())
+        {
+            bool ok;
+            int pos = 0;
+            for (int i = 0; i + 1 < req->arguments.size(); i += 2)
+            {
+                int size = static_cast<int>(req->arguments.at(i + 1).toUInt(&ok, 16));
+                if (pos + size > req->readData.size())
+                    break;
+                updateWatches(device, req->arguments.at(i).toUInt(&ok, 16), req->readData.mid(pos, size));
+                pos += size;
+            }
+        }
+        break;
+    }
+    case USB2SnesWS::Stream :
+    {
+        QWebSocket* ws = info.currentWS;
+        disconnect(device, &ADevice::getDataReceived, this, &WSServer::onDeviceGetDataReceived);
+        disconnect(device, &ADevice::streamDataReceived, this, &WSServer::onDeviceStreamDataReceived);
+        if (!streams.contains(ws))
+            break;
+        // The device stop streaming only when we ask for it
+        if (streams.value(ws).burst || streams.value(ws).stopRequested)
+        {
+            streams.remove(ws);
+            sendReply(ws, QStringList());
+            break;
+        }
+        // The watches don't need to read what the stream just did
+        if (streams.value(ws).space == SD2Snes::space::SNES)
+            updateWatches(device, streams.value(ws).address, streams.value(ws).frame);
+        if (streams.value(ws).timestamp)
+            streams[ws].frame.prepend(timestampHeader(device));
+        ws->sendBinaryMessage(streams.value(ws).frame);
+        streams[ws].frame.clear();
+        scheduleStreamRead(ws);
         break;
     }
     default:
@@ -574,16 +960,52 @@ void    WSServer::onNewDeviceName(QString name)
     deviceList.append(name);
 }
 
-void WSServer::cmdAttach(MRequest *req)
+/*
+ * Factories that watch their devices in the background tell when one comes or goes,
+ * a device list being built is fixed and the clients that asked for it get an event.
+ */
+
+void    WSServer::onDeviceAppeared(QString name)
+{
+    sInfo() << "Device appeared" << name;
+    if (pendingDeviceListQuery != 0 && !deviceList.contains(name))
+        deviceList.append(name);
+    QJsonObject jEvent;
+    jEvent["DeviceAppeared"] = name;
+    for (auto it = wsInfos.cbegin(); it != wsInfos.cend(); ++it)
+    {
+        if (it.value().deviceEvents)
+            sendEvent(it.key(), jEvent);
+    }
+}
+
+void    WSServer::onDeviceDisappeared(QString name)
+{
+    sInfo() << "Device disappeared" << name;
+    if (pendingDeviceListQuery != 0)
+        deviceList.removeAll(name);
+    QJsonObject jEvent;
+    jEvent["DeviceDisappeared"] = name;
+    for (auto it = wsInfos.cbegin(); it != wsInfos.cend(); ++it)
+    {
+        if (it.value().deviceEvents)
+            sendEvent(it.key(), jEvent);
+    }
+}
+
+/*
+ * Find the device in the factories, open it and make it known to the server
+ * Return nullptr and set the error if it fails
+ */
+
+ADevice*    WSServer::openDevice(const QString& deviceName)
 {
-    QString deviceToAttach = req->arguments.at(0);
-    wsInfos[req->owner].pendingAttach = true;
     ADevice* devGet = nullptr;
 
     foreach (DeviceFactory* devFact, deviceFactories)
     {
         sDebug() << devFact->name();
-        devGet = devFact->attach(deviceToAttach);
+        devGet = devFact->attach(deviceName);
         if (devGet != nullptr)
         {
             mapDevFact[devGet] = devFact;
@@ -591,72 +1013,279 @@ void WSServer::cmdAttach(MRequest *req)
         }
         if (!devFact->attachError().isEmpty())
         {
-            setError(ErrorType::CommandError, "Attach Error with " + deviceToAttach + " - " + devFact->attachError());
-            clientError(req->owner);
-            return ;
+            setError(ErrorType::CommandError, "Attach Error with " + deviceName + " - " + devFact->attachError());
+            return nullptr;
         }
     }
-    if (devGet != nullptr)
+    if (devGet == nullptr)
     {
-        sDebug() << "Found device" << devGet->name() << "from" << mapDevFact[devGet]->name() << "State : " << devGet->state();
-        sDebug() << "Attaching " << wsInfos.value(req->owner).name <<  " to " << deviceToAttach;
-        if (devGet->state() == ADevice::State::CLOSED)
+        setError(ErrorType::CommandError, "Trying to Attach to an unknow device");
+        return nullptr;
+    }
+    sDebug() << "Found device" << devGet->name() << "from" << mapDevFact[devGet]->name() << "State : " << devGet->state();
+    if (devGet->state() == ADevice::State::CLOSED)
+    {
+        sDebug() << "Trying to open device";
+        if (!devGet->open())
         {
-            sDebug() << "Trying to open device";
-            if (!devGet->open())
-            {
-                setError(ErrorType::CommandError, "Attach: Can't open the device on " + deviceToAttach);
-                clientError(req->owner);
-                return;
-            }
+            setError(ErrorType::CommandError, "Attach: Can't open the device on " + deviceName);
+            return nullptr;
         }
-        if (!devices.contains(devGet))
-            addDevice(devGet);
-        wsInfos[req->owner].attached = true;
-        wsInfos[req->owner].attachedTo = devGet;
-        wsInfos[req->owner].pendingAttach = false;
-        sendReplyV2(req->owner, devGet->name());
-        if (devGet->state() == ADevice::READY)
-            processCommandQueue(devGet);
-        return ;
-    } else {
-        setError(ErrorType::CommandError, "Trying to Attach to an unknow device");
+    }
+    if (!devices.contains(devGet))
+        addDevice(devGet);
+    if (devGet->hasFileCommands() && !devicesInfos.value(devGet).identityQueried)
+        queryCartIdentity(devGet);
+    return devGet;
+}
+
+void WSServer::cmdAttach(MRequest *req)
+{
+    QString deviceToAttach = req->arguments.at(0);
+    wsInfos[req->owner].pendingAttach = true;
+    ADevice* devGet = openDevice(deviceToAttach);
+    if (devGet == nullptr)
+    {
         clientError(req->owner);
         return ;
     }
+    sDebug() << "Attaching " << wsInfos.value(req->owner).name <<  " to " << deviceToAttach;
+    wsInfos[req->owner].attached = true;
+    wsInfos[req->owner].attachedTo = devGet;
+    wsInfos[req->owner].pendingAttach = false;
+    sendReplyV2(req->owner, devGet->name());
+    if (devGet->state() == ADevice::READY)
+        processCommandQueue(devGet);
+}
+
+/*
+ * Data from the client for a put command, PutFile data are hashed for the manifest
+ * before being written since the device can finish the command right away
+ */
+
+void    WSServer::writeDeviceData(ADevice* device, const QByteArray& data)
+{
+    if (devicesInfos.value(device).currentCommand == USB2SnesWS::PutFile)
+        putFileManifest.addUploadData(manifestDevice(device), data);
+    device->writeData(data);
+}
+
+void    WSServer::updatePutFileManifest(ADevice* device, MRequest* req)
+{
+    if (req == nullptr)
+        return ;
+    switch (req->opcode)
+    {
+    case USB2SnesWS::PutFile :
+        putFileManifest.finishUpload(manifestDevice(device));
+        break;
+    case USB2SnesWS::Remove :
+        putFileManifest.remove(manifestDevice(device), req->arguments.at(0));
+        break;
+    case USB2SnesWS::Rename :
+    {
+        // The new name can be only a file name, in the same directory
+        QString newPath = req->arguments.at(1);
+        if (!newPath.contains('/'))
+            newPath = QFileInfo(QDir::cleanPath("/" + req->arguments.at(0))).path() + "/" + newPath;
+        putFileManifest.rename(manifestDevice(device), req->arguments.at(0), newPath);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/*
+ * The port of a device can be used by another cart later, the manifest
+ * also knows the device by its model and firmware.
+ */
+
+QString WSServer::manifestDevice(ADevice* device) const
+{
+    return device->name() + " - " + devicesInfos.value(device).cartIdentity;
+}
+
+void    WSServer::queryCartIdentity(ADevice* device)
+{
+    DeviceInfoJob* job = new DeviceInfoJob(this);
+    connect(job, &DeviceJob::finished, this, &WSServer::onCartIdentityDone);
+    if (queueDeviceJob(device, job, USB2SnesWS::Info))
+        devicesInfos[device].identityQueried = true;
+    else
+        delete job;
+}
+
+void    WSServer::onCartIdentityDone()
+{
+    DeviceInfoJob* job = qobject_cast<DeviceInfoJob*>(sender());
+    ADevice* device = deviceRunningJob(job);
+    if (device == nullptr || job->results().size() < 2)
+        return ;
+    devicesInfos[device].cartIdentity = job->results().at(1) + " " + job->results().at(0);
+    sDebug() << device->name() << "is" << devicesInfos.value(device).cartIdentity;
+}
+
+/*
+ * Device jobs, the request stay the current one of the device until the job is done
+ */
+
+void    WSServer::startDeviceJob(MRequest* req, ADevice* device, DeviceJob* job)
+{
+    req->job = job;
+    req->state = RequestState::WAITINGREPLY;
+    connect(job, &DeviceJob::finished, this, &WSServer::onDeviceJobFinished);
+    connect(job, &DeviceJob::failed, this, &WSServer::onDeviceJobFailed);
+    job->start(device);
+}
+
+/*
+ * A job queued by something else than a websocket client (like the NWA server)
+ * The request has no owner, the caller gets the results from the job signals
+ */
+
+bool    WSServer::queueDeviceJob(ADevice* device, DeviceJob* job, USB2SnesWS::opcode opcode)
+{
+    if (!devices.contains(device))
+        return false;
+    MRequest* req = new MRequest();
+    req->owner = nullptr;
+    req->opcode = opcode;
+    req->space = SD2Snes::space::SNES;
+    req->state = RequestState::NEW;
+    req->timeCreated = QTime::currentTime();
+    req->job = job;
+    pendingRequests[device].append(req);
+    sDebug() << device->name() << "Adding job in queue " << *req << "(" << pendingRequests[device].size() << ")";
+    if (device->state() == ADevice::READY && currentRequests.value(device) == nullptr)
+        processCommandQueue(device);
+    return true;
+}
+
+ADevice*    WSServer::deviceRunningJob(DeviceJob* job) const
+{
+    QMapIterator<ADevice*, MRequest*> it(currentRequests);
+    while (it.hasNext())
+    {
+        it.next();
+        if (it.value() != nullptr && it.value()->job == job)
+            return it.key();
+    }
+    return nullptr;
 }
 
-void    WSServer::processIpsData(QWebSocket* ws)
+void    WSServer::onDeviceJobFinished()
 {
-    sDebug() << "processing IPS data";
-    WSInfos& infos = wsInfos[ws];
-    MRequest* ipsReq = currentRequests[infos.attachedTo];
-    QList<IPSReccord>  ipsReccords = parseIPSData(infos.ipsData);
+    DeviceJob* job = qobject_cast<DeviceJob*>(sender());
+    ADevice* device = deviceRunningJob(job);
+    job->deleteLater();
+    if (device == nullptr)
+        return ;
+    MRequest* req = currentRequests.value(device);
+    if (req->owner != nullptr)
+    {
+        // Like the put commands, a patch only gets a reply with the v2 protocol
+        if (req->opcode == USB2SnesWS::PutIPS)
+            sendReplyV2(req->owner, "");
+        else
+            sendReply(req->owner, job->results());
+    }
+    if (req->opcode == USB2SnesWS::CheckFile)
+    {
+        if (job->results().value(0) == "Match")
+            putFileManifest.setVerified(manifestDevice(device), req->arguments.at(0));
+        else
+            putFileManifest.remove(manifestDevice(device), req->arguments.at(0));
+    }
+    req->state = RequestState::DONE;
+    sInfo() << "Device job finished - " << *req << "processed in " << req->timeCreated.msecsTo(QTime::currentTime()) << " ms";
+    currentRequests[device] = nullptr;
+    delete req;
+    processCommandQueue(device);
+}
+
+void    WSServer::onDeviceJobFailed()
+{
+    DeviceJob* job = qobject_cast<DeviceJob*>(sender());
+    ADevice* device = deviceRunningJob(job);
+    job->deleteLater();
+    if (device == nullptr)
+        return ;
+    MRequest* req = currentRequests.value(device);
+    QWebSocket* ws = req->owner;
+    sInfo() << "Device job failed - " << *req << job->errorString();
+    // A patch can fail before all its data are there
+    if (ws != nullptr && wsInfos.value(ws).patchJob == job)
+        wsInfos[ws].patchJob = nullptr;
+    currentRequests[device] = nullptr;
+    // A late answer of the device is for nobody
+    devicesInfos[device].currentWS = nullptr;
+    delete req;
+    if (ws != nullptr)
+    {
+        setError(ErrorType::DeviceError, job->errorString());
+        clientError(ws);
+    }
+    if (devices.contains(device) && device->state() == ADevice::READY)
+        processCommandQueue(device);
+}
 
-    // Creating new PutAddress requests
-    int cpt = 0;
-    sDebug() << "Creating " << ipsReccords.size() << "PutRequests";
-    foreach(IPSReccord ipsr, ipsReccords)
+/*
+ * Stream stuff
+ * A polling stream is a chain of Stream requests the server put in the device queue
+ * on behalf of the client, the client only get the frames.
+ */
+
+void    WSServer::cmdStopStream(MRequest* req)
+{
+    QWebSocket* ws = req->owner;
+    sDebug() << "Stopping stream for" << wsInfos.value(ws).name;
+    delete req;
+    if (!streams.contains(ws))
     {
+        sendReply(ws, QStringList());
+        return ;
+    }
+    ADevice* device = streams.value(ws).device;
+    QMutableListIterator<MRequest*> it(pendingRequests[device]);
+    while (it.hasNext())
+    {
+        MRequest* mReq = it.next();
+        if (mReq->owner == ws && mReq->opcode == USB2SnesWS::Stream)
+        {
+            it.remove();
+            delete mReq;
+        }
+    }
+    MRequest* current = currentRequests.value(device);
+    // The reply will be sent when the running read is done
+    if (current != nullptr && current->owner == ws && current->opcode == USB2SnesWS::Stream)
+    {
+        streams[ws].stopRequested = true;
+        if (streams.value(ws).burst)
+            device->stopStreamCommand();
+        return ;
+    }
+    streams.remove(ws);
+    sendReply(ws, QStringList());
+}
+
+void    WSServer::scheduleStreamRead(QWebSocket* ws)
+{
+    QTimer::singleShot(streams.value(ws).interval, this, [=] {
+        if (!streams.contains(ws) || streams.value(ws).stopRequested)
+            return ;
+        const StreamInfos& si = streams[ws];
         MRequest* newReq = new MRequest();
         newReq->owner = ws;
         newReq->state = RequestState::NEW;
-        newReq->space = SD2Snes::space::SNES;
+        newReq->space = si.space;
         newReq->timeCreated = QTime::currentTime();
-        newReq->wasPending = false;
-        newReq->opcode = USB2SnesWS::PutAddress;
-        // Special stuff for patch that install stuff in the NMI of sd2snes
-        if (cpt == 0 && ipsReq->arguments.at(0) == "hook")
-            newReq->flags << "CLRX";
-        if (cpt == (ipsReccords.size() - 1) && ipsReq->arguments.at(0) == "hook")
-            newReq->flags << "SETX";
-        newReq->arguments << QString::number(ipsr.offset, 16) << QString::number(ipsr.size, 16);
-
-        pendingRequests[infos.attachedTo].append(newReq);
-        infos.recvData.append(ipsr.data);
-        //sDebug() << "IPS:" <<  QString::number(ipsr.offset, 16) << ipsr.data.toHex();
-        cpt++;
-    }
-    infos.ipsData.clear();
-    processCommandQueue(infos.attachedTo);
+        newReq->opcode = USB2SnesWS::Stream;
+        newReq->fromStream = true;
+        newReq->arguments << QString::number(si.address, 16) << QString::number(si.size, 16);
+        pendingRequests[si.device].append(newReq);
+        if (si.device->state() == ADevice::READY && currentRequests.value(si.device) == nullptr)
+            processCommandQueue(si.device);
+    });
 }